@@ -0,0 +1,594 @@
+/* 8051 emulator
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * batch.c
+ * Headless batch front-end; runs firmware to a stop condition and dumps
+ * the final state. Does not use curses, so it can run from scripts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+enum STOP_REASONS
+{
+    STOP_NONE = 0,
+    STOP_PC,        // program counter reached the -pc address
+    STOP_CYCLES,    // cycle budget ran out
+    STOP_SFR,       // firmware wrote the -exitsfr register
+    STOP_EXCEPTION, // an enabled exception occurred
+    STOP_COMPARE    // the run differed from the -compare trace
+};
+
+// per-emulator run state; hangs off em8051::mContext
+struct batch
+{
+    int stopreason;
+    int stopvalue;
+
+    // -1 if not in use
+    int stop_pc;
+    int exit_sfr;
+
+    int opt_exception_iret_sp;
+    int opt_exception_iret_acc;
+    int opt_exception_iret_psw;
+    int opt_exception_acc_to_a;
+    int opt_exception_stack;
+    int opt_exception_invalid;
+};
+
+static const char *exception_names[] =
+{
+    "stack",
+    "acc-to-a move",
+    "psw not preserved over interrupt call",
+    "sp not preserved over interrupt call",
+    "acc not preserved over interrupt call",
+    "illegal opcode"
+};
+
+static void batch_init(struct batch *aBatch)
+{
+    aBatch->stopreason = STOP_NONE;
+    aBatch->stopvalue = 0;
+    aBatch->stop_pc = -1;
+    aBatch->exit_sfr = -1;
+    aBatch->opt_exception_iret_sp = 1;
+    aBatch->opt_exception_iret_acc = 1;
+    aBatch->opt_exception_iret_psw = 1;
+    aBatch->opt_exception_acc_to_a = 1;
+    aBatch->opt_exception_stack = 1;
+    aBatch->opt_exception_invalid = 1;
+}
+
+static void batch_exception(struct em8051 *aCPU, int aCode)
+{
+    struct batch *b = aCPU->mContext;
+    switch (aCode)
+    {
+    case EXCEPTION_IRET_SP_MISMATCH:
+        if (!b->opt_exception_iret_sp) return;
+        break;
+    case EXCEPTION_IRET_ACC_MISMATCH:
+        if (!b->opt_exception_iret_acc) return;
+        break;
+    case EXCEPTION_IRET_PSW_MISMATCH:
+        if (!b->opt_exception_iret_psw) return;
+        break;
+    case EXCEPTION_ACC_TO_A:
+        if (!b->opt_exception_acc_to_a) return;
+        break;
+    case EXCEPTION_STACK:
+        if (!b->opt_exception_stack) return;
+        break;
+    case EXCEPTION_ILLEGAL_OPCODE:
+        if (!b->opt_exception_invalid) return;
+        break;
+    }
+    // only report the first one
+    if (b->stopreason == STOP_NONE)
+    {
+        b->stopreason = STOP_EXCEPTION;
+        b->stopvalue = aCode;
+        aCPU->mStop = 1;
+    }
+}
+
+static void batch_sfrwrite(struct em8051 *aCPU, int aRegister)
+{
+    struct batch *b = aCPU->mContext;
+    if (aRegister == b->exit_sfr && b->stopreason == STOP_NONE)
+    {
+        b->stopreason = STOP_SFR;
+        b->stopvalue = aCPU->mSFR[aRegister - 0x80];
+        aCPU->mStop = 1;
+    }
+}
+
+static void dump_area(const char *aTitle, unsigned char *aMem, int aSize, int aBase)
+{
+    int i;
+    printf("%s:\n", aTitle);
+    for (i = 0; i < aSize; i++)
+    {
+        if ((i & 15) == 0)
+            printf("%04X", i + aBase);
+        printf(" %02X", aMem[i]);
+        if ((i & 15) == 15)
+            printf("\n");
+    }
+}
+
+static void dump_registers(struct em8051 *aCPU)
+{
+    int rx = 8 * ((aCPU->mSFR[REG_PSW] & (PSW_RS0_MASK|PSW_RS1_MASK))>>PSW_RS0);
+    int i;
+
+    printf("PC: %04X  A: %02X  B: %02X  PSW: %02X  SP: %02X  DPTR: %04X\n",
+        aCPU->mPC & 0xffff,
+        aCPU->mSFR[REG_ACC],
+        aCPU->mSFR[REG_B],
+        aCPU->mSFR[REG_PSW],
+        aCPU->mSFR[REG_SP],
+        (aCPU->mSFR[REG_DPH] << 8) | aCPU->mSFR[REG_DPL]);
+    printf("R0-R7:");
+    for (i = 0; i < 8; i++)
+        printf(" %02X", aCPU->mLowerData[rx + i]);
+    printf("\n");
+    printf("P0: %02X  P1: %02X  P2: %02X  P3: %02X  TMOD: %02X  TCON: %02X  IEN0: %02X\n",
+        aCPU->mSFR[REG_P0],
+        aCPU->mSFR[REG_P1],
+        aCPU->mSFR[REG_P2],
+        aCPU->mSFR[REG_P3],
+        aCPU->mSFR[REG_TMOD],
+        aCPU->mSFR[REG_TCON],
+        aCPU->mSFR[REG_IEN0]);
+    printf("TH0: %02X  TL0: %02X  TH1: %02X  TL1: %02X\n",
+        aCPU->mSFR[REG_TH0],
+        aCPU->mSFR[REG_TL0],
+        aCPU->mSFR[REG_TH1],
+        aCPU->mSFR[REG_TL1]);
+}
+
+static int save_ext(struct em8051 *aCPU, char *aFilename)
+{
+    FILE *f;
+    f = fopen(aFilename, "wb");
+    if (!f) return -1;
+    fwrite(aCPU->mExtData, aCPU->mExtDataSize, 1, f);
+    fclose(f);
+    return 0;
+}
+
+int main(int parc, char ** pars)
+{
+    struct em8051 emu;
+    struct batch batch;
+    struct batch *b = &batch;
+    int i;
+    unsigned long long cycles = 0;
+    unsigned long long maxcycles = 0;
+    int dumpmem = 0;
+    char *xdump = NULL;
+    char *xload = NULL;
+    char *hexfile = NULL;
+    char *loadstate = NULL;
+    char *savestate = NULL;
+    char *tracefile = NULL;
+    char *comparefile = NULL;
+    char *profilefile = NULL;
+    char *stacksfile = NULL;
+    char *coveragefile = NULL;
+    struct em8051coverage *coverage = NULL;
+    struct em8051profile *profile = NULL;
+    struct em8051trace *trace = NULL;
+    struct em8051tracerecord expected;
+    struct em8051tracerecord actual;
+    char line[160];
+
+    batch_init(b);
+
+    memset(&emu, 0, sizeof(emu));
+    emu.mCodeMem     = malloc(65536);
+    emu.mCodeMemSize = 65536;
+    emu.mExtData     = malloc(65536);
+    emu.mExtDataSize = 65536;
+    emu.mLowerData   = malloc(128);
+    emu.mUpperData   = malloc(128);
+    emu.mSFR         = malloc(128);
+    emu.mDecoded     = calloc(65536, sizeof(struct em8051decoded));
+    emu.except       = &batch_exception;
+    emu.sfrread      = NULL;
+    emu.sfrwrite     = &batch_sfrwrite;
+    emu.xread = NULL;
+    emu.xwrite = NULL;
+    emu.mContext = b;
+    reset(&emu, 1);
+
+    for (i = 1; i < parc; i++)
+    {
+        if (pars[i][0] == '-')
+        {
+            if (strncmp("pc=",pars[i]+1,3) == 0)
+            {
+                b->stop_pc = strtol(pars[i]+4, NULL, 16) & 0xffff;
+            }
+            else
+            if (strncmp("cycles=",pars[i]+1,7) == 0)
+            {
+                maxcycles = strtoull(pars[i]+8, NULL, 10);
+            }
+            else
+            if (strncmp("exitsfr=",pars[i]+1,8) == 0)
+            {
+                b->exit_sfr = strtol(pars[i]+9, NULL, 16);
+                if (b->exit_sfr < 0x80 || b->exit_sfr > 0xff)
+                {
+                    printf("SFR address must be between 80 and FF\n");
+                    return -1;
+                }
+            }
+            else
+            if (strcmp("dumpmem",pars[i]+1) == 0)
+            {
+                dumpmem = 1;
+            }
+            else
+            if (strncmp("xdump=",pars[i]+1,6) == 0)
+            {
+                xdump = pars[i]+7;
+            }
+            else
+            if (strncmp("xload=",pars[i]+1,6) == 0)
+            {
+                xload = pars[i]+7;
+            }
+            else
+            if (strncmp("loadstate=",pars[i]+1,10) == 0)
+            {
+                loadstate = pars[i]+11;
+            }
+            else
+            if (strncmp("savestate=",pars[i]+1,10) == 0)
+            {
+                savestate = pars[i]+11;
+            }
+            else
+            if (strncmp("trace=",pars[i]+1,6) == 0)
+            {
+                tracefile = pars[i]+7;
+            }
+            else
+            if (strncmp("compare=",pars[i]+1,8) == 0)
+            {
+                comparefile = pars[i]+9;
+            }
+            else
+            if (strncmp("profile=",pars[i]+1,8) == 0)
+            {
+                profilefile = pars[i]+9;
+            }
+            else
+            if (strncmp("stacks=",pars[i]+1,7) == 0)
+            {
+                stacksfile = pars[i]+8;
+            }
+            else
+            if (strncmp("coverage=",pars[i]+1,9) == 0)
+            {
+                coveragefile = pars[i]+10;
+            }
+            else
+            if (strcmp("jit",pars[i]+1) == 0)
+            {
+                emu.mJit = jit_create(&emu);
+                if (!emu.mJit)
+                    printf("Translator not available on this host; interpreting\n");
+            }
+            else
+            if (strcmp("noexc_iret_sp",pars[i]+1) == 0 || strcmp("nosp",pars[i]+1) == 0)
+            {
+                b->opt_exception_iret_sp = 0;
+            }
+            else
+            if (strcmp("noexc_iret_acc",pars[i]+1) == 0 || strcmp("noacc",pars[i]+1) == 0)
+            {
+                b->opt_exception_iret_acc = 0;
+            }
+            else
+            if (strcmp("noexc_iret_psw",pars[i]+1) == 0 || strcmp("nopsw",pars[i]+1) == 0)
+            {
+                b->opt_exception_iret_psw = 0;
+            }
+            else
+            if (strcmp("noexc_acc_to_a",pars[i]+1) == 0 || strcmp("noaa",pars[i]+1) == 0)
+            {
+                b->opt_exception_acc_to_a = 0;
+            }
+            else
+            if (strcmp("noexc_stack",pars[i]+1) == 0 || strcmp("nostk",pars[i]+1) == 0)
+            {
+                b->opt_exception_stack = 0;
+            }
+            else
+            if (strcmp("noexc_invalid_op",pars[i]+1) == 0 || strcmp("noiop",pars[i]+1) == 0)
+            {
+                b->opt_exception_invalid = 0;
+            }
+            else
+            {
+                printf("Help:\n\n"
+                    "emu8051-batch [options] [filename]\n\n"
+                    "Runs the intel hex file until a stop condition is met and dumps the\n"
+                    "final state. Available options:\n\n"
+                    "Option            Alternate   description\n"
+                    "-pc=addr                      Stop when PC reaches addr (hex)\n"
+                    "-cycles=count                 Stop after count machine cycles\n"
+                    "-exitsfr=addr                 Stop when SFR at addr (hex) is written\n"
+                    "-dumpmem                      Dump internal RAM and SFRs on exit\n"
+                    "-xload=file                   Load external memory from file\n"
+                    "-xdump=file                   Save external memory to file on exit\n"
+                    "-loadstate=file               Start from a snapshot instead of reset state\n"
+                    "-savestate=file               Save a snapshot of the machine on exit\n"
+                    "-trace=file                   Write a binary trace of every operation\n"
+                    "                              (read with emu8051-tracedump)\n"
+                    "-compare=file                 Compare the run with a trace written by\n"
+                    "                              -trace, and stop where they differ\n"
+                    "-profile=file                 Write the operations and cycles spent per\n"
+                    "                              opcode, per function and per address to file\n"
+                    "-stacks=file                  Write the cycles spent per call stack to\n"
+                    "                              file, in the collapsed format flame graph\n"
+                    "                              tools read\n"
+                    "-coverage=file                Add the code addresses run and the ways\n"
+                    "                              conditional jumps went to file (read with\n"
+                    "                              emu8051-cover)\n"
+                    "-jit                          Translate code to native code, if possible\n"
+                    "-noexc_iret_sp    -nosp       Disable sp iret exception\n"
+                    "-noexc_iret_acc   -noacc      Disable acc iret exception\n"
+                    "-noexc_iret_psw   -nopsw      Disable psw iret exception\n"
+                    "-noexc_acc_to_a   -noaa       Disable acc-to-a invalid instruction exception\n"
+                    "-noexc_stack      -nostk      Disable stack abnormal behaviour exception\n"
+                    "-noexc_invalid_op -noiop      Disable invalid opcode exception\n\n"
+                    "Exit code is 0 when stopped by -pc or -exitsfr, 1 when the cycle\n"
+                    "budget ran out, 2 on exceptions and 3 when -compare found a difference.\n"
+                    );
+                return -1;
+            }
+        }
+        else
+        {
+            hexfile = pars[i];
+        }
+    }
+
+    if (hexfile == NULL && loadstate == NULL)
+    {
+        printf("No file given; try emu8051-batch -help\n");
+        return -1;
+    }
+
+    if (hexfile && load_obj(&emu, hexfile) != 0)
+    {
+        printf("File '%s' load failure\n", hexfile);
+        return -1;
+    }
+
+    if (xload && load_mem(&emu, xload) != 0)
+    {
+        printf("File '%s' load failure\n", xload);
+        return -1;
+    }
+
+    // the snapshot brings its own memory, replacing any hex or -xload file
+    if (loadstate && em8051_load_state(&emu, loadstate, NULL, 0) != 0)
+    {
+        printf("File '%s' load failure\n", loadstate);
+        return -1;
+    }
+
+    if (b->stop_pc == -1 && b->exit_sfr == -1 && maxcycles == 0)
+    {
+        printf("No stop condition given; try emu8051-batch -help\n");
+        return -1;
+    }
+
+    if ((tracefile != NULL) + (comparefile != NULL) + (profilefile != NULL || stacksfile != NULL) +
+        (coveragefile != NULL) > 1)
+    {
+        printf("Only one of -trace, -compare, -profile or -stacks and -coverage can be used at a time\n");
+        return -1;
+    }
+
+    if (tracefile)
+    {
+        trace = trace_create(tracefile);
+        if (!trace)
+        {
+            printf("File '%s' save failure\n", tracefile);
+            return -1;
+        }
+    }
+
+    if (profilefile || stacksfile)
+    {
+        profile = profile_create();
+        if (!profile)
+        {
+            printf("Out of memory\n");
+            return -1;
+        }
+    }
+
+    // runs add up in the file
+    if (coveragefile)
+    {
+        coverage = calloc(1, sizeof(struct em8051coverage));
+        if (!coverage)
+        {
+            printf("Out of memory\n");
+            return -1;
+        }
+        if (coverage_load(coverage, coveragefile) == -2)
+        {
+            printf("File '%s' is not a coverage file\n", coveragefile);
+            return -1;
+        }
+    }
+
+    // the reference is read as the run goes, a buffer at a time
+    if (comparefile)
+    {
+        trace = trace_open(comparefile);
+        if (!trace)
+        {
+            printf("File '%s' is not a trace\n", comparefile);
+            return -1;
+        }
+    }
+
+    while (b->stopreason == STOP_NONE)
+    {
+        int chunk = 0x40000000;
+        if (maxcycles)
+        {
+            if (cycles == maxcycles)
+            {
+                b->stopreason = STOP_CYCLES;
+                break;
+            }
+            if (maxcycles - cycles < (unsigned long long)chunk)
+                chunk = maxcycles - cycles;
+        }
+        if (trace)
+            cycles += trace_run(&emu, trace, chunk, b->stop_pc);
+        else if (profile)
+            cycles += profile_run(&emu, profile, chunk, b->stop_pc);
+        else if (coverage)
+            cycles += coverage_run(&emu, coverage, chunk, b->stop_pc);
+        else
+            cycles += run_cycles(&emu, chunk, b->stop_pc);
+        if (comparefile && trace_status(trace, NULL, NULL) != TRACE_MATCH && b->stopreason == STOP_NONE)
+        {
+            b->stopreason = STOP_COMPARE;
+        }
+        // callbacks set their own reason; otherwise it was the breakpoint
+        if (emu.mStop && b->stopreason == STOP_NONE)
+        {
+            b->stopreason = STOP_PC;
+        }
+    }
+
+    // bring the timer registers up to date for the dumps
+    timer_sync(&emu);
+
+    switch (b->stopreason)
+    {
+    case STOP_PC:
+        printf("Stop: PC reached %04X\n", b->stop_pc);
+        break;
+    case STOP_CYCLES:
+        printf("Stop: cycle budget exhausted\n");
+        break;
+    case STOP_SFR:
+        printf("Stop: SFR %02X written, value %02X\n", b->exit_sfr, b->stopvalue);
+        break;
+    case STOP_EXCEPTION:
+        printf("Stop: exception: %s\n", exception_names[b->stopvalue]);
+        break;
+    case STOP_COMPARE:
+        switch (trace_status(trace, &expected, &actual))
+        {
+        case TRACE_DIVERGED:
+            printf("Stop: run differs from '%s'\n", comparefile);
+            trace_format(&emu, &expected, line);
+            printf("Expected: %s\n", line);
+            break;
+        case TRACE_ENDED:
+            printf("Stop: run went on after '%s' ended\n", comparefile);
+            break;
+        default:
+            printf("Stop: file '%s' is damaged\n", comparefile);
+            break;
+        }
+        trace_format(&emu, &actual, line);
+        printf("Actual:   %s\n", line);
+        break;
+    }
+    printf("Cycles: %llu  Clocks: %llu\n", cycles, cycles * 12);
+    dump_registers(&emu);
+
+    if (dumpmem)
+    {
+        dump_area("Lower", emu.mLowerData, 128, 0);
+        if (emu.mUpperData)
+            dump_area("Upper", emu.mUpperData, 128, 0x80);
+        dump_area("SFR", emu.mSFR, 128, 0x80);
+    }
+
+    if (xdump && save_ext(&emu, xdump) != 0)
+    {
+        printf("File '%s' save failure\n", xdump);
+    }
+
+    if (savestate && em8051_save_state(&emu, savestate, NULL, 0) != 0)
+    {
+        printf("File '%s' save failure\n", savestate);
+    }
+
+    if (trace && trace_close(trace) != 0 && tracefile)
+    {
+        printf("File '%s' save failure\n", tracefile);
+    }
+
+    if (profilefile && profile_report(&emu, profile, profilefile, -1) != 0)
+    {
+        printf("File '%s' save failure\n", profilefile);
+    }
+
+    if (stacksfile && profile_stacks(profile, stacksfile) != 0)
+    {
+        printf("File '%s' save failure\n", stacksfile);
+    }
+
+    if (profile)
+        profile_free(profile);
+
+    if (coverage && coverage_save(coverage, coveragefile) != 0)
+    {
+        printf("File '%s' save failure\n", coveragefile);
+    }
+
+    switch (b->stopreason)
+    {
+    case STOP_CYCLES:
+        return 1;
+    case STOP_EXCEPTION:
+        return 2;
+    case STOP_COMPARE:
+        return 3;
+    }
+    return 0;
+}
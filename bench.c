@@ -0,0 +1,443 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * bench.c
+ * Host-side benchmark; runs a set of 8051 workloads through the core and
+ * reports emulated MIPS and simulated clock rate
+ */
+
+// Each workload runs for the same number of ticks through tick() one at a
+// time, through run_cycles() and, where the host has it, through the
+// translator. The dispatch mode is fixed at build time, so "make bench"
+// builds this once per mode. The runs must all end in the same state;
+// a workload that doesn't is reported, as that's a bug in the core.
+//
+// Times are processor time from clock(), the best of a few repeats.
+// Results can also be appended to a file as comma separated values:
+//
+//   workload,dispatch,runner,operations,ticks,seconds,mips,mhz
+//
+// where mhz is the clock rate the run would have kept up with, at 12
+// clocks per tick.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emu8051.h"
+
+#ifndef EM8051_DISPATCH
+#define EM8051_DISPATCH 0
+#endif
+
+static const char *dispatch_names[] =
+{
+    "table",
+    "switch",
+    "threaded"
+};
+
+// Integer work in the style of Dhrystone: moves, arithmetic, a call per
+// element and compares
+static const unsigned char dhrystone_code[] =
+{
+    0x75, 0x81, 0x60,       // 0000      MOV   SP, #60h
+    0x78, 0x30,             // 0003 L0:  MOV   R0, #30h
+    0x7a, 0x10,             // 0005      MOV   R2, #10h
+    0xe4,                   // 0007 L1:  CLR   A
+    0x26,                   // 0008      ADD   A, @R0
+    0x24, 0x07,             // 0009      ADD   A, #07h
+    0xf6,                   // 000B      MOV   @R0, A
+    0x12, 0x00, 0x20,       // 000C      LCALL 0020h
+    0x08,                   // 000F      INC   R0
+    0xda, 0xf5,             // 0010      DJNZ  R2, L1
+    0x05, 0x40,             // 0012      INC   40h
+    0xe5, 0x40,             // 0014      MOV   A, 40h
+    0xb4, 0x80, 0xea,       // 0016      CJNE  A, #80h, L0
+    0x75, 0x40, 0x00,       // 0019      MOV   40h, #00h
+    0x80, 0xe5,             // 001C      SJMP  L0
+    0x00, 0x00,             // 001E
+    0x75, 0xf0, 0x03,       // 0020      MOV   B, #03h
+    0xa4,                   // 0023      MUL   AB
+    0x25, 0x41,             // 0024      ADD   A, 41h
+    0xf5, 0x41,             // 0026      MOV   41h, A
+    0xc3,                   // 0028      CLR   C
+    0x95, 0x42,             // 0029      SUBB  A, 42h
+    0xf5, 0x42,             // 002B      MOV   42h, A
+    0x22                    // 002D      RET
+};
+
+// Table driven CRC-16/CCITT over 256 bytes of external memory; the table
+// is at 1000h (high bytes) and 1100h (low bytes) in code memory
+static const unsigned char crc16_code[] =
+{
+    0x7e, 0xff,             // 0000      MOV   R6, #0FFh
+    0x7f, 0xff,             // 0002      MOV   R7, #0FFh
+    0x90, 0x00, 0x00,       // 0004 L0:  MOV   DPTR, #0000h
+    0xe0,                   // 0007 L1:  MOVX  A, @DPTR
+    0x6e,                   // 0008      XRL   A, R6
+    0xf8,                   // 0009      MOV   R0, A
+    0xa3,                   // 000A      INC   DPTR
+    0xac, 0x82,             // 000B      MOV   R4, DPL
+    0xad, 0x83,             // 000D      MOV   R5, DPH
+    0x90, 0x10, 0x00,       // 000F      MOV   DPTR, #1000h
+    0x93,                   // 0012      MOVC  A, @A+DPTR
+    0x6f,                   // 0013      XRL   A, R7
+    0xfe,                   // 0014      MOV   R6, A
+    0xe8,                   // 0015      MOV   A, R0
+    0x05, 0x83,             // 0016      INC   DPH
+    0x93,                   // 0018      MOVC  A, @A+DPTR
+    0xff,                   // 0019      MOV   R7, A
+    0x8c, 0x82,             // 001A      MOV   DPL, R4
+    0x8d, 0x83,             // 001C      MOV   DPH, R5
+    0xe5, 0x82,             // 001E      MOV   A, DPL
+    0x70, 0xe5,             // 0020      JNZ   L1
+    0x80, 0xe0              // 0022      SJMP  L0
+};
+
+// Shifts bytes out on P1.0 with a clock on P1.1, sampling P3.2, and
+// toggles P1.4 by P3.3
+static const unsigned char bitbang_code[] =
+{
+    0x79, 0x00,             // 0000 L0:  MOV   R1, #00h
+    0xe9,                   // 0002 L1:  MOV   A, R1
+    0x7a, 0x08,             // 0003      MOV   R2, #08h
+    0x33,                   // 0005 L2:  RLC   A
+    0x92, 0x90,             // 0006      MOV   P1.0, C
+    0xd2, 0x91,             // 0008      SETB  P1.1
+    0xa2, 0xb2,             // 000A      MOV   C, P3.2
+    0xc2, 0x91,             // 000C      CLR   P1.1
+    0xda, 0xf5,             // 000E      DJNZ  R2, L2
+    0x30, 0xb3, 0x02,       // 0010      JNB   P3.3, L3
+    0xb2, 0x94,             // 0013      CPL   P1.4
+    0x09,                   // 0015 L3:  INC   R1
+    0xe9,                   // 0016      MOV   A, R1
+    0x70, 0xe9,             // 0017      JNZ   L1
+    0x80, 0xe5              // 0019      SJMP  L0
+};
+
+// A main loop interrupted by timer 0 every 64 ticks and by timer 1 every
+// 100. Timer 0 runs in mode 0, reloaded by its handler, as the core only
+// raises TF1 with timer 0 in mode 0.
+static const unsigned char interrupts_code[] =
+{
+    0x02, 0x00, 0x30,       // 0000      LJMP  0030h
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x02, 0x00, 0x60,       // 000B      LJMP  0060h
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x02, 0x00, 0x80,       // 001B      LJMP  0080h
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x75, 0x81, 0x60,       // 0030      MOV   SP, #60h
+    0x75, 0x89, 0x20,       // 0033      MOV   TMOD, #20h
+    0x75, 0x8c, 0xfe,       // 0036      MOV   TH0, #0FEh
+    0x75, 0x8d, 0x9c,       // 0039      MOV   TH1, #9Ch
+    0x75, 0x88, 0x50,       // 003C      MOV   TCON, #50h
+    0x75, 0xa8, 0x8a,       // 003F      MOV   IEN0, #8Ah
+    0x05, 0x30,             // 0042 L0:  INC   30h
+    0xe5, 0x30,             // 0044      MOV   A, 30h
+    0x25, 0x31,             // 0046      ADD   A, 31h
+    0xf5, 0x32,             // 0048      MOV   32h, A
+    0x80, 0xf6,             // 004A      SJMP  L0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xc0, 0xe0,             // 0060      PUSH  ACC
+    0xc0, 0xd0,             // 0062      PUSH  PSW
+    0x75, 0x8c, 0xfe,       // 0064      MOV   TH0, #0FEh
+    0x05, 0x31,             // 0067      INC   31h
+    0xe5, 0x31,             // 0069      MOV   A, 31h
+    0x24, 0x03,             // 006B      ADD   A, #03h
+    0xf5, 0x33,             // 006D      MOV   33h, A
+    0xd0, 0xd0,             // 006F      POP   PSW
+    0xd0, 0xe0,             // 0071      POP   ACC
+    0x32,                   // 0073      RETI
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x05, 0x34,             // 0080      INC   34h
+    0x32                    // 0082      RETI
+};
+
+// Copies 4K of external memory from 0000h to 8000h
+static const unsigned char movx_code[] =
+{
+    0x90, 0x00, 0x00,       // 0000 L0:  MOV   DPTR, #0000h
+    0xe0,                   // 0003 L1:  MOVX  A, @DPTR
+    0x43, 0x83, 0x80,       // 0004      ORL   DPH, #80h
+    0xf0,                   // 0007      MOVX  @DPTR, A
+    0x53, 0x83, 0x7f,       // 0008      ANL   DPH, #7Fh
+    0xa3,                   // 000B      INC   DPTR
+    0xe5, 0x83,             // 000C      MOV   A, DPH
+    0xb4, 0x10, 0xf2,       // 000E      CJNE  A, #10h, L1
+    0x80, 0xed              // 0011      SJMP  L0
+};
+
+struct workload
+{
+    const char *mName;
+    const unsigned char *mCode;
+    int mSize;
+};
+
+static const struct workload workloads[] =
+{
+    { "dhrystone", dhrystone_code, sizeof(dhrystone_code) },
+    { "crc16", crc16_code, sizeof(crc16_code) },
+    { "bitbang", bitbang_code, sizeof(bitbang_code) },
+    { "interrupts", interrupts_code, sizeof(interrupts_code) },
+    { "movx", movx_code, sizeof(movx_code) }
+};
+
+enum RUNNERS
+{
+    RUN_TICK = 0, // tick() one at a time
+    RUN_CYCLES, // run_cycles()
+    RUN_JIT, // run_cycles() with the translator
+    RUNNERS
+};
+
+static const char *runner_names[] =
+{
+    "tick",
+    "run_cycles",
+    "jit"
+};
+
+static void load_workload(struct em8051 *aCPU, const struct workload *aWorkload)
+{
+    int crc;
+    int i;
+    int j;
+
+    reset(aCPU, 1);
+    memcpy(aCPU->mCodeMem, aWorkload->mCode, aWorkload->mSize);
+
+    // the CRC table, and something to checksum and copy
+    for (i = 0; i < 256; i++)
+    {
+        crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        aCPU->mCodeMem[0x1000 + i] = (crc >> 8) & 0xff;
+        aCPU->mCodeMem[0x1100 + i] = crc & 0xff;
+    }
+    for (i = 0; i < 0x1000; i++)
+        aCPU->mExtData[i] = (i * 7 + (i >> 8)) & 0xff;
+    predecode_invalidate(aCPU, 0, aCPU->mCodeMemSize);
+}
+
+// a summary of the machine state, to check that the runners agree
+static unsigned int state_hash(struct em8051 *aCPU)
+{
+    unsigned int h = aCPU->mPC;
+    int i;
+
+    timer_sync(aCPU);
+    for (i = 0; i < 128; i++)
+        h = h * 31 + aCPU->mLowerData[i];
+    for (i = 0; i < 128; i++)
+        h = h * 31 + aCPU->mUpperData[i];
+    for (i = 0; i < 128; i++)
+        h = h * 31 + aCPU->mSFR[i];
+    for (i = 0; i < aCPU->mExtDataSize; i++)
+        h = h * 31 + aCPU->mExtData[i];
+    return h;
+}
+
+// Runs the workload for aTicks ticks; returns processor seconds, and sets
+// *aOperations when running tick by tick
+static double run_workload(struct em8051 *aCPU, const struct workload *aWorkload, int aRunner, int aTicks, unsigned int *aOperations, unsigned int *aHash)
+{
+    unsigned int operations = 0;
+    clock_t start;
+    clock_t end;
+    int ticks = 0;
+
+    load_workload(aCPU, aWorkload);
+    if (aRunner == RUN_JIT)
+        aCPU->mJit = jit_create(aCPU);
+
+    start = clock();
+    if (aRunner == RUN_TICK)
+    {
+        for (ticks = 0; ticks < aTicks; ticks++)
+            operations += tick(aCPU);
+    }
+    else
+    {
+        while (ticks < aTicks)
+            ticks += run_cycles(aCPU, aTicks - ticks, -1);
+    }
+    end = clock();
+
+    if (aCPU->mJit)
+    {
+        jit_destroy(aCPU->mJit);
+        aCPU->mJit = NULL;
+    }
+    if (aRunner == RUN_TICK)
+        *aOperations = operations;
+    *aHash = state_hash(aCPU);
+    return (double)(end - start) / CLOCKS_PER_SEC;
+}
+
+int main(int parc, char ** pars)
+{
+    struct em8051 emu;
+    char *resultfile = NULL;
+    FILE *results = NULL;
+    int ticks = 20000000;
+    int repeats = 3;
+    int failed = 0;
+    int w;
+    int i;
+
+    for (i = 1; i < parc; i++)
+    {
+        if (strncmp("-ticks=",pars[i],7) == 0)
+        {
+            ticks = atoi(pars[i]+7);
+            if (ticks < 1)
+                ticks = 1;
+        }
+        else
+        if (strncmp("-repeat=",pars[i],8) == 0)
+        {
+            repeats = atoi(pars[i]+8);
+            if (repeats < 1)
+                repeats = 1;
+        }
+        else
+        if (strncmp("-results=",pars[i],9) == 0)
+        {
+            resultfile = pars[i]+9;
+        }
+        else
+        {
+            printf("Help:\n\n"
+                "emu8051-bench [options]\n\n"
+                "Runs the built-in workloads through the core and reports emulated\n"
+                "MIPS and the clock rate kept up with. Available options:\n\n"
+                "Option            Alternate   description\n"
+                "-ticks=count                  Ticks to run each workload for\n"
+                "                              (default 20000000)\n"
+                "-repeat=count                 Runs to take the best time of (default 3)\n"
+                "-results=file                 Append the results to file, as comma\n"
+                "                              separated values\n"
+                );
+            return -1;
+        }
+    }
+
+    memset(&emu, 0, sizeof(emu));
+    emu.mCodeMem     = malloc(65536);
+    emu.mCodeMemSize = 65536;
+    emu.mExtData     = malloc(65536);
+    emu.mExtDataSize = 65536;
+    emu.mLowerData   = malloc(128);
+    emu.mUpperData   = malloc(128);
+    emu.mSFR         = malloc(128);
+    emu.mDecoded     = calloc(65536, sizeof(struct em8051decoded));
+    reset(&emu, 1);
+
+    if (resultfile)
+    {
+        results = fopen(resultfile, "a");
+        if (!results)
+        {
+            printf("File '%s' save failure\n", resultfile);
+            return -1;
+        }
+        // a header for a new file
+        fseek(results, 0, SEEK_END);
+        if (ftell(results) == 0)
+            fprintf(results, "workload,dispatch,runner,operations,ticks,seconds,mips,mhz\n");
+    }
+
+    printf("Dispatch: %s, %d ticks per run, best of %d\n\n", dispatch_names[EM8051_DISPATCH], ticks, repeats);
+    printf("Workload    Runner      Operations   Seconds      MIPS       MHz\n");
+    for (w = 0; w < (int)(sizeof(workloads) / sizeof(workloads[0])); w++)
+    {
+        unsigned int operations = 0;
+        unsigned int reference = 0;
+        int r;
+
+        for (r = 0; r < RUNNERS; r++)
+        {
+            unsigned int hash = 0;
+            double best = 0;
+            double mips;
+            double mhz;
+
+            if (r == RUN_JIT)
+            {
+                struct em8051jit *jit = jit_create(&emu);
+                if (!jit)
+                    continue;
+                jit_destroy(jit);
+            }
+
+            for (i = 0; i < repeats; i++)
+            {
+                double seconds = run_workload(&emu, &workloads[w], r, ticks, &operations, &hash);
+                if (i == 0 || seconds < best)
+                    best = seconds;
+            }
+            if (r == RUN_TICK)
+                reference = hash;
+
+            // too quick for clock() to see
+            if (best <= 0)
+                best = 1.0 / CLOCKS_PER_SEC;
+            mips = operations / best / 1000000.0;
+            mhz = 12.0 * ticks / best / 1000000.0;
+            printf("%-11s %-11s %10u %9.3f %9.2f %9.2f%s\n",
+                workloads[w].mName,
+                runner_names[r],
+                operations,
+                best,
+                mips,
+                mhz,
+                hash != reference ? "  (ended in a different state)" : "");
+            if (hash != reference)
+                failed = 1;
+
+            if (results)
+            {
+                fprintf(results, "%s,%s,%s,%u,%d,%.6f,%.3f,%.3f\n",
+                    workloads[w].mName,
+                    dispatch_names[EM8051_DISPATCH],
+                    runner_names[r],
+                    operations,
+                    ticks,
+                    best,
+                    mips,
+                    mhz);
+            }
+        }
+    }
+
+    if (results && fclose(results) != 0)
+    {
+        printf("File '%s' save failure\n", resultfile);
+        return -1;
+    }
+    return failed ? 2 : 0;
+}
@@ -31,243 +31,250 @@
 #include <string.h>
 #include "emu8051.h"
 
-static void timer_tick(struct em8051 *aCPU)
+// How operations are dispatched; select at build time with -DEM8051_DISPATCH=n
+#define DISPATCH_TABLE 0    // through the op[] function pointers (default)
+#define DISPATCH_SWITCH 1   // through the switch in do_op()
+#define DISPATCH_THREADED 2 // runs of operations in op_run_threaded(); tick() uses op[]
+
+#ifndef EM8051_DISPATCH
+#define EM8051_DISPATCH DISPATCH_TABLE
+#endif
+
+// The timers are not stepped on every tick. The core counts the ticks
+// since the timer registers were last updated (mTimerTicks) and calls
+// timer_sync() once that reaches the next overflow (mTimerEvent), or
+// around any operation that accesses the timer registers.
+
+// longest time between timer updates when no overflow is coming
+#define TIMER_IDLE_TICKS (1 << 20)
+
+// ticks each emulator runs per turn in run_interleaved(); short enough that
+// the code and decoded operations of a turn are still in the L1 cache
+// when the next emulator runs the same stretch of code
+#define INTERLEAVE_TICKS 256
+
+// Advance a counter of aRange steps by aTicks. Returns 1 if it overflowed.
+static int timer_count(int *aValue, int aRange, int aTicks)
 {
-    int increment;
-    int v;
+    int v = *aValue + aTicks;
+    *aValue = v % aRange;
+    return v >= aRange;
+}
+
+// Advance an 8-bit auto-reload counter by aTicks. Returns 1 if it overflowed.
+static int timer_reload(int *aValue, int aReload, int aTicks)
+{
+    int v = *aValue + aTicks;
+    if (v <= 0xff)
+    {
+        *aValue = v;
+        return 0;
+    }
+    // ticks counted since the first overflow
+    v -= 0x100;
+    *aValue = aReload + v % (0x100 - aReload);
+    return 1;
+}
 
-    // TODO: External int 0 flag
+// Whether handle_interrupts() could start an interrupt is kept in
+// mInterruptPending, so that it needn't be called before every operation.
+// Only IEN0 and TCON decide it; it's updated after anything that may
+// write them: operations on SFRs, callbacks, timer updates and interrupt
+// entry. Priorities are still sorted out by handle_interrupts(). Idle and
+// power-down modes are noted there as well, as they also need a look
+// before the next operation.
+void interrupt_update(struct em8051 *aCPU)
+{
+    int ien0 = aCPU->mSFR[REG_IEN0];
+    int tcon = aCPU->mSFR[REG_TCON];
+    int pending = 0;
 
-    if ((aCPU->mSFR[REG_TMOD] & (TMOD_M0_0_MASK | TMOD_M1_0_MASK)) == (TMOD_M0_0_MASK | TMOD_M1_0_MASK))
+    if (ien0 & IEN0_EA_MASK)
     {
-        // timer/counter 0 in mode 3
-
-        increment = 0;
-        
-        // Check if we're run enabled
-        // TODO: also run if GATE is one and INT is one (external interrupt)
-        if (!(aCPU->mSFR[REG_TMOD] & TMOD_GATE_0_MASK) && 
-            (aCPU->mSFR[REG_TCON] & TCON_TR0_MASK))
-        {
-            // check timer / counter mode
-            if (aCPU->mSFR[REG_TMOD] & TMOD_CT_0_MASK)
-            {
-                // counter op;
-                // counter works if T0 pin was 1 and is now 0 (P3.4 on AT89C2051)
-                increment = 0; // TODO
-            }
-            else
-            {
-                increment = 1;
-            }
-        }
-        if (increment)
+        if ((ien0 & IEN0_EX0_MASK) && (tcon & TCON_IE0_MASK))
+            pending = 1;
+        if ((ien0 & IEN0_ET0_MASK) && (tcon & TCON_TF0_MASK))
+            pending = 1;
+        if ((ien0 & IEN0_EX1_MASK) && (tcon & TCON_IE1_MASK))
+            pending = 1;
+        if ((ien0 & IEN0_ET1_MASK) && (tcon & TCON_TF1_MASK))
+            pending = 1;
+        // serial port and timer 2 request flags aren't emulated yet;
+        // enabling them is enough
+        if (ien0 & (IEN0_ES_MASK | IEN0_ET2_MASK))
+            pending = 1;
+    }
+
+    if (aCPU->mSFR[REG_PCON] & (PCON_IDL_MASK | PCON_PD_MASK))
+        pending |= 2;
+
+    aCPU->mInterruptPending = pending;
+}
+
+void timer_sync(struct em8051 *aCPU)
+{
+    int ticks = aCPU->mTimerTicks;
+    int tmod = aCPU->mSFR[REG_TMOD];
+    int run0, run1, tf1;
+    int next = TIMER_IDLE_TICKS;
+    int v;
+
+    aCPU->mTimerTicks = 0;
+
+    // TODO: External int 0 and 1
+
+    // Check if we're run enabled
+    // TODO: also run if GATE is one and INT is one (external interrupt)
+    // TODO: counter mode; counts if T0/T1 pin was 1 and is now 0
+    run0 = !(tmod & (TMOD_GATE_0_MASK | TMOD_CT_0_MASK)) && 
+           (aCPU->mSFR[REG_TCON] & TCON_TR0_MASK);
+    run1 = !(tmod & (TMOD_GATE_1_MASK | TMOD_CT_1_MASK)) && 
+           (aCPU->mSFR[REG_TCON] & TCON_TR1_MASK);
+
+    // Timer 1 only updates TF1 if timer 0 is in mode 0
+    tf1 = !(tmod & (TMOD_M0_0_MASK | TMOD_M1_0_MASK));
+
+    if (run0)
+    {   // Timer/counter 0
+        switch (tmod & (TMOD_M0_0_MASK | TMOD_M1_0_MASK))
         {
-            v = aCPU->mSFR[REG_TL0];
-            v++;
+        case 0: // 13-bit timer; lower 5 bits of TL0 and TH0
+            v = (aCPU->mSFR[REG_TH0] << 5) | (aCPU->mSFR[REG_TL0] & 0x1f);
+            if (timer_count(&v, 0x2000, ticks))
+                aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
+            aCPU->mSFR[REG_TL0] = (aCPU->mSFR[REG_TL0] & ~0x1f) | (v & 0x1f);
+            aCPU->mSFR[REG_TH0] = v >> 5;
+            v = 0x2000 - v;
+            break;
+        case TMOD_M0_0_MASK: // 16-bit timer/counter
+            v = (aCPU->mSFR[REG_TH0] << 8) | aCPU->mSFR[REG_TL0];
+            if (timer_count(&v, 0x10000, ticks))
+                aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
             aCPU->mSFR[REG_TL0] = v & 0xff;
-            if (v > 0xff)
-            {
-                // TL0 overflowed
+            aCPU->mSFR[REG_TH0] = v >> 8;
+            v = 0x10000 - v;
+            break;
+        case TMOD_M1_0_MASK: // 8-bit auto-reload timer
+            v = aCPU->mSFR[REG_TL0];
+            if (timer_reload(&v, aCPU->mSFR[REG_TH0], ticks))
                 aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
-            }
+            aCPU->mSFR[REG_TL0] = v;
+            v = 0x100 - v;
+            break;
+        default: // two 8-bit timers; TL0 here, TH0 runs with timer 1 below
+            v = aCPU->mSFR[REG_TL0];
+            if (timer_count(&v, 0x100, ticks))
+                aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
+            aCPU->mSFR[REG_TL0] = v;
+            v = 0x100 - v;
+            break;
         }
+        if (v < next)
+            next = v;
+    }
 
-        increment = 0;
-        
-        // Check if we're run enabled
-        // TODO: also run if GATE is one and INT is one (external interrupt)
-        if (!(aCPU->mSFR[REG_TMOD] & TMOD_GATE_1_MASK) && 
-            (aCPU->mSFR[REG_TCON] & TCON_TR1_MASK))
-        {
-            // check timer / counter mode
-            if (aCPU->mSFR[REG_TMOD] & TMOD_CT_1_MASK)
-            {
-                // counter op;
-                // counter works if T1 pin was 1 and is now 0
-                increment = 0; // TODO
-            }
-            else
-            {
-                increment = 1;
-            }
-        }
+    if (run1 && (tmod & (TMOD_M0_0_MASK | TMOD_M1_0_MASK)) == (TMOD_M0_0_MASK | TMOD_M1_0_MASK))
+    {   // timer 0 in mode 3; TH0 uses timer 1's run bits and flag
+        v = aCPU->mSFR[REG_TH0];
+        if (timer_count(&v, 0x100, ticks))
+            aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
+        aCPU->mSFR[REG_TH0] = v;
+        v = 0x100 - v;
+        if (v < next)
+            next = v;
+    }
 
-        if (increment)
+    if (run1)
+    {   // Timer/counter 1
+        switch (tmod & (TMOD_M0_1_MASK | TMOD_M1_1_MASK))
         {
-            v = aCPU->mSFR[REG_TH0];
-            v++;
-            aCPU->mSFR[REG_TH0] = v & 0xff;
-            if (v > 0xff)
-            {
-                // TH0 overflowed
+        case 0: // 13-bit timer
+            v = (aCPU->mSFR[REG_TH1] << 5) | (aCPU->mSFR[REG_TL1] & 0x1f);
+            if (timer_count(&v, 0x2000, ticks) && tf1)
                 aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
-            }
+            aCPU->mSFR[REG_TL1] = (aCPU->mSFR[REG_TL1] & ~0x1f) | (v & 0x1f);
+            aCPU->mSFR[REG_TH1] = v >> 5;
+            v = 0x2000 - v;
+            break;
+        case TMOD_M0_1_MASK: // 16-bit timer/counter
+            v = (aCPU->mSFR[REG_TH1] << 8) | aCPU->mSFR[REG_TL1];
+            if (timer_count(&v, 0x10000, ticks) && tf1)
+                aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
+            aCPU->mSFR[REG_TL1] = v & 0xff;
+            aCPU->mSFR[REG_TH1] = v >> 8;
+            v = 0x10000 - v;
+            break;
+        case TMOD_M1_1_MASK: // 8-bit auto-reload timer
+            v = aCPU->mSFR[REG_TL1];
+            if (timer_reload(&v, aCPU->mSFR[REG_TH1], ticks) && tf1)
+                aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
+            aCPU->mSFR[REG_TL1] = v;
+            v = 0x100 - v;
+            break;
+        default: // disabled
+            v = next;
+            break;
         }
-
+        // overflows that can't set TF1 need no event
+        if (tf1 && v < next)
+            next = v;
     }
 
-    {   // Timer/counter 0
-        
-        increment = 0;
-        
-        // Check if we're run enabled
-        // TODO: also run if GATE is one and INT is one (external interrupt)
-        if (!(aCPU->mSFR[REG_TMOD] & TMOD_GATE_0_MASK) && 
-            (aCPU->mSFR[REG_TCON] & TCON_TR0_MASK))
-        {
-            // check timer / counter mode
-            if (aCPU->mSFR[REG_TMOD] & TMOD_CT_0_MASK)
-            {
-                // counter op;
-                // counter works if T0 pin was 1 and is now 0 (P3.4 on AT89C2051)
-                increment = 0; // TODO
-            }
-            else
-            {
-                increment = 1;
-            }
-        }
-        
-        if (increment)
-        {
-            switch (aCPU->mSFR[REG_TMOD] & (TMOD_M0_0_MASK | TMOD_M1_0_MASK))
-            {
-            case 0: // 13-bit timer
-                v = aCPU->mSFR[REG_TL0] & 0x1f; // lower 5 bits of TL0
-                v++;
-                aCPU->mSFR[REG_TL0] = (aCPU->mSFR[REG_TL0] & ~0x1f) | (v & 0x1f);
-                if (v > 0x1f)
-                {
-                    // TL0 overflowed
-                    v = aCPU->mSFR[REG_TH0];
-                    v++;
-                    aCPU->mSFR[REG_TH0] = v & 0xff;
-                    if (v > 0xff)
-                    {
-                        // TH0 overflowed; set bit
-                        aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
-                    }
-                }
-                break;
-            case TMOD_M0_0_MASK: // 16-bit timer/counter
-                v = aCPU->mSFR[REG_TL0];
-                v++;
-                aCPU->mSFR[REG_TL0] = v & 0xff;
-                if (v > 0xff)
-                {
-                    // TL0 overflowed
-                    v = aCPU->mSFR[REG_TH0];
-                    v++;
-                    aCPU->mSFR[REG_TH0] = v & 0xff;
-                    if (v > 0xff)
-                    {
-                        // TH0 overflowed; set bit
-                        aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
-                    }
-                }
-                break;
-            case TMOD_M1_0_MASK: // 8-bit auto-reload timer
-                v = aCPU->mSFR[REG_TL0];
-                v++;
-                aCPU->mSFR[REG_TL0] = v & 0xff;
-                if (v > 0xff)
-                {
-                    // TL0 overflowed; reload
-                    aCPU->mSFR[REG_TL0] = aCPU->mSFR[REG_TH0];
-                    aCPU->mSFR[REG_TCON] |= TCON_TF0_MASK;
-                }
-                break;
-            default: // two 8-bit timers
-                // TODO
-                break;
-            }
-        }
-    }
+    // TODO: serial port, timer2, other stuff
+
+    aCPU->mTimerEvent = next;
 
-    // TODO: External int 1 
+    // overflow flags may have been set, or the caller may have changed
+    // the interrupt registers
+    interrupt_update(aCPU);
+}
 
-    {   // Timer/counter 1 
-        
-        increment = 0;
+// The flags in PSW are not updated after every operation. The parity flag
+// is never read by the operations themselves, and ADD, ADDC and SUBB only
+// note their operands for the carry flags. They're brought up to date
+// before operations that use the carry flags, access SFRs or call the
+// front-end, and before the core returns to the front-end.
+void psw_sync(struct em8051 *aCPU)
+{
+    int value1 = aCPU->mFlagsValue1;
+    int value2 = aCPU->mFlagsValue2;
+    int carry;
+    int auxcarry;
+    int overflow;
+    int acc;
+    int v;
 
-        if (!(aCPU->mSFR[REG_TMOD] & TMOD_GATE_1_MASK) && 
-            (aCPU->mSFR[REG_TCON] & TCON_TR1_MASK))
+    if (aCPU->mFlagsOp != FLAGS_NONE)
+    {
+        if (aCPU->mFlagsOp == FLAGS_SUB || aCPU->mFlagsOp == FLAGS_SUBB)
         {
-            if (aCPU->mSFR[REG_TMOD] & TMOD_CT_1_MASK)
-            {
-                // counter op;
-                // counter works if T1 pin was 1 and is now 0
-                increment = 0; // TODO
-            }
-            else
-            {
-                increment = 1;
-            }
+            acc = aCPU->mFlagsOp == FLAGS_SUBB;
+            /* Carry: borrow into the 8th bit */
+            carry = (((value1 & 255) - (value2 & 255) - acc) >> 8) & 1;
+            /* Auxiliary carry: borrow into the 4th bit */
+            auxcarry = (((value1 & 15) - (value2 & 15) - acc) >> 4) & 1;
+            overflow = ((((value1 & 127) - (value2 & 127) - acc) >> 7) & 1)^carry;
         }
-
-        if (increment)
+        else
         {
-            switch (aCPU->mSFR[REG_TMOD] & (TMOD_M0_1_MASK | TMOD_M1_1_MASK))
-            {
-            case 0: // 13-bit timer
-                v = aCPU->mSFR[REG_TL1] & 0x1f; // lower 5 bits of TL0
-                v++;
-                aCPU->mSFR[REG_TL1] = (aCPU->mSFR[REG_TL1] & ~0x1f) | (v & 0x1f);
-                if (v > 0x1f)
-                {
-                    // TL1 overflowed
-                    v = aCPU->mSFR[REG_TH1];
-                    v++;
-                    aCPU->mSFR[REG_TH1] = v & 0xff;
-                    if (v > 0xff)
-                    {
-                        // TH1 overflowed; set bit
-                        // Only update TF1 if timer 0 is not in "mode 3"
-                        if (!(aCPU->mSFR[REG_TMOD] & (TMOD_M0_0_MASK | TMOD_M1_0_MASK)))
-                            aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
-                    }
-                }
-                break;
-            case TMOD_M0_1_MASK: // 16-bit timer/counter
-                v = aCPU->mSFR[REG_TL1];
-                v++;
-                aCPU->mSFR[REG_TL1] = v & 0xff;
-                if (v > 0xff)
-                {
-                    // TL1 overflowed
-                    v = aCPU->mSFR[REG_TH1];
-                    v++;
-                    aCPU->mSFR[REG_TH1] = v & 0xff;
-                    if (v > 0xff)
-                    {
-                        // TH1 overflowed; set bit
-                        // Only update TF1 if timer 0 is not in "mode 3"
-                        if (!(aCPU->mSFR[REG_TMOD] & (TMOD_M0_0_MASK | TMOD_M1_0_MASK)))
-                            aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
-                    }
-                }
-                break;
-            case TMOD_M1_1_MASK: // 8-bit auto-reload timer
-                v = aCPU->mSFR[REG_TL1];
-                v++;
-                aCPU->mSFR[REG_TL1] = v & 0xff;
-                if (v > 0xff)
-                {
-                    // TL0 overflowed; reload
-                    aCPU->mSFR[REG_TL1] = aCPU->mSFR[REG_TH1];
-                    // Only update TF1 if timer 0 is not in "mode 3"
-                    if (!(aCPU->mSFR[REG_TMOD] & (TMOD_M0_0_MASK | TMOD_M1_0_MASK)))
-                        aCPU->mSFR[REG_TCON] |= TCON_TF1_MASK;
-                }
-                break;
-            default: // disabled
-                break;
-            }
+            acc = aCPU->mFlagsOp == FLAGS_ADDC;
+            /* Carry: overflow from 7th bit to 8th bit */
+            carry = ((value1 & 255) + (value2 & 255) + acc) >> 8;
+            /* Auxiliary carry: overflow from 3th bit to 4th bit */
+            auxcarry = ((value1 & 15) + (value2 & 15) + acc) >> 4;
+            /* Overflow: overflow from 6th or 7th bit, but not both */
+            overflow = (((value1 & 127) + (value2 & 127) + acc) >> 7)^carry;
         }
+        aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~(PSW_CY_MASK | PSW_AC_MASK | PSW_OV_MASK)) |
+            (carry << PSW_CY) | (auxcarry << PSW_AC) | (overflow << PSW_OV);
+        aCPU->mFlagsOp = FLAGS_NONE;
     }
 
-    // TODO: serial port, timer2, other stuff
+    v = aCPU->mSFR[REG_ACC];
+    v ^= v >> 4;
+    v &= 0xf;
+    v = (0x6996 >> v) & 1;
+    aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~PSW_P_MASK) | (v * PSW_P_MASK);
 }
 
 void handle_interrupts(struct em8051 *aCPU)
@@ -280,6 +287,10 @@ void handle_interrupts(struct em8051 *aCPU)
     if (aCPU->mInterruptActive > 1) 
         return;    
 
+    // no clock in power-down mode
+    if (aCPU->mSFR[REG_PCON] & PCON_PD_MASK)
+        return;
+
     if (aCPU->mSFR[REG_IEN0] & IEN0_EA_MASK)
     {
         // Interrupts enabled
@@ -373,7 +384,12 @@ void handle_interrupts(struct em8051 *aCPU)
     if (aCPU->mInterruptActive == 1 && !hi)
         return; 
 
-    // some interrupt occurs; perform LCALL
+    // some interrupt occurs; wakes up from idle mode, and continues after
+    // the operation that entered it once the interrupt returns
+    aCPU->mSFR[REG_PCON] &= ~PCON_IDL_MASK;
+
+    // perform LCALL
+    psw_sync(aCPU);
     push_to_stack(aCPU, aCPU->mPC & 0xff);
     push_to_stack(aCPU, aCPU->mPC >> 8);
     aCPU->mPC = dest_ip;
@@ -389,6 +405,7 @@ void handle_interrupts(struct em8051 *aCPU)
         aCPU->mSFR[REG_TCON] &= ~TCON_TF1_MASK; // clear overflow flag
         break;
     }
+    interrupt_update(aCPU);
 
     if (hi)
     {
@@ -403,9 +420,52 @@ void handle_interrupts(struct em8051 *aCPU)
     aCPU->int_sp[hi] = aCPU->mSFR[REG_SP];
 }
 
+// Run the operation at PC.
+// Returns the number of ticks the operation should delay.
+static int execute(struct em8051 *aCPU)
+{
+    int pc = aCPU->mPC & (aCPU->mCodeMemSize - 1);
+    em8051operation op;
+    int flags;
+    int delay;
+
+    if (aCPU->mDecoded)
+    {
+        struct em8051decoded *d = aCPU->mDecoded + pc;
+        if (d->mLength == 0)
+            op_predecode(aCPU, pc);
+        op = d->mOp;
+        flags = d->mFlags;
+    }
+    else
+    {
+        op = aCPU->op[aCPU->mCodeMem[pc]];
+        flags = op_flags(aCPU, pc);
+    }
+
+#if EM8051_DISPATCH == DISPATCH_SWITCH
+    // the switch in do_op() picks the handler by itself
+    op = &do_op;
+#endif
+
+    if (flags & (DECODED_SFR | DECODED_CALLBACK | DECODED_PSW))
+        psw_sync(aCPU);
+
+    // bring the timers up to date for ops that access them, and
+    // reschedule afterwards in case the op changed them
+    if (flags & DECODED_TIMER)
+        timer_sync(aCPU);
+    delay = op(aCPU);
+    if (flags & DECODED_TIMER)
+        timer_sync(aCPU);
+    else if (flags & (DECODED_SFR | DECODED_CALLBACK))
+        interrupt_update(aCPU);
+
+    return delay;
+}
+
 int tick(struct em8051 *aCPU)
 {
-    int v;
     int ticked = 0;
 
     if (aCPU->mTickDelay)
@@ -413,32 +473,275 @@ int tick(struct em8051 *aCPU)
         aCPU->mTickDelay--;
     }
 
+    // power-down mode; once the operation that entered it is over, the
+    // oscillator is stopped until reset
+    if (aCPU->mTickDelay == 0 && (aCPU->mSFR[REG_PCON] & PCON_PD_MASK))
+        return 0;
+
     // Interrupts are sent if the following cases are not true:
     // 1. interrupt of equal or higher priority is in progress (tested inside function)
     // 2. current cycle is not the final cycle of instruction (tickdelay = 0)
     // 3. the instruction in progress is RETI or any write to the IE or IP regs (TODO)
-    if (aCPU->mTickDelay == 0)
+    if (aCPU->mTickDelay == 0 && aCPU->mInterruptPending)
     {
         handle_interrupts(aCPU);
     }
 
-    if (aCPU->mTickDelay == 0)
+    // in idle mode only the timers and interrupts run
+    if (aCPU->mTickDelay == 0 && !(aCPU->mSFR[REG_PCON] & PCON_IDL_MASK))
     {
-        aCPU->mTickDelay = aCPU->op[aCPU->mCodeMem[aCPU->mPC & (aCPU->mCodeMemSize - 1)]](aCPU);
+        aCPU->mTickDelay = execute(aCPU);
+        psw_sync(aCPU);
         ticked = 1;
-        // update parity bit
-        v = aCPU->mSFR[REG_ACC];
-        v ^= v >> 4;
-        v &= 0xf;
-        v = (0x6996 >> v) & 1;
-        aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~PSW_P_MASK) | (v * PSW_P_MASK);
     }
 
-    timer_tick(aCPU);
+    if (++aCPU->mTimerTicks >= aCPU->mTimerEvent)
+        timer_sync(aCPU);
 
     return ticked;
 }
 
+// Skip whole rounds of the idle loop at PC, if it is one, up to aCycles
+// ticks and stopping before the tick the next timer overflow is due. Call
+// only between operations, when no interrupt can start. Returns the ticks
+// skipped; the caller counts them, and the timers are moved ahead by as
+// many.
+static int idle_round(struct em8051 *aCPU, int aCycles)
+{
+    int ticks = op_idle_loop(aCPU);
+    int skip;
+
+    if (!ticks)
+        return 0;
+
+    // the loop only reads its own state, which nothing but a timer
+    // overflow or an interrupt changes
+    skip = aCPU->mTimerEvent - aCPU->mTimerTicks - 1;
+    if (skip > aCycles)
+        skip = aCycles;
+    skip -= skip % ticks;
+    aCPU->mTimerTicks += skip;
+    return skip;
+}
+
+// Let the ticks up to the next timer overflow, or aCycles ticks, pass in
+// idle mode. Returns the ticks that passed; the caller counts them.
+static int idle_mode(struct em8051 *aCPU, int aCycles)
+{
+    int skip = aCPU->mTimerEvent - aCPU->mTimerTicks - 1;
+    if (skip > aCycles)
+        skip = aCycles;
+    aCPU->mTimerTicks += skip;
+    return skip;
+}
+
+int idle_skip(struct em8051 *aCPU, int aCycles)
+{
+    // the next tick must not be in the middle of an operation, nor start
+    // an interrupt
+    if (aCPU->mTickDelay > 1)
+        return 0;
+    if (aCPU->mSFR[REG_PCON] & PCON_PD_MASK)
+        return aCycles;
+    if (aCPU->mInterruptPending & 1)
+        return 0;
+    if (aCPU->mSFR[REG_PCON] & PCON_IDL_MASK)
+        return idle_mode(aCPU, aCycles);
+    return idle_round(aCPU, aCycles);
+}
+
+// The run_cycles() loop; sets *aStopped to 1 if it stopped at the
+// breakpoint or for mStop. Returns the ticks run.
+static int run_loop(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aStopped)
+{
+    int delay = aCPU->mTickDelay;
+    int cycles = 0;
+    int skip;
+    int pc;
+
+    while (cycles < aCycles)
+    {
+        cycles++;
+
+        if (delay)
+            delay--;
+
+        if (delay == 0 && aCPU->mInterruptPending)
+        {
+            // handle_interrupts may start an interrupt and set a delay
+            aCPU->mTickDelay = 0;
+            handle_interrupts(aCPU);
+            delay = aCPU->mTickDelay;
+
+            if (delay == 0 && (aCPU->mSFR[REG_PCON] & PCON_PD_MASK))
+            {
+                // power-down mode; nothing runs until reset
+                cycles = aCycles;
+                break;
+            }
+            if (delay == 0 && (aCPU->mSFR[REG_PCON] & PCON_IDL_MASK))
+            {
+                // idle mode; nothing changes until the next timer
+                // overflow or interrupt, so move ahead to the tick the
+                // overflow is due
+                cycles += idle_mode(aCPU, aCycles - cycles);
+                if (++aCPU->mTimerTicks >= aCPU->mTimerEvent)
+                    timer_sync(aCPU);
+                continue;
+            }
+        }
+
+        if (delay == 0)
+        {
+            pc = aCPU->mPC;
+            skip = 0;
+            if (aCPU->mJit && !(aCPU->mDecoded[pc & (aCPU->mCodeMemSize - 1)].mFlags & DECODED_NOBLOCK))
+                skip = jit_run(aCPU, aCycles - cycles, aBreakpoint, &delay);
+#if EM8051_DISPATCH == DISPATCH_THREADED
+            if (!skip)
+                skip = op_run_threaded(aCPU, aCycles - cycles, aBreakpoint, &delay);
+#endif
+            if (skip)
+            {
+                // several operations ran; count the ticks up to the last one
+                cycles += skip - 1;
+                aCPU->mTimerTicks += skip - 1;
+                // the last one may have called the front-end
+                interrupt_update(aCPU);
+            }
+            else
+            {
+                delay = execute(aCPU);
+            }
+
+            if (++aCPU->mTimerTicks >= aCPU->mTimerEvent)
+                timer_sync(aCPU);
+
+            if ((aCPU->mPC & 0xffff) == aBreakpoint)
+                aCPU->mStop = 1;
+            if (aCPU->mStop)
+            {
+                *aStopped = 1;
+                break;
+            }
+
+            // an operation that jumped to itself may be a loop waiting for
+            // the timers or an interrupt; if so, move ahead to its last
+            // round before the next timer overflow
+            if (aCPU->mPC == pc && !aCPU->mInterruptPending)
+                cycles += idle_round(aCPU, aCycles - cycles);
+        }
+        else
+        {
+            // nothing but the timers runs until the delay is over, and
+            // nothing looks at them meanwhile, so skip ahead to the last
+            // tick of the delay
+            skip = delay - 1;
+            if (skip > aCycles - cycles)
+                skip = aCycles - cycles;
+            cycles += skip;
+            delay -= skip;
+            aCPU->mTimerTicks += skip + 1;
+            if (aCPU->mTimerTicks >= aCPU->mTimerEvent)
+                timer_sync(aCPU);
+        }
+    }
+
+    aCPU->mTickDelay = delay;
+    return cycles;
+}
+
+int run_cycles(struct em8051 *aCPU, int aCycles, int aBreakpoint)
+{
+    int stopped = 0;
+    int cycles;
+
+    aCPU->mStop = 0;
+    cycles = run_loop(aCPU, aCycles, aBreakpoint, &stopped);
+    psw_sync(aCPU);
+    return cycles;
+}
+
+void run_interleaved(struct em8051 **aCPUs, int aCount, int aCycles, int aBreakpoint, int *aRan)
+{
+    int *stopped = calloc(aCount, sizeof(int));
+    int running = 1;
+    int i;
+
+    // TODO: step the emulators together while their PCs agree, with the
+    // registers of all of them side by side so that one operation updates
+    // them all, and run the ones that went their own way, or hit an SFR
+    // callback, one by one as below
+
+    if (!stopped)
+    {
+        // no room to note which ones stopped; run them one after another
+        for (i = 0; i < aCount; i++)
+            aRan[i] = run_cycles(aCPUs[i], aCycles, aBreakpoint);
+        return;
+    }
+
+    for (i = 0; i < aCount; i++)
+    {
+        aCPUs[i]->mStop = 0;
+        aRan[i] = 0;
+    }
+
+    while (running)
+    {
+        running = 0;
+        for (i = 0; i < aCount; i++)
+        {
+            if (aRan[i] < aCycles && !stopped[i])
+            {
+                int turn = aCycles - aRan[i];
+                if (turn > INTERLEAVE_TICKS)
+                    turn = INTERLEAVE_TICKS;
+                aRan[i] += run_loop(aCPUs[i], turn, aBreakpoint, &stopped[i]);
+                // nothing runs in power-down mode; the rest of the ticks
+                // would pass one turn at a time
+                if (aCPUs[i]->mSFR[REG_PCON] & PCON_PD_MASK)
+                    aRan[i] = aCycles;
+                running = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < aCount; i++)
+        psw_sync(aCPUs[i]);
+    free(stopped);
+}
+
+void predecode_invalidate(struct em8051 *aCPU, int aAddress, int aLength)
+{
+    int i;
+
+    if (aCPU->mDirty)
+    {
+        if (aLength >= aCPU->mCodeMemSize)
+            memset(aCPU->mDirty, 1, aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT);
+        else
+            for (i = aAddress >> EM8051_PAGE_SHIFT; i <= (aAddress + aLength - 1) >> EM8051_PAGE_SHIFT; i++)
+                aCPU->mDirty[i & ((aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT) - 1)] = 1;
+    }
+
+    if (aCPU->mJit)
+        jit_invalidate(aCPU->mJit, aAddress, aLength);
+
+    if (!aCPU->mDecoded)
+        return;
+
+    if (aLength >= aCPU->mCodeMemSize)
+    {
+        memset(aCPU->mDecoded, 0, aCPU->mCodeMemSize * sizeof(struct em8051decoded));
+        return;
+    }
+
+    // operations starting up to two bytes earlier may cover the changed bytes
+    for (i = aAddress - 2; i < aAddress + aLength; i++)
+        aCPU->mDecoded[i & (aCPU->mCodeMemSize - 1)].mLength = 0;
+}
+
 int decode(struct em8051 *aCPU, int aPosition, unsigned char *aBuffer)
 {
     return aCPU->dec[aCPU->mCodeMem[aPosition & (aCPU->mCodeMemSize - 1)]](aCPU, aPosition, aBuffer);
@@ -454,6 +757,8 @@ void reset(struct em8051 *aCPU, int aWipe)
     {
         memset(aCPU->mCodeMem, 0, aCPU->mCodeMemSize);
         memset(aCPU->mExtData, 0, aCPU->mExtDataSize);
+        if (aCPU->mDirty)
+            memset(aCPU->mDirty + (aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT), 1, aCPU->mExtDataSize >> EM8051_PAGE_SHIFT);
         memset(aCPU->mLowerData, 0, 128);
         if (aCPU->mUpperData) 
             memset(aCPU->mUpperData, 0, 128);
@@ -463,6 +768,7 @@ void reset(struct em8051 *aCPU, int aWipe)
 
     aCPU->mPC = 0;
     aCPU->mTickDelay = 0;
+    aCPU->mFlagsOp = FLAGS_NONE;
     aCPU->mSFR[REG_SP] = 7;
     aCPU->mSFR[REG_P0] = 0xff;
     aCPU->mSFR[REG_P1] = 0xff;
@@ -471,6 +777,13 @@ void reset(struct em8051 *aCPU, int aWipe)
     aCPU->mSFR[REG_P4] = 0xff;
     aCPU->mSFR[REG_P5] = 0xff;
 
+    // handlers may have changed, and so may code memory
+    predecode_invalidate(aCPU, 0, aCPU->mCodeMemSize);
+
+    // schedule the (stopped) timers
+    aCPU->mTimerTicks = 0;
+    timer_sync(aCPU);
+
     // build function pointer lists
 
     disasm_setptrs(aCPU);
@@ -525,6 +838,7 @@ int load_obj(struct em8051 *aCPU, char *aFilename)
             checksum += data;
             aCPU->mCodeMem[address + i] = data;
         }
+        predecode_invalidate(aCPU, address, recordlength);
         i = readbyte(f);
         checksum &= 0xff;
         checksum = 256 - checksum;
@@ -547,6 +861,8 @@ int load_mem(struct em8051 *aCPU, char *aFilename)
     f = fopen(aFilename, "rb");
     if (!f) return -1;
     fread(aCPU->mExtData, aCPU->mExtDataSize, 1, f);
+    if (aCPU->mDirty)
+        memset(aCPU->mDirty + (aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT), 1, aCPU->mExtDataSize >> EM8051_PAGE_SHIFT);
     fclose(f);
     return 0; // we're done
 }
\ No newline at end of file
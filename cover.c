@@ -0,0 +1,487 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * cover.c
+ * Coverage reports; merges the files emu8051-batch -coverage writes, and
+ * maps them to source lines through assembler listings, in LCOV format.
+ */
+
+// Listings are read line by line, looking for an address followed by the
+// bytes of an operation, as in SDCC's relocated listings (.rst):
+//
+//       000000 75 90 00         [24]   57 	mov	_P1,#0x00
+//
+// and ASEM-51's listings, which start with the source line number:
+//
+//     3  0000  02 00 30            ljmp start
+//
+// decode() tells how many bytes the operation has, so whatever follows
+// them (cycle counts, line numbers) isn't mistaken for code. Lines of data
+// (.db and the like) and labels are left out. Operations are counted
+// against the C source line named in the last of SDCC's ";	file.c:12:"
+// comments, or else against the listing line they're on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "emu8051.h"
+
+// an operation in a listing
+struct listed
+{
+    int mFile;
+    int mLine;
+    int mAddress;
+    int mOpcode;
+};
+
+static char **files;
+static int filecount;
+static struct listed *ops;
+static int opcount;
+static int opspace;
+
+// Returns -1 if out of memory.
+static int file_index(const char *aName)
+{
+    char **grown;
+    int i;
+    for (i = 0; i < filecount; i++)
+    {
+        if (strcmp(files[i], aName) == 0)
+            return i;
+    }
+    grown = realloc(files, (filecount + 1) * sizeof(char*));
+    if (!grown)
+        return -1;
+    files = grown;
+    files[filecount] = malloc(strlen(aName) + 1);
+    if (!files[filecount])
+        return -1;
+    strcpy(files[filecount], aName);
+    return filecount++;
+}
+
+// Returns -1 if out of memory.
+static int add_op(int aFile, int aLine, int aAddress, int aOpcode)
+{
+    if (opcount == opspace)
+    {
+        struct listed *grown = realloc(ops, (opspace ? opspace * 2 : 1024) * sizeof(struct listed));
+        if (!grown)
+            return -1;
+        ops = grown;
+        opspace = opspace ? opspace * 2 : 1024;
+    }
+    ops[opcount].mFile = aFile;
+    ops[opcount].mLine = aLine;
+    ops[opcount].mAddress = aAddress;
+    ops[opcount].mOpcode = aOpcode;
+    opcount++;
+    return 0;
+}
+
+// length of the token at aText
+static int token_length(const char *aText)
+{
+    int i = 0;
+    while (aText[i] && !isspace((unsigned char)aText[i]))
+        i++;
+    return i;
+}
+
+static const char *next_token(const char *aText)
+{
+    aText += token_length(aText);
+    while (isspace((unsigned char)*aText))
+        aText++;
+    return aText;
+}
+
+// value of a token of aMin to aMax hex digits, or -1
+static int hex_token(const char *aText, int aMin, int aMax)
+{
+    int length = token_length(aText);
+    int i;
+    if (length < aMin || length > aMax)
+        return -1;
+    for (i = 0; i < length; i++)
+    {
+        if (!isxdigit((unsigned char)aText[i]))
+            return -1;
+    }
+    return (int)strtol(aText, NULL, 16);
+}
+
+static int same_word(const char *aText, int aLength, const char *aWord)
+{
+    int i;
+    if ((int)strlen(aWord) != aLength)
+        return 0;
+    for (i = 0; i < aLength; i++)
+    {
+        if (tolower((unsigned char)aText[i]) != aWord[i])
+            return 0;
+    }
+    return 1;
+}
+
+// the operation's text is a data directive or a label
+static int not_code(const char *aText)
+{
+    static const char *directives[] =
+    {
+        ".db", ".dw", ".ds", ".byte", ".word", ".ascii", ".asciz", ".str",
+        "db", "dw", "ds", "defb", "defw", NULL
+    };
+    const char *t;
+    int length;
+    int i;
+
+    if (!*aText || *aText == ';')
+        return 1;
+    for (t = aText; *t && *t != ';'; t = next_token(t))
+    {
+        length = token_length(t);
+        for (i = 0; directives[i]; i++)
+        {
+            if (same_word(t, length, directives[i]))
+                return 1;
+        }
+    }
+    // a label alone
+    length = token_length(aText);
+    return aText[length - 1] == ':' && *next_token(aText) == 0;
+}
+
+// SDCC's comment naming the C line the code after it is for
+static int source_comment(const char *aText, char *aFile, int *aLine)
+{
+    const char *t = strchr(aText, ';');
+    const char *colon;
+    int length;
+
+    if (!t)
+        return 0;
+    t++;
+    while (isspace((unsigned char)*t))
+        t++;
+    colon = strchr(t, ':');
+    if (!colon || colon == t || colon - t > 255 || !isdigit((unsigned char)colon[1]))
+        return 0;
+    length = (int)(colon - t);
+    if (memchr(t, ' ', length) || !memchr(t, '.', length))
+        return 0;
+    memcpy(aFile, t, length);
+    aFile[length] = 0;
+    *aLine = atoi(colon + 1);
+    return 1;
+}
+
+static int read_listing(struct em8051 *aCPU, char *aFilename)
+{
+    char text[1024];
+    char source[256];
+    unsigned char assembly[128];
+    int listing;
+    int file;
+    int sourceline = 0;
+    int line = 0;
+    int failed = 0;
+    FILE *f;
+
+    f = fopen(aFilename, "r");
+    if (!f)
+        return -1;
+    listing = file_index(aFilename);
+    if (listing < 0)
+    {
+        fclose(f);
+        return -1;
+    }
+    file = -1;
+
+    while (fgets(text, sizeof(text), f))
+    {
+        const char *t = text;
+        const char *bytes;
+        int address;
+        int length;
+        int i;
+
+        line++;
+        if (source_comment(text, source, &sourceline))
+        {
+            file = file_index(source);
+            if (file < 0)
+            {
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        while (isspace((unsigned char)*t))
+            t++;
+        // a line number first, then the address
+        if (hex_token(next_token(t), 4, 8) >= 0 && isdigit((unsigned char)*t))
+            t = next_token(t);
+        address = hex_token(t, 4, 8);
+        if (address < 0)
+            continue;
+        address &= 0xffff;
+
+        // the operation's bytes; decode() knows how many there should be
+        bytes = next_token(t);
+        if (hex_token(bytes, 2, 2) < 0)
+            continue;
+        t = bytes;
+        for (i = 0; i < 3; i++)
+        {
+            int value = hex_token(t, 2, 2);
+            aCPU->mCodeMem[(address + i) & 0xffff] = value < 0 ? 0 : value;
+            if (value >= 0)
+                t = next_token(t);
+        }
+        length = decode(aCPU, address, assembly);
+        t = bytes;
+        for (i = 0; i < length; i++)
+        {
+            if (hex_token(t, 2, 2) < 0)
+                break;
+            t = next_token(t);
+        }
+        if (i < length)
+            continue;
+
+        // cycle count and line number, if any
+        if (*t == '[')
+            t = next_token(t);
+        if (isdigit((unsigned char)*t) && token_length(t) == (int)strspn(t, "0123456789"))
+            t = next_token(t);
+        if (not_code(t))
+            continue;
+
+        if (file >= 0)
+            failed = add_op(file, sourceline, address, hex_token(bytes, 2, 2)) != 0;
+        else
+            failed = add_op(listing, line, address, hex_token(bytes, 2, 2)) != 0;
+        if (failed)
+            break;
+    }
+    fclose(f);
+    return failed ? -1 : 0;
+}
+
+static int listed_compare(const void *aA, const void *aB)
+{
+    const struct listed *a = aA;
+    const struct listed *b = aB;
+    if (a->mFile != b->mFile)
+        return a->mFile - b->mFile;
+    if (a->mLine != b->mLine)
+        return a->mLine - b->mLine;
+    return a->mAddress - b->mAddress;
+}
+
+static void write_lcov(struct em8051coverage *aCoverage)
+{
+    int i;
+    int j;
+
+    qsort(ops, opcount, sizeof(struct listed), listed_compare);
+    printf("TN:\n");
+    for (i = 0; i < opcount; i = j)
+    {
+        int branches = 0;
+        int branches_hit = 0;
+        int lines = 0;
+        int lines_hit = 0;
+        int k;
+
+        for (j = i; j < opcount && ops[j].mFile == ops[i].mFile; j++)
+            ;
+        printf("SF:%s\n", files[ops[i].mFile]);
+
+        // both ways of every conditional jump
+        for (k = i; k < j; k++)
+        {
+            int flags = aCoverage->mFlags[ops[k].mAddress];
+            if (!coverage_branch(ops[k].mOpcode))
+                continue;
+            if (flags & COVERAGE_RUN)
+            {
+                printf("BRDA:%d,%d,0,%d\n", ops[k].mLine, ops[k].mAddress, (flags & COVERAGE_TAKEN) != 0);
+                printf("BRDA:%d,%d,1,%d\n", ops[k].mLine, ops[k].mAddress, (flags & COVERAGE_NOT_TAKEN) != 0);
+            }
+            else
+            {
+                printf("BRDA:%d,%d,0,-\n", ops[k].mLine, ops[k].mAddress);
+                printf("BRDA:%d,%d,1,-\n", ops[k].mLine, ops[k].mAddress);
+            }
+            branches += 2;
+            branches_hit += ((flags & COVERAGE_TAKEN) != 0) + ((flags & COVERAGE_NOT_TAKEN) != 0);
+        }
+        printf("BRF:%d\nBRH:%d\n", branches, branches_hit);
+
+        // a line ran if any of its operations did
+        for (k = i; k < j; )
+        {
+            int line = ops[k].mLine;
+            int hit = 0;
+            for (; k < j && ops[k].mLine == line; k++)
+            {
+                if (aCoverage->mFlags[ops[k].mAddress] & COVERAGE_RUN)
+                    hit = 1;
+            }
+            printf("DA:%d,%d\n", line, hit);
+            lines++;
+            lines_hit += hit;
+        }
+        printf("LF:%d\nLH:%d\n", lines, lines_hit);
+        printf("end_of_record\n");
+    }
+}
+
+static void write_summary(struct em8051coverage *aCoverage)
+{
+    int run = 0;
+    int branches = 0;
+    int both = 0;
+    int i;
+
+    for (i = 0; i < 65536; i++)
+    {
+        int flags = aCoverage->mFlags[i];
+        if (flags & COVERAGE_RUN)
+            run++;
+        if (flags & (COVERAGE_TAKEN | COVERAGE_NOT_TAKEN))
+            branches++;
+        if ((flags & COVERAGE_TAKEN) && (flags & COVERAGE_NOT_TAKEN))
+            both++;
+    }
+    printf("Operations run at %d addresses\n", run);
+    printf("Conditional jumps run: %d, both ways: %d\n", branches, both);
+
+    for (i = 0; i < 65536; i++)
+    {
+        int flags = aCoverage->mFlags[i] & (COVERAGE_TAKEN | COVERAGE_NOT_TAKEN);
+        if (flags == COVERAGE_TAKEN)
+            printf("  %04X  always taken\n", i);
+        if (flags == COVERAGE_NOT_TAKEN)
+            printf("  %04X  never taken\n", i);
+    }
+}
+
+int main(int parc, char ** pars)
+{
+    struct em8051 emu;
+    struct em8051coverage *coverage;
+    char *savefile = NULL;
+    int listings = 0;
+    int inputs = 0;
+    int i;
+
+    coverage = calloc(1, sizeof(struct em8051coverage));
+
+    // only for decode()
+    memset(&emu, 0, sizeof(emu));
+    emu.mCodeMem     = malloc(65536);
+    emu.mCodeMemSize = 65536;
+    emu.mExtData     = NULL;
+    emu.mExtDataSize = 0;
+    emu.mLowerData   = malloc(128);
+    emu.mUpperData   = malloc(128);
+    emu.mSFR         = malloc(128);
+    if (!coverage || !emu.mCodeMem || !emu.mLowerData || !emu.mUpperData || !emu.mSFR)
+    {
+        printf("Out of memory\n");
+        return -1;
+    }
+    reset(&emu, 1);
+
+    for (i = 1; i < parc; i++)
+    {
+        if (pars[i][0] == '-')
+        {
+            if (strncmp("listing=",pars[i]+1,8) == 0)
+            {
+                if (read_listing(&emu, pars[i]+9) != 0)
+                {
+                    printf("File '%s' load failure\n", pars[i]+9);
+                    return -1;
+                }
+                listings++;
+            }
+            else
+            if (strncmp("save=",pars[i]+1,5) == 0)
+            {
+                savefile = pars[i]+6;
+            }
+            else
+            {
+                printf("Help:\n\n"
+                    "emu8051-cover [options] coveragefile [coveragefile...]\n\n"
+                    "Adds up the coverage files written by emu8051-batch -coverage. Without\n"
+                    "listings, prints how many addresses ran and the conditional jumps that\n"
+                    "only went one way; with them, prints LCOV tracefile data for the source\n"
+                    "lines. Available options:\n\n"
+                    "Option            Alternate   description\n"
+                    "-listing=file                 Map addresses to lines through an SDCC .rst\n"
+                    "                              or ASEM-51 .lst listing; may be repeated\n"
+                    "-save=file                    Save the added up coverage to file\n"
+                    );
+                return -1;
+            }
+        }
+        else
+        {
+            if (coverage_load(coverage, pars[i]) != 0)
+            {
+                printf("File '%s' is not a coverage file\n", pars[i]);
+                return -1;
+            }
+            inputs++;
+        }
+    }
+
+    if (inputs == 0)
+    {
+        printf("No file given; try emu8051-cover -help\n");
+        return -1;
+    }
+
+    if (savefile && coverage_save(coverage, savefile) != 0)
+    {
+        printf("File '%s' save failure\n", savefile);
+        return -1;
+    }
+
+    if (listings)
+        write_lcov(coverage);
+    else
+        write_summary(coverage);
+    return 0;
+}
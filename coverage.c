@@ -0,0 +1,168 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * coverage.c
+ * Code coverage; which operations ran, and which ways branches went
+ */
+
+// coverage_tick() marks the code address of each operation tick() runs,
+// and for conditional jumps whether the jump was taken, going by where PC
+// ends up; a jump to the next operation counts as not taken. Like the
+// profiler, runs without coverage never come here.
+//
+// A coverage file is "EM8051CV", a 32 bit little-endian version, and the
+// 64K COVERAGE_FLAGS bytes, one per code address. Loading ORs the file
+// into what is already there, so that runs can be added up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#define COVERAGE_MAGIC "EM8051CV"
+#define COVERAGE_VERSION 1
+
+int coverage_branch(int aOpcode)
+{
+    switch (aOpcode)
+    {
+    case 0x40: // JC
+    case 0x50: // JNC
+    case 0x60: // JZ
+    case 0x70: // JNZ
+    case 0xd8: case 0xd9: case 0xda: case 0xdb: // DJNZ Rn
+    case 0xdc: case 0xdd: case 0xde: case 0xdf:
+        return 2;
+    case 0x10: // JBC
+    case 0x20: // JB
+    case 0x30: // JNB
+    case 0xd5: // DJNZ direct
+    case 0xb4: case 0xb5: case 0xb6: case 0xb7: // CJNE
+    case 0xb8: case 0xb9: case 0xba: case 0xbb:
+    case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+        return 3;
+    }
+    return 0;
+}
+
+int coverage_tick(struct em8051 *aCPU, struct em8051coverage *aCoverage)
+{
+    int pc = aCPU->mPC & 0xffff;
+    int opcode = aCPU->mCodeMem[pc & (aCPU->mCodeMemSize - 1)];
+    int ticked;
+    int length;
+
+    // if an operation runs, it's the one at PC
+    ticked = tick(aCPU);
+    if (ticked)
+    {
+        aCoverage->mFlags[pc] |= COVERAGE_RUN;
+        length = coverage_branch(opcode);
+        if (length)
+        {
+            if ((aCPU->mPC & 0xffff) == ((pc + length) & 0xffff))
+                aCoverage->mFlags[pc] |= COVERAGE_NOT_TAKEN;
+            else
+                aCoverage->mFlags[pc] |= COVERAGE_TAKEN;
+        }
+    }
+    return ticked;
+}
+
+int coverage_run(struct em8051 *aCPU, struct em8051coverage *aCoverage, int aCycles, int aBreakpoint)
+{
+    int cycles = 0;
+
+    aCPU->mStop = 0;
+    while (cycles < aCycles)
+    {
+        // idle and power-down ticks don't run operations; skip them
+        if (aCPU->mTickDelay <= 1 && (aCPU->mSFR[REG_PCON] & (PCON_IDL_MASK | PCON_PD_MASK)))
+        {
+            int skip = idle_skip(aCPU, aCycles - cycles);
+            cycles += skip;
+            if (skip)
+                continue;
+        }
+
+        cycles++;
+        if (coverage_tick(aCPU, aCoverage) && (aCPU->mPC & 0xffff) == aBreakpoint)
+            aCPU->mStop = 1;
+        if (aCPU->mStop)
+            break;
+    }
+    return cycles;
+}
+
+int coverage_load(struct em8051coverage *aCoverage, char *aFilename)
+{
+    unsigned char header[12];
+    unsigned char *flags;
+    FILE *f;
+    int i;
+
+    f = fopen(aFilename, "rb");
+    if (!f)
+        return -1;
+    flags = malloc(65536);
+    if (!flags ||
+        fread(header, sizeof(header), 1, f) != 1 ||
+        memcmp(header, COVERAGE_MAGIC, 8) != 0 ||
+        (header[8] | (header[9] << 8) | (header[10] << 16) | (header[11] << 24)) != COVERAGE_VERSION ||
+        fread(flags, 65536, 1, f) != 1)
+    {
+        free(flags);
+        fclose(f);
+        return -2;
+    }
+    fclose(f);
+
+    for (i = 0; i < 65536; i++)
+        aCoverage->mFlags[i] |= flags[i];
+    free(flags);
+    return 0;
+}
+
+int coverage_save(struct em8051coverage *aCoverage, char *aFilename)
+{
+    unsigned char header[12];
+    FILE *f;
+    int result = 0;
+
+    memcpy(header, COVERAGE_MAGIC, 8);
+    header[8] = COVERAGE_VERSION & 0xff;
+    header[9] = (COVERAGE_VERSION >> 8) & 0xff;
+    header[10] = (COVERAGE_VERSION >> 16) & 0xff;
+    header[11] = (COVERAGE_VERSION >> 24) & 0xff;
+
+    f = fopen(aFilename, "wb");
+    if (!f)
+        return -1;
+    if (fwrite(header, sizeof(header), 1, f) != 1 ||
+        fwrite(aCoverage->mFlags, 65536, 1, f) != 1)
+        result = -1;
+    if (fclose(f) != 0)
+        result = -1;
+    return result;
+}
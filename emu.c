@@ -45,38 +45,12 @@
 #include "emu8051.h"
 #include "emulator.h"
 
-unsigned char history[HISTORY_LINES * (128 + 64 + sizeof(int))];
-
-
-// current line in the history cyclic buffers
-int historyline = 0;
 // last known columns and rows; for screen resize detection
 int oldcols, oldrows;
-// are we in single-step or run mode
-int runmode = 0;
-// current run speed, lower is faster
-int speed = 6;
-
-// instruction count; needed to replay history correctly
-unsigned int icount = 0;
-
-// current clock count
-unsigned int clocks = 0;
 
 // currently active view
 int view = MAIN_VIEW;
 
-// old port out values
-int p0out = 0;
-int p1out = 0;
-int p2out = 0;
-int p3out = 0;
-int p4out = 0;
-int p5out = 0;
-int p6out = 0;
-
-int breakpoint = -1;
-
 // returns time in 1ms units
 int getTick()
 {
@@ -172,80 +146,81 @@ void setSpeed(int speed, int runmode)
 
 
 
-int emu_sfrread(struct em8051 *aCPU, int aRegister)
+static int port_read(struct em8051 *aCPU, int aRegister)
 {
+    struct emu_context *ctx = aCPU->mContext;
     int outputbyte = -1;
 
     if (view == LOGICBOARD_VIEW)
     {
         if (aRegister == REG_P0 + 0x80)
         {
-            outputbyte = p0out;
+            outputbyte = ctx->p0out;
         }
         if (aRegister == REG_P1 + 0x80)
         {
-            outputbyte =  p1out;
+            outputbyte =  ctx->p1out;
         }
         if (aRegister == REG_P2 + 0x80)
         {
-            outputbyte =  p2out;
+            outputbyte =  ctx->p2out;
         }
         if (aRegister == REG_P3 + 0x80)
         {
-            outputbyte =  p3out;
+            outputbyte =  ctx->p3out;
         }
         if (aRegister == REG_P4 + 0x80)
         {
-            outputbyte =  p4out;
+            outputbyte =  ctx->p4out;
         }
         if (aRegister == REG_P5 + 0x80)
         {
-            outputbyte =  p5out;
+            outputbyte =  ctx->p5out;
         }
         if (aRegister == REG_P6 + 0x80)
         {
-            outputbyte =  p6out;
+            outputbyte =  ctx->p6out;
         }
     }
     else
     {
         if (aRegister == REG_P0 + 0x80)
         {
-            outputbyte = p0out = emu_readvalue(aCPU, "P0 port read", p0out, 2);
+            outputbyte = ctx->p0out = emu_readvalue(aCPU, "P0 port read", ctx->p0out, 2);
         }
         if (aRegister == REG_P1 + 0x80)
         {
-            outputbyte = p1out = emu_readvalue(aCPU, "P1 port read", p1out, 2);
+            outputbyte = ctx->p1out = emu_readvalue(aCPU, "P1 port read", ctx->p1out, 2);
         }
         if (aRegister == REG_P2 + 0x80)
         {
-            outputbyte = p2out = emu_readvalue(aCPU, "P2 port read", p2out, 2);
+            outputbyte = ctx->p2out = emu_readvalue(aCPU, "P2 port read", ctx->p2out, 2);
         }
         if (aRegister == REG_P3 + 0x80)
         {
-            outputbyte = p3out = emu_readvalue(aCPU, "P3 port read", p3out, 2);
+            outputbyte = ctx->p3out = emu_readvalue(aCPU, "P3 port read", ctx->p3out, 2);
         }
         if (aRegister == REG_P4 + 0x80)
         {
-            outputbyte = p4out = emu_readvalue(aCPU, "P4 port read", p4out, 2);
+            outputbyte = ctx->p4out = emu_readvalue(aCPU, "P4 port read", ctx->p4out, 2);
         }
         if (aRegister == REG_P5 + 0x80)
         {
-            outputbyte = p5out = emu_readvalue(aCPU, "P5 port read", p5out, 2);
+            outputbyte = ctx->p5out = emu_readvalue(aCPU, "P5 port read", ctx->p5out, 2);
         }
         if (aRegister == REG_P6 + 0x80)
         {
-            outputbyte = p6out = emu_readvalue(aCPU, "P6 port read", p6out, 2);
+            outputbyte = ctx->p6out = emu_readvalue(aCPU, "P6 port read", ctx->p6out, 2);
         }
     }
     if (outputbyte != -1)
     {
-        if (opt_input_outputlow == 1)
+        if (ctx->opt_input_outputlow == 1)
         {
             // option: output 1 even though ouput latch is 0
             return outputbyte;
         }
-        if (opt_input_outputlow == 0)
+        if (ctx->opt_input_outputlow == 0)
         {
             // option: output 0 if output latch is 0
             return outputbyte & aCPU->mSFR[aRegister - 0x80];
@@ -259,6 +234,24 @@ int emu_sfrread(struct em8051 *aCPU, int aRegister)
 
 }
 
+int emu_sfrread(struct em8051 *aCPU, int aRegister)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    int value;
+
+    // port reads are the input; record them so that replays read the same
+    if (aRegister != REG_P0 + 0x80 && aRegister != REG_P1 + 0x80 &&
+        aRegister != REG_P2 + 0x80 && aRegister != REG_P3 + 0x80 &&
+        aRegister != REG_P4 + 0x80 && aRegister != REG_P5 + 0x80 &&
+        aRegister != REG_P6 + 0x80)
+        return aCPU->mSFR[aRegister - 0x80];
+    if (ctx->reverse.replaying)
+        return reverse_replay_input(aCPU);
+    value = port_read(aCPU, aRegister);
+    reverse_record_input(aCPU, value);
+    return value;
+}
+
 void refreshview(struct em8051 *aCPU)
 {
     change_view(aCPU, view);
@@ -272,7 +265,7 @@ void change_view(struct em8051 *aCPU, int changeto)
         wipe_main_view();
         break;
     case LOGICBOARD_VIEW:
-        wipe_logicboard_view();
+        wipe_logicboard_view(aCPU);
         break;
     case MEMEDITOR_VIEW:
         wipe_memeditor_view();
@@ -299,12 +292,38 @@ void change_view(struct em8051 *aCPU, int changeto)
     }
 }
 
+void emu_context_init(struct emu_context *aContext)
+{
+    memset(aContext, 0, sizeof(struct emu_context));
+    aContext->speed = 6;
+    aContext->breakpoint = -1;
+
+    aContext->opt_exception_iret_sp = 1;
+    aContext->opt_exception_iret_acc = 1;
+    aContext->opt_exception_iret_psw = 1;
+    aContext->opt_exception_acc_to_a = 1;
+    aContext->opt_exception_stack = 1;
+    aContext->opt_exception_invalid = 1;
+    aContext->opt_input_outputlow = 1;
+    aContext->opt_clock_select = 3;
+    aContext->opt_clock_hz = 12*1000*1000;
+
+    aContext->logicboard.chardisplaydir = 1;
+    aContext->logicboard.chardisplaydcb = 7;
+}
+
 int main(int parc, char ** pars)
 {
     int ch = 0;
     struct em8051 emu;
+    struct emu_context context;
+    struct emu_context *ctx = &context;
     int i;
     int ticked = 1;
+    int history = 32;
+    int lines = HISTORY_DEFAULT;
+
+    emu_context_init(ctx);
 
     memset(&emu, 0, sizeof(emu));
     emu.mCodeMem     = malloc(65536);
@@ -314,10 +333,12 @@ int main(int parc, char ** pars)
     emu.mLowerData   = malloc(128);
     emu.mUpperData   = malloc(128);
     emu.mSFR         = malloc(128);
+    emu.mDecoded     = calloc(65536, sizeof(struct em8051decoded));
     emu.except       = &emu_exception;
     emu.sfrread      = &emu_sfrread;
     emu.xread = NULL;
     emu.xwrite = NULL;
+    emu.mContext = ctx;
     reset(&emu, 1);
 
     if (parc > 1)
@@ -328,90 +349,114 @@ int main(int parc, char ** pars)
             {
                 if (strcmp("step_instruction",pars[i]+1) == 0)
                 {
-                    opt_step_instruction = 1;
+                    ctx->opt_step_instruction = 1;
                 }
                 else
                 if (strcmp("si",pars[i]+1) == 0)
                 {
-                    opt_step_instruction = 1;
+                    ctx->opt_step_instruction = 1;
                 }
                 else
                 if (strcmp("noexc_iret_sp",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_sp = 0;
+                    ctx->opt_exception_iret_sp = 0;
                 }
                 else
                 if (strcmp("nosp",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_sp = 0;
+                    ctx->opt_exception_iret_sp = 0;
                 }
                 else
                 if (strcmp("noexc_iret_acc",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_acc = 0;
+                    ctx->opt_exception_iret_acc = 0;
                 }
                 else
                 if (strcmp("noacc",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_acc = 0;
+                    ctx->opt_exception_iret_acc = 0;
                 }
                 else
                 if (strcmp("noexc_iret_psw",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_psw = 0;
+                    ctx->opt_exception_iret_psw = 0;
                 }
                 else
                 if (strcmp("nopsw",pars[i]+1) == 0)
                 {
-                    opt_exception_iret_psw = 0;
+                    ctx->opt_exception_iret_psw = 0;
                 }
                 else
                 if (strcmp("noexc_acc_to_a",pars[i]+1) == 0)
                 {
-                    opt_exception_acc_to_a = 0;
+                    ctx->opt_exception_acc_to_a = 0;
                 }
                 else
                 if (strcmp("noaa",pars[i]+1) == 0)
                 {
-                    opt_exception_acc_to_a = 0;
+                    ctx->opt_exception_acc_to_a = 0;
                 }
                 else
                 if (strcmp("noexc_stack",pars[i]+1) == 0)
                 {
-                    opt_exception_stack = 0;
+                    ctx->opt_exception_stack = 0;
                 }
                 else
                 if (strcmp("nostk",pars[i]+1) == 0)
                 {
-                    opt_exception_stack = 0;
+                    ctx->opt_exception_stack = 0;
                 }
                 else
                 if (strcmp("noexc_invalid_op",pars[i]+1) == 0)
                 {
-                    opt_exception_invalid = 0;
+                    ctx->opt_exception_invalid = 0;
                 }
                 else
                 if (strcmp("noiop",pars[i]+1) == 0)
                 {
-                    opt_exception_invalid = 0;
+                    ctx->opt_exception_invalid = 0;
                 }
                 else
                 if (strcmp("iolowlow",pars[i]+1) == 0)
                 {
-                    opt_input_outputlow = 0;
+                    ctx->opt_input_outputlow = 0;
                 }
                 else
                 if (strcmp("iolowrand",pars[i]+1) == 0)
                 {
-                    opt_input_outputlow = 2;
+                    ctx->opt_input_outputlow = 2;
+                }
+                else
+                if (strncmp("history=",pars[i]+1,8) == 0)
+                {
+                    history = atoi(pars[i]+9);
+                    if (history < 0)
+                        history = 0;
+                }
+                else
+                if (strncmp("lines=",pars[i]+1,6) == 0)
+                {
+                    lines = atoi(pars[i]+7);
+                    if (lines < HISTORY_LINES)
+                        lines = HISTORY_LINES;
+                }
+                else
+                if (strncmp("profile=",pars[i]+1,8) == 0)
+                {
+                    ctx->profilefile = pars[i]+9;
+                }
+                else
+                if (strncmp("stacks=",pars[i]+1,7) == 0)
+                {
+                    ctx->stacksfile = pars[i]+8;
                 }
                 else
                 if (strncmp("clock=",pars[i]+1,6) == 0)
                 {
-                    opt_clock_select = 12;
-                    opt_clock_hz = atoi(pars[i]+7);
-                    if (opt_clock_hz <= 0)
-                        opt_clock_hz = 1;
+                    ctx->opt_clock_select = 12;
+                    ctx->opt_clock_hz = atoi(pars[i]+7);
+                    if (ctx->opt_clock_hz <= 0)
+                        ctx->opt_clock_hz = 1;
                 }
                 else
                 {
@@ -429,6 +474,14 @@ int main(int parc, char ** pars)
                         "-iolowlow         If out pin is low, hi input from same pin is low\n"
                         "-iolowrand        If out pin is low, hi input from same pin is random\n"
                         "-clock=value      Set clock speed, in Hz\n"
+                        "-history=value    Memory for stepping backwards, in megabytes\n"
+                        "                  (default 32, 0 to disable)\n"
+                        "-lines=value      Operations to keep in the execution history\n"
+                        "                  (default 100000)\n"
+                        "-profile=file     Write the operations and cycles spent per opcode,\n"
+                        "                  per function and per address to file on exit\n"
+                        "-stacks=file      Write the cycles spent per call stack to file on\n"
+                        "                  exit, in the collapsed format flame graph tools read\n"
                         );
                     return -1;
                 }
@@ -442,12 +495,18 @@ int main(int parc, char ** pars)
                 }
                 else
                 {
-                    strcpy(filename, pars[i]);
+                    strcpy(ctx->filename, pars[i]);
                 }
             }
         }
     }
 
+    if (ctx->profilefile || ctx->stacksfile)
+        ctx->profile = profile_create();
+
+    history_init(&emu, lines);
+    reverse_init(&emu, history * 1024 * 1024);
+
     //  Initialize ncurses
 
     slk_init(1);
@@ -463,7 +522,7 @@ int main(int parc, char ** pars)
     slk_set(6, "v)iew", 0);
     slk_set(7, "home=rst", 0);
     slk_set(8, "s-Q)quit", 0);
-    setSpeed(speed, runmode);
+    setSpeed(ctx->speed, ctx->runmode);
 
 
     //  Switch of echoing and enable keypad (for arrow keys etc)
@@ -501,71 +560,96 @@ int main(int parc, char ** pars)
             change_view(&emu, (view + 1) % 4);
             break;
         case 'k':
-            if (breakpoint != -1)
+            if (ctx->breakpoint != -1)
             {
-                breakpoint = -1;
+                ctx->breakpoint = -1;
                 emu_popup(&emu, "Breakpoint", "Breakpoint cleared.");
             }
             else
             {
-                breakpoint = emu_readvalue(&emu, "Set Breakpoint", emu.mPC, 4);
+                ctx->breakpoint = emu_readvalue(&emu, "Set Breakpoint", emu.mPC, 4);
             }
             break;
         case 'g':
             emu.mPC = emu_readvalue(&emu, "Set Program Counter", emu.mPC, 4);
+            reverse_edited(&emu);
             break;
         case 'h':
             emu_help(&emu);
             break;
         case 'l':
             emu_load(&emu);
+            reverse_edited(&emu);
             break;
         case 'L':
             mem_load(&emu);
+            reverse_edited(&emu);
             break;                        
+        case 's':
+            state_file(&emu, 1);
+            break;
+        case 'S':
+            state_file(&emu, 0);
+            reverse_edited(&emu);
+            break;
+        case 'p':
+            ctx->runmode = 0;
+            setSpeed(ctx->speed, ctx->runmode);
+            if (!reverse_step(&emu))
+                emu_popup(&emu, "Step back", "No earlier state recorded.");
+            refreshview(&emu);
+            break;
+        case 'P':
+            ctx->runmode = 0;
+            setSpeed(ctx->speed, ctx->runmode);
+            if (!reverse_continue(&emu))
+                emu_popup(&emu, "Run back", "No earlier state recorded.");
+            refreshview(&emu);
+            break;
         case ' ':
-            runmode = 0;
-            setSpeed(speed, runmode);
+            ctx->runmode = 0;
+            setSpeed(ctx->speed, ctx->runmode);
             break;
         case 'r':
-            if (runmode)
+            if (ctx->runmode)
             {
-                runmode = 0;
-                setSpeed(speed, runmode);
+                ctx->runmode = 0;
+                setSpeed(ctx->speed, ctx->runmode);
             }
             else
             {
-                runmode = 1;
-                setSpeed(speed, runmode);
+                ctx->runmode = 1;
+                setSpeed(ctx->speed, ctx->runmode);
             }
             break;
 #ifdef __PDCURSES__
         case PADPLUS:
 #endif
         case '+':
-            speed--;
-            if (speed < 0)
-                speed = 0;
-            setSpeed(speed, runmode);
+            ctx->speed--;
+            if (ctx->speed < 0)
+                ctx->speed = 0;
+            setSpeed(ctx->speed, ctx->runmode);
             break;
 #ifdef __PDCURSES__
         case PADMINUS:
 #endif
         case '-':
-            speed++;
-            if (speed > 7)
-                speed = 7;
-            setSpeed(speed, runmode);
+            ctx->speed++;
+            if (ctx->speed > 7)
+                ctx->speed = 7;
+            setSpeed(ctx->speed, ctx->runmode);
             break;
         case KEY_HOME:
             if (emu_reset(&emu))
             {
-                clocks = 0;
+                ctx->clocks = 0;
                 ticked = 1;
+                reverse_edited(&emu);
             }
             break;
         case KEY_END:
-            clocks = 0;
+            ctx->clocks = 0;
             ticked = 1;
             break;
         default:
@@ -588,60 +672,74 @@ int main(int parc, char ** pars)
             break;
         }
 
-        if (ch == 32 || runmode)
+        // the keys may have edited the timer registers; reschedule
+        timer_sync(&emu);
+
+        if (ch == 32 || ctx->runmode)
         {
             int targettime;
             unsigned int targetclocks;
             targetclocks = 1;
             targettime = getTick();
 
-            if (speed == 2 && runmode)
+            if (ctx->speed == 2 && ctx->runmode)
             {
                 targettime += 1;
-                targetclocks += (opt_clock_hz / 12000) - 1;
+                targetclocks += (ctx->opt_clock_hz / 12000) - 1;
             }
-            if (speed < 2 && runmode)
+            if (ctx->speed < 2 && ctx->runmode)
             {
                 targettime += 10;
-                targetclocks += (opt_clock_hz / 1200) - 1;
+                targetclocks += (ctx->opt_clock_hz / 1200) - 1;
             }
 
             do
             {
                 int old_pc;
+                int ran = 0;
                 old_pc = emu.mPC;
-                if (opt_step_instruction)
+                if (ctx->opt_step_instruction)
                 {
-                    ticked = 0;
-                    while (!ticked)
+                    // in idle or power-down mode there may be no
+                    // operation to step to; step a tick instead
+                    do
                     {
                         targetclocks--;
-                        clocks += 12;
-                        ticked = tick(&emu);
+                        ctx->clocks += 12;
+                        ticked = ctx->profile ? profile_tick(&emu, ctx->profile) : tick(&emu);
                         logicboard_tick(&emu);
+                        ran++;
                     }
+                    while (!ticked && !(emu.mSFR[REG_PCON] & (PCON_IDL_MASK | PCON_PD_MASK)));
                 }
                 else
                 {
+                    int idle = 0;
+                    // a wait loop; run up to the next timer overflow at once,
+                    // unless every operation has to be counted
+                    if (emu.mPC != ctx->breakpoint && !ctx->profile)
+                    {
+                        idle = idle_skip(&emu, targetclocks - 1);
+                        targetclocks -= idle;
+                        ctx->clocks += 12 * idle;
+                        logicboard_skip(&emu, idle);
+                    }
                     targetclocks--;
-                    clocks += 12;
-                    ticked = tick(&emu);
+                    ctx->clocks += 12;
+                    ticked = ctx->profile ? profile_tick(&emu, ctx->profile) : tick(&emu);
                     logicboard_tick(&emu);
+                    ran = idle + 1;
                 }
 
-                if (emu.mPC == breakpoint)
+                if (emu.mPC == ctx->breakpoint)
                     emu_exception(&emu, -1);
 
                 if (ticked)
                 {
-                    icount++;
-
-                    historyline = (historyline + 1) % HISTORY_LINES;
-
-                    memcpy(history + (historyline * (128 + 64 + sizeof(int))), emu.mSFR, 128);
-                    memcpy(history + (historyline * (128 + 64 + sizeof(int))) + 128, emu.mLowerData, 64);
-                    memcpy(history + (historyline * (128 + 64 + sizeof(int))) + 128 + 64, &old_pc, sizeof(int));
+                    history_add(&emu, old_pc);
                 }
+
+                reverse_ran(&emu, ran);
             }
             while (targettime > getTick() && targetclocks > 0);
 
@@ -651,6 +749,9 @@ int main(int parc, char ** pars)
             }
         }
 
+        // bring the timer registers up to date for display and editing
+        timer_sync(&emu);
+
         switch (view)
         {
         case MAIN_VIEW:
@@ -671,5 +772,17 @@ int main(int parc, char ** pars)
 
     endwin();
 
+    logicboard_close(&emu);
+
+    if (ctx->profile && ctx->profilefile && profile_report(&emu, ctx->profile, ctx->profilefile, -1) != 0)
+    {
+        printf("File '%s' save failure\n", ctx->profilefile);
+    }
+
+    if (ctx->profile && ctx->stacksfile && profile_stacks(ctx->profile, ctx->stacksfile) != 0)
+    {
+        printf("File '%s' save failure\n", ctx->stacksfile);
+    }
+
     return EXIT_SUCCESS;
 }
@@ -27,6 +27,9 @@
  */
 
 struct em8051;
+struct em8051jit;
+struct em8051snapshot;
+struct em8051trace;
 
 // Operation: returns number of ticks the operation should take
 typedef int (*em8051operation)(struct em8051 *aCPU); 
@@ -56,6 +59,63 @@ typedef void (*em8051xwrite)(struct em8051 *aCPU, int aAddress, int aValue);
 // (can be used to control some peripherals)
 typedef int (*em8051xread)(struct em8051 *aCPU, int aAddress);
 
+// Predecoded operation, filled in the first time the code address is run
+struct em8051decoded
+{
+    em8051operation mOp; // opcode handler
+    unsigned char mLength; // operation length in bytes; 0 if not decoded yet
+    unsigned char mTicks; // ticks the operation delays (handler return value)
+    unsigned char mFlags; // see DECODED_FLAGS enum, below
+};
+
+// One record of an execution trace; see trace.c
+struct em8051tracerecord
+{
+    unsigned int mTicks; // ticks since the trace started, before this one; wraps around
+    int mType; // see TRACE_TYPES enum, below
+    int mPC;
+    unsigned char mCode[3]; // opcode and operands; zero past the length
+    unsigned char mACC; // registers after the operation
+    unsigned char mPSW;
+    unsigned char mSP;
+    int mDPTR;
+    int mWrites; // memory writes, other than to ACC, PSW and SP; 0 to 2
+    int mSpace[2]; // see TRACE_SPACES enum, below
+    int mAddress[2];
+    unsigned char mValue[2];
+};
+
+struct em8051profilenode;
+
+enum PROFILE_LIMITS
+{
+    PROFILE_DEPTH = 64 // calls deep the profiler follows; deeper calls count as their caller
+};
+
+// Execution counts; see profile.c. Created by profile_create().
+struct em8051profile
+{
+    unsigned long long mOpCount[256]; // operations run, per opcode
+    unsigned long long mOpCycles[256]; // ticks they took
+    unsigned long long mPCCount[65536]; // operations run, per code address
+    unsigned long long mPCCycles[65536];
+
+    // call stacks seen, and the ticks spent in each
+    struct em8051profilenode *mNodes;
+    int mNodeCount;
+    int mNodeSpace;
+    // the shadow call stack; node, and SP with the return address on the
+    // stack (-1 for the bottom)
+    int mStackNode[PROFILE_DEPTH];
+    int mStackSP[PROFILE_DEPTH];
+    int mDepth;
+};
+
+// Code coverage; see coverage.c. Zero it to start.
+struct em8051coverage
+{
+    unsigned char mFlags[65536]; // per code address; see COVERAGE_FLAGS enum, below
+};
 
 struct em8051
 {
@@ -75,9 +135,21 @@ struct em8051
     em8051sfrwrite sfrwrite; // callback: SFR register written
     em8051xread xread; // callback: external memory being read
     em8051xwrite xwrite; // callback: external memory being written
+    void *mContext; // front-end data for the callbacks; not touched by the core
+    int mStop; // set by callbacks to make run_cycles() return early
+    int mTimerTicks; // ticks since the timer registers were last updated
+    int mTimerEvent; // mTimerTicks value at which the next timer overflow is due
+    struct em8051decoded *mDecoded; // mCodeMemSize zeroed records; NULL to not predecode
+    struct em8051jit *mJit; // from jit_create(); NULL to only interpret
+    int mFlagsOp; // PENDING_FLAGS of the last ADD, ADDC or SUBB; FLAGS_NONE outside the core
+    int mFlagsValue1; // its operands
+    int mFlagsValue2;
+    unsigned char *mDirty; // one flag per EM8051_PAGE_SIZE bytes of code memory, then of external memory; NULL to not track. See snapshot_create()
+    struct em8051snapshot *mSnapshot; // snapshot that mDirty tells the changes from
 
     // Internal values for interrupt services etc.
     int mInterruptActive;
+    int mInterruptPending; // 1 if an interrupt may be due, 2 in idle or power-down mode; see timer_sync()
     // Stored register values for interrupts (exception checking)
     int int_a[2];
     int int_psw[2];
@@ -93,6 +165,55 @@ void reset(struct em8051 *aCPU, int aWipe);
 // returns 1 if a new operation was executed.
 int tick(struct em8051 *aCPU);
 
+// run up to aCycles emulator ticks; same results as calling tick() aCycles
+// times. Returns early, with mStop set, after an operation that leaves PC
+// at aBreakpoint (-1 for none) or during which a callback set mStop.
+// Returns the number of ticks actually run.
+int run_cycles(struct em8051 *aCPU, int aCycles, int aBreakpoint);
+
+// run aCount emulators in turn for up to aCycles ticks each, with the same
+// results as calling run_cycles() on each. Each emulator runs a few hundred
+// ticks per turn, one after the other; they are not stepped together. When
+// they run the same firmware (for a parameter sweep), each stretch of code
+// is then run by all of them while it is in the cache, which only pays off
+// for firmware too large for the cache. Give them the same mCodeMem and
+// mDecoded to share those; they must then not write code memory. aRan
+// receives the ticks each one ran. Stepping them together in lanes, for
+// a sweep to run several times faster, is yet to be done.
+void run_interleaved(struct em8051 **aCPUs, int aCount, int aCycles, int aBreakpoint, int *aRan);
+
+// if the CPU is waiting in an idle loop (a jump to itself, or a JB/JNB to
+// itself on a RAM or TCON bit), or in idle mode (PCON.0), run up to aCycles
+// ticks at once, stopping before the next timer overflow. In power-down
+// mode (PCON.1) all of aCycles pass. For front-ends calling tick(); call
+// between ticks. Returns the number of ticks run, 0 if not idle.
+// run_cycles() does this by itself.
+int idle_skip(struct em8051 *aCPU, int aCycles);
+
+// bring the timer registers (TL0, TH0, TL1, TH1 and the TCON flags) up to
+// date and schedule the next timer overflow. The core does this by itself;
+// call it before reading, and again after changing, the timer registers
+// from outside the core. Call it after changing the interrupt registers
+// (IEN0, TCON) or PCON from outside the core as well.
+void timer_sync(struct em8051 *aCPU);
+
+// bring the parity, carry, auxiliary carry and overflow flags in PSW up to
+// date. tick() and run_cycles() do this before returning; call it after
+// changing ACC from outside the core, before reading PSW.
+void psw_sync(struct em8051 *aCPU);
+
+// forget the predecoded operations and translated blocks covering aLength
+// bytes of code memory from aAddress. Call after changing code memory, if
+// mDecoded or mJit is used.
+void predecode_invalidate(struct em8051 *aCPU, int aAddress, int aLength);
+
+// create a translator that run_cycles() uses to run straight-line code
+// natively. Needs mDecoded. Returns NULL if the host is not supported.
+struct em8051jit *jit_create(struct em8051 *aCPU);
+
+// free a translator from jit_create()
+void jit_destroy(struct em8051jit *aJit);
+
 // decode the next operation as character string.
 // buffer must be big enough (64 bytes is very safe). 
 // Returns length of opcode.
@@ -101,12 +222,191 @@ int decode(struct em8051 *aCPU, int aPosition, unsigned char *aBuffer);
 // Load an intel hex format object file. Returns negative for errors.
 int load_obj(struct em8051 *aCPU, char *aFilename);
 
+// Load a raw binary file into external memory. Returns negative for errors.
+int load_mem(struct em8051 *aCPU, char *aFilename);
+
+// Snapshots of the whole machine state, with aExtraSize bytes of front-end
+// data (such as peripherals) from aExtra stored along; see state.c for the
+// format. Returns the buffer size em8051_save_state_mem() needs; aFlags are
+// STATE_FLAGS.
+int em8051_state_size(struct em8051 *aCPU, int aFlags, int aExtraSize);
+
+// Save a snapshot into aBuffer. Without STATE_CODE code memory is left out,
+// for in-memory snapshots of firmware that doesn't change it. Returns the
+// number of bytes written.
+int em8051_save_state_mem(struct em8051 *aCPU, unsigned char *aBuffer, int aFlags, const void *aExtra, int aExtraSize);
+
+// Restore a snapshot of aSize bytes. Memory sizes must match the ones it was
+// saved with; code memory is kept if it was left out. The front-end data is
+// copied to aExtra if it is given and the snapshot has some, in which case
+// aExtraSize must match. Returns negative for errors.
+int em8051_load_state_mem(struct em8051 *aCPU, const unsigned char *aBuffer, int aSize, void *aExtra, int aExtraSize);
+
+// Save a snapshot, including code memory, to a file. Returns negative for errors.
+int em8051_save_state(struct em8051 *aCPU, char *aFilename, const void *aExtra, int aExtraSize);
+
+// Restore a snapshot from a file. Returns negative for errors.
+int em8051_load_state(struct em8051 *aCPU, char *aFilename, void *aExtra, int aExtraSize);
+
+// Copy-on-write snapshots, for forking many emulators from one state. A
+// snapshot keeps memory in EM8051_PAGE_SIZE byte pages, and the pages that
+// haven't changed since the snapshot the emulator was forked from are
+// shared with that one instead of copied. This needs mDirty, which the
+// core sets as operations write external memory and as
+// predecode_invalidate() is told of code memory changes; front-ends
+// writing external memory themselves set its flags too. Both memory sizes
+// must be multiples of EM8051_PAGE_SIZE (or 0 for external memory).
+// Without mDirty, snapshots are full copies. Create and destroy snapshots
+// from one thread; forking from the same snapshot is fine from several.
+
+// Snapshot the emulator, which then counts as forked from it. Returns NULL
+// if out of memory or the memory sizes don't suit.
+struct em8051snapshot *snapshot_create(struct em8051 *aCPU);
+
+// Drop a snapshot from snapshot_create(), freeing the pages no other
+// snapshot shares. Emulators forked from it must not be forked again
+// before their mSnapshot is set to NULL.
+void snapshot_destroy(struct em8051snapshot *aSnapshot);
+
+// Bytes of memory the snapshot holds that no other snapshot shares; what
+// snapshot_destroy() would free.
+int snapshot_size(struct em8051snapshot *aSnapshot);
+
+// Put the emulator into the snapshot's state. With mDirty, only the pages
+// that differ from it are copied. Memory sizes must match the snapshot's.
+// Returns negative for errors.
+int snapshot_fork(struct em8051snapshot *aSnapshot, struct em8051 *aCPU);
+
+// Execution traces, a fixed-size binary record of every operation run and
+// every interrupt started, for looking into afterwards; see trace.c for
+// the format. Records are collected in a large buffer that is written out
+// as it fills.
+
+// Create a trace file for trace_tick() and trace_run(). Returns NULL if
+// the file can't be created.
+struct em8051trace *trace_create(char *aFilename);
+
+// Open a trace file for trace_read(), or as the reference trace_tick() and
+// trace_run() compare a run against. Returns NULL if the file can't be
+// opened or isn't a trace.
+struct em8051trace *trace_open(char *aFilename);
+
+// tick(), writing a record if an operation ran or an interrupt started.
+// With a trace from trace_open(), the record is compared with the next
+// one in the trace instead, and mStop is set if they differ.
+int trace_tick(struct em8051 *aCPU, struct em8051trace *aTrace);
+
+// run_cycles() with trace_tick(); every tick is run, as nothing may be
+// skipped. Stops right after a tick in which a callback set mStop.
+int trace_run(struct em8051 *aCPU, struct em8051trace *aTrace, int aCycles, int aBreakpoint);
+
+// Read the next record. Returns 1 if there was one, 0 at the end of the
+// trace and negative for errors.
+int trace_read(struct em8051trace *aTrace, struct em8051tracerecord *aRecord);
+
+// How a run compares with a trace from trace_open(); see TRACE_COMPARE.
+// Unless it's TRACE_MATCH, fills aExpected (if given) with the record the
+// trace has and aActual (if given) with the one the run made instead.
+int trace_status(struct em8051trace *aTrace, struct em8051tracerecord *aExpected, struct em8051tracerecord *aActual);
+
+// Format a record as a line of text, with the operation disassembled from
+// the recorded bytes. aBuffer should have room for 160 characters. Returns
+// the length of the line.
+int trace_format(struct em8051 *aCPU, struct em8051tracerecord *aRecord, char *aBuffer);
+
+// Write out what is left of the records and close the file. Returns
+// negative if writing the trace failed at any point.
+int trace_close(struct em8051trace *aTrace);
+
+// Profiling, counting the operations run and the ticks they take per opcode,
+// per code address and per call stack; see profile.c.
+
+// Returns NULL if out of memory.
+struct em8051profile *profile_create(void);
+
+void profile_free(struct em8051profile *aProfile);
+
+// tick(), counting the operation it ran, if any
+int profile_tick(struct em8051 *aCPU, struct em8051profile *aProfile);
+
+// run_cycles() with profile_tick(), which sees every operation. Idle and
+// power-down mode still pass at once.
+int profile_run(struct em8051 *aCPU, struct em8051profile *aProfile, int aCycles, int aBreakpoint);
+
+// Write a text report of the opcodes, the functions and the aLines code
+// addresses (-1 for all) that took the most ticks, with the operations
+// disassembled from code memory. Functions are listed with the ticks
+// spent in them and their callees, and in them alone; interrupts are
+// listed on their own, and not counted in the functions they interrupted.
+// Returns negative if the file can't be written.
+int profile_report(struct em8051 *aCPU, struct em8051profile *aProfile, char *aFilename, int aLines);
+
+// Write the ticks spent per call stack, in the collapsed stack format that
+// flame graph tools read: one "main;sub_0123;sub_0456 ticks" line per
+// stack. Returns negative if the file can't be written.
+int profile_stacks(struct em8051profile *aProfile, char *aFilename);
+
+// Code coverage, marking the code addresses operations ran at and which
+// ways conditional jumps went; see coverage.c.
+
+// tick(), marking the operation it ran, if any
+int coverage_tick(struct em8051 *aCPU, struct em8051coverage *aCoverage);
+
+// run_cycles() with coverage_tick(), which sees every operation. Idle and
+// power-down mode still pass at once.
+int coverage_run(struct em8051 *aCPU, struct em8051coverage *aCoverage, int aCycles, int aBreakpoint);
+
+// Add the coverage in a file to aCoverage. Returns -1 if the file can't be
+// opened and -2 if it isn't a coverage file.
+int coverage_load(struct em8051coverage *aCoverage, char *aFilename);
+
+// Returns negative if the file can't be written.
+int coverage_save(struct em8051coverage *aCoverage, char *aFilename);
+
+// Returns the length of aOpcode if it's a conditional jump, 0 if not
+int coverage_branch(int aOpcode);
+
 // Alternate way to execute an opcode (switch-structure instead of function pointers)
 int do_op(struct em8051 *aCPU);
 
 // Internal: Pushes a value into stack
 void push_to_stack(struct em8051 *aCPU, int aValue);
 
+// Internal: Works out mInterruptPending again after IEN0, TCON or PCON
+// may have changed
+void interrupt_update(struct em8051 *aCPU);
+
+// Internal: Returns the DECODED_FLAGS of the operation at aPosition
+int op_flags(struct em8051 *aCPU, int aPosition);
+
+// Internal: Returns the length of aOpcode in bytes
+int op_length(int aOpcode);
+
+// Internal: Returns the ticks one round of the loop at PC takes if it's an
+// idle loop (see idle_skip()), 0 if not
+int op_idle_loop(struct em8051 *aCPU);
+
+// Internal: Works out the memory the operation at PC is about to write,
+// other than ACC, PSW and SP. Fills aSpace (TRACE_SPACES) and aAddress for
+// each write and returns their number, at most 2
+int op_writes(struct em8051 *aCPU, int *aSpace, int *aAddress);
+
+// Internal: Fills in the mDecoded record for the operation at aPosition
+void op_predecode(struct em8051 *aCPU, int aPosition);
+
+// Internal: Forgets translated blocks covering the given code memory bytes
+void jit_invalidate(struct em8051jit *aJit, int aAddress, int aLength);
+
+// Internal: Runs the translated block at PC if it can run without checks
+// between its operations. Returns the ticks used, counting the tick its last
+// operation ran on, and sets aDelay to that operation's delay. Returns 0
+// if nothing was run. aCycles is the budget after the current tick.
+int jit_run(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aDelay);
+
+// Internal: Runs operations from PC with threaded dispatch, while the core's
+// checks between them would do nothing. Returns like jit_run().
+int op_run_threaded(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aDelay);
+
 // SAB 80C515/80C535 Special Function Registers
 // SFR register locations
 enum SFR_REGS
@@ -283,6 +583,75 @@ enum IP1_MASKS
     IP1_TF2_EXF2_MASK = 0x20 // Timer 2 overflow/ext. reload
 };
 
+enum PCON_MASKS
+{
+    PCON_IDL_MASK = 0x01, // Idle mode: the CPU stops, timers and interrupts keep running
+    PCON_PD_MASK = 0x02, // Power-down mode: everything stops until reset
+    PCON_GF0_MASK = 0x04, // General purpose flag 0
+    PCON_GF1_MASK = 0x08, // General purpose flag 1
+    PCON_SMOD_MASK = 0x80 // Double serial baud rate
+};
+
+enum DECODED_FLAGS
+{
+    DECODED_TIMER = 0x01, // operation accesses the timer registers
+    DECODED_SFR = 0x02, // operation accesses SFRs through a direct or bit address
+    DECODED_JUMP = 0x04, // operation may continue elsewhere than the next one
+    DECODED_CALLBACK = 0x08, // operation may call the front-end (stack ops, calls, returns, movx, illegal)
+    DECODED_PSW = 0x10, // operation needs up to date carry, auxiliary carry and overflow flags
+    DECODED_INTERRUPT = 0x20, // operation accesses IEN0, the interrupt priorities or PCON
+    DECODED_NOBLOCK = 0x40 // no translated block can start here; set by the translator
+};
+
+enum EM8051_PAGE
+{
+    EM8051_PAGE_SHIFT = 8,
+    EM8051_PAGE_SIZE = 1 << EM8051_PAGE_SHIFT // unit of mDirty and snapshot sharing
+};
+
+enum STATE_FLAGS
+{
+    STATE_CODE = 0x01 // the snapshot includes code memory
+};
+
+enum COVERAGE_FLAGS
+{
+    COVERAGE_RUN = 0x01, // an operation ran at the address
+    COVERAGE_TAKEN = 0x02, // the conditional jump there was taken
+    COVERAGE_NOT_TAKEN = 0x04 // the conditional jump there wasn't taken
+};
+
+enum TRACE_TYPES
+{
+    TRACE_OPERATION = 0, // an operation ran; PC is where it is
+    TRACE_INTERRUPT = 1 // an interrupt started; PC is its vector, and the writes push the return address
+};
+
+enum TRACE_SPACES
+{
+    TRACE_IDATA = 0, // lower and upper RAM, as indirect addressing sees them
+    TRACE_SFR = 1, // address 80 to FF
+    TRACE_XDATA = 2 // external memory, as MOVX addresses it
+};
+
+enum TRACE_COMPARE
+{
+    TRACE_MATCH = 0, // every record so far was the same
+    TRACE_DIVERGED = 1, // a record differed
+    TRACE_ENDED = 2, // the run went on after the trace ended
+    TRACE_DAMAGED = 3 // the trace couldn't be read
+};
+
+// Internal: operation whose CY, AC and OV flags psw_sync() still has to work out
+enum PENDING_FLAGS
+{
+    FLAGS_NONE = 0,
+    FLAGS_ADD, // mFlagsValue1 + mFlagsValue2
+    FLAGS_ADDC, // mFlagsValue1 + mFlagsValue2 + 1
+    FLAGS_SUB, // mFlagsValue1 - mFlagsValue2
+    FLAGS_SUBB // mFlagsValue1 - mFlagsValue2 - 1
+};
+
 enum EM8051_EXCEPTION
 {
     EXCEPTION_STACK,  // stack address > 127 with no upper memory, or roll over
@@ -26,8 +26,10 @@
  * Curses-based emulator front-end
  */
 
-// how many lines of history to remember
+// how many lines of history the main view shows at most
 #define HISTORY_LINES 20
+// how many operations the history remembers by default
+#define HISTORY_DEFAULT 100000
 
 enum EMU_VIEWS
 {
@@ -38,50 +40,150 @@ enum EMU_VIEWS
 };
 
 
-// binary history buffer
-extern unsigned char history[];
+// logic board hardware, driven by logicboard_tick()
+struct logicboard
+{
+    // selected extra hardware; see logicboard_update()
+    int logicmode;
+    // port values on the previous tick, for edge detection
+    int oldports[7];
+    unsigned char shiftregisters[7*4];
+    int audiotick;
+    FILE *audioout;
+    FILE *rawout;
+
+    // for the 2x16 character display
+    unsigned char chardisplayram[0x80];
+    unsigned char chardisplaycgram[0x40];
+    int chardisplaycp;
+    int chardisplayofs;
+    int chardisplaydir;
+    int chardisplayshift;
+    int chardisplaydcb;
+    int chardisplaychargen;
+    int chardisplaydata;
+    int chardisplay4bmode;
+    int chardisplaytick;
+    int chardisplaybusy;
+};
+
+// bytes logicboard_save_state() writes: 19 ints, the shift registers and
+// the display memories
+#define LOGICBOARD_STATE_SIZE (19 * 4 + 7 * 4 + 0x80 + 0x40)
+
+// machine and front-end state to replay from; see reverse.c
+struct checkpoint
+{
+    struct em8051snapshot *snapshot;
+    // position on the time line, in ticks
+    unsigned int ticks;
+    // port reads recorded before it
+    int input;
+    unsigned int icount;
+    unsigned int clocks;
+    int portout[7];
+    struct logicboard logicboard;
+};
+
+// checkpoints and recorded input for stepping backwards; see reverse.c
+struct reverse
+{
+    // oldest first
+    struct checkpoint *checkpoint;
+    int checkpoints;
+    int checkpointsize;
+    // values of the port reads since the oldest checkpoint
+    int *input;
+    int inputs;
+    int inputsize;
+    // next recorded port read to use, while replaying
+    int inputpos;
+    // ticks run on the time line
+    unsigned int ticks;
+    // bytes the checkpoints and input may use; 0 to not record
+    int budget;
+    int used;
+    // set while replaying, so that the front-end stays quiet
+    int replaying;
+};
 
-// last used filename
-extern char filename[];
+// operations run, each with the bytes it changed; see history.c
+struct history
+{
+    unsigned char *ring;
+    int size;
+    // where the next record goes, and bytes in use before it
+    int head;
+    int used;
+    int entries;
+    // icount of the newest record
+    unsigned int newest;
+    // SFRs and the first 64 bytes of lower memory after the newest record
+    unsigned char image[128 + 64];
+};
 
-// instruction count; needed to replay history correctly
-extern unsigned int icount;
+// Per-emulator front-end state, reached through em8051::mContext so that
+// any number of emulators can live in one process. Set up with
+// emu_context_init().
+struct emu_context
+{
+    struct history history;
+    // instruction count; needed to replay history correctly
+    unsigned int icount;
+    // current clock count
+    unsigned int clocks;
+    // icount the main view last showed
+    unsigned int lastclock;
+    // memory the main view shows, one of the em8051 memory areas
+    unsigned char *memarea;
+
+    // last used filename
+    char filename[256];
+
+    // are we in single-step or run mode
+    int runmode;
+    // current run speed, lower is faster
+    int speed;
+    // -1 if not in use
+    int breakpoint;
+
+    // old port out values
+    int p0out;
+    int p1out;
+    int p2out;
+    int p3out;
+    int p4out;
+    int p5out;
+    int p6out;
+
+    int opt_exception_iret_sp;
+    int opt_exception_iret_acc;
+    int opt_exception_iret_psw;
+    int opt_exception_acc_to_a;
+    int opt_exception_stack;
+    int opt_exception_invalid;
+    int opt_clock_select;
+    int opt_clock_hz;
+    int opt_step_instruction;
+    int opt_input_outputlow;
+
+    struct logicboard logicboard;
+
+    struct reverse reverse;
+
+    // counts of what ran, written to profilefile and stacksfile on exit;
+    // NULL if not profiling
+    struct em8051profile *profile;
+    char *profilefile;
+    char *stacksfile;
+};
 
-// current line in the history cyclic buffers
-extern int historyline;
 // last known columns and rows; for screen resize detection
 extern int oldcols, oldrows;
-// are we in single-step or run mode
-extern int runmode;
-// current run speed, lower is faster
-extern int speed;
 
 // currently active view
 extern int view;
 
-// old port out values
-extern int p0out;
-extern int p1out;
-extern int p2out;
-extern int p3out;
-extern int p4out;
-extern int p5out;
-extern int p6out;
-
-// current clock count
-unsigned int clocks;
-
-int opt_exception_iret_sp;
-int opt_exception_iret_acc;
-int opt_exception_iret_psw;
-int opt_exception_acc_to_a;
-int opt_exception_stack;
-int opt_exception_invalid;
-int opt_clock_select;
-int opt_clock_hz;
-int opt_step_instruction;
-int opt_input_outputlow;
-
 
 
 // emu.c
@@ -90,6 +192,7 @@ extern void setSpeed(int speed, int runmode);
 extern int emu_sfrread(struct em8051 *aCPU, int aRegister);
 extern void refreshview(struct em8051 *aCPU);
 extern void change_view(struct em8051 *aCPU, int changeto);
+extern void emu_context_init(struct emu_context *aContext);
 
 // popups.c
 extern void emu_help(struct em8051 *aCPU);
@@ -98,6 +201,7 @@ extern int emu_readvalue(struct em8051 *aCPU, const char *aPrompt, int aOldvalue
 extern int emu_readhz(struct em8051 *aCPU, const char *aPrompt, int aOldvalue);
 extern void emu_load(struct em8051 *aCPU);
 extern void mem_load(struct em8051 *aCPU);
+extern void state_file(struct em8051 *aCPU, int aSave);
 extern void emu_exception(struct em8051 *aCPU, int aCode);
 extern void emu_popup(struct em8051 *aCPU, char *aTitle, char *aMessage);
 
@@ -108,11 +212,30 @@ extern void wipe_main_view();
 extern void mainview_update(struct em8051 *aCPU);
 
 // logicboard.c
-extern void wipe_logicboard_view();
+extern void wipe_logicboard_view(struct em8051 *aCPU);
 extern void build_logicboard_view(struct em8051 *aCPU);
 extern void logicboard_editor_keys(struct em8051 *aCPU, int ch);
 extern void logicboard_update(struct em8051 *aCPU);
 extern void logicboard_tick(struct em8051 *aCPU);
+extern void logicboard_skip(struct em8051 *aCPU, int aTicks);
+extern void logicboard_close(struct em8051 *aCPU);
+extern void logicboard_save_state(struct logicboard *aBoard, unsigned char *aBuffer);
+extern void logicboard_load_state(struct logicboard *aBoard, const unsigned char *aBuffer);
+
+// history.c
+extern void history_init(struct em8051 *aCPU, int aLines);
+extern void history_add(struct em8051 *aCPU, int aOldPC);
+extern int history_read(struct em8051 *aCPU, int aCount, int *aPC, unsigned char aImage[][128 + 64]);
+extern void history_rewind(struct em8051 *aCPU, unsigned int aCount);
+
+// reverse.c
+extern void reverse_init(struct em8051 *aCPU, int aBudget);
+extern void reverse_edited(struct em8051 *aCPU);
+extern void reverse_ran(struct em8051 *aCPU, int aTicks);
+extern void reverse_record_input(struct em8051 *aCPU, int aValue);
+extern int reverse_replay_input(struct em8051 *aCPU);
+extern int reverse_step(struct em8051 *aCPU);
+extern int reverse_continue(struct em8051 *aCPU);
 
 // memeditor.c
 extern void wipe_memeditor_view();
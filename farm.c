@@ -0,0 +1,596 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * farm.c
+ * Regression farm; runs the jobs of a manifest file on a pool of threads,
+ * one emulator per job, and reports pass/fail for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "emu8051.h"
+
+enum STOP_REASONS
+{
+    STOP_NONE = 0,
+    STOP_PC,        // program counter reached the expected address
+    STOP_CYCLES,    // cycle budget ran out
+    STOP_SFR,       // firmware wrote the expected SFR
+    STOP_EXCEPTION, // an enabled exception occurred
+    STOP_LOAD       // the hex file could not be loaded
+};
+
+enum EXPECTATIONS
+{
+    EXPECT_PC = 0,  // pc=addr; reach addr within the budget
+    EXPECT_SFR,     // exitsfr=addr[:value]; write to SFR addr (with value)
+    EXPECT_TIMEOUT  // timeout; run the whole budget without exceptions
+};
+
+struct farm;
+
+// one manifest line; written only by the thread that runs it
+struct job
+{
+    const struct farm *farm;
+    int line; // manifest line number
+    char hexfile[256];
+    int ports[4]; // P0..P3 pin levels; -1 if not driven
+    unsigned long long maxcycles;
+    int expect; // see EXPECTATIONS enum
+    int expect_addr;
+    int expect_value; // -1 for any
+
+    // results
+    int stopreason;
+    int stopvalue;
+    unsigned long long cycles;
+    double ms;
+    int pass;
+};
+
+struct farm
+{
+    struct job *jobs;
+    int jobcount;
+    // jobs run interleaved in groups; see make_groups()
+    int *groups; // first job of each group, plus jobcount at the end
+    int groupcount;
+    int next; // next group to hand out; guarded by lock
+    pthread_mutex_t lock;
+    int exceptions; // (1 << EXCEPTION_xxx) for each enabled exception
+    int jit;
+    int group; // most jobs in a group
+};
+
+static const char *exception_names[] =
+{
+    "stack",
+    "acc-to-a move",
+    "psw not preserved over interrupt call",
+    "sp not preserved over interrupt call",
+    "acc not preserved over interrupt call",
+    "illegal opcode"
+};
+
+// returns time in milliseconds
+static double getTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void farm_exception(struct em8051 *aCPU, int aCode)
+{
+    struct job *j = aCPU->mContext;
+    if (aCode < 0 || !(j->farm->exceptions & (1 << aCode)))
+        return;
+    // only report the first one
+    if (j->stopreason == STOP_NONE)
+    {
+        j->stopreason = STOP_EXCEPTION;
+        j->stopvalue = aCode;
+        aCPU->mStop = 1;
+    }
+}
+
+static void farm_sfrwrite(struct em8051 *aCPU, int aRegister)
+{
+    struct job *j = aCPU->mContext;
+    if (j->expect == EXPECT_SFR && aRegister == j->expect_addr && j->stopreason == STOP_NONE)
+    {
+        j->stopreason = STOP_SFR;
+        j->stopvalue = aCPU->mSFR[aRegister - 0x80];
+        aCPU->mStop = 1;
+    }
+}
+
+// driven port pins; as on the hardware, pins with a low output latch read low
+static int farm_sfrread(struct em8051 *aCPU, int aRegister)
+{
+    struct job *j = aCPU->mContext;
+    int port = -1;
+    switch (aRegister - 0x80)
+    {
+    case REG_P0: port = 0; break;
+    case REG_P1: port = 1; break;
+    case REG_P2: port = 2; break;
+    case REG_P3: port = 3; break;
+    }
+    if (port != -1 && j->ports[port] != -1)
+        return j->ports[port] & aCPU->mSFR[aRegister - 0x80];
+    return aCPU->mSFR[aRegister - 0x80];
+}
+
+static int stop_pc(struct job *aJob)
+{
+    return aJob->expect == EXPECT_PC ? aJob->expect_addr : -1;
+}
+
+// Runs the jobs of a group in turn with run_interleaved(). They share
+// the code memory and decoded operations, so they must all run the same
+// hex file with the same budget and breakpoint.
+static void run_group(struct job *aJobs, int aCount)
+{
+    struct em8051 *emu = calloc(aCount, sizeof(struct em8051));
+    struct em8051 **running = malloc(aCount * sizeof(struct em8051 *));
+    int *ran = malloc(aCount * sizeof(int));
+    unsigned char *code = malloc(65536);
+    struct em8051decoded *decoded = calloc(65536, sizeof(struct em8051decoded));
+    int i, j;
+    double start;
+
+    for (i = 0; i < aCount; i++)
+    {
+        int driven = 0;
+        for (j = 0; j < 4; j++)
+            if (aJobs[i].ports[j] != -1)
+                driven = 1;
+
+        emu[i].mCodeMem     = code;
+        emu[i].mCodeMemSize = 65536;
+        emu[i].mExtData     = malloc(65536);
+        emu[i].mExtDataSize = 65536;
+        emu[i].mLowerData   = malloc(128);
+        emu[i].mUpperData   = malloc(128);
+        emu[i].mSFR         = malloc(128);
+        emu[i].mDecoded     = decoded;
+        emu[i].except       = &farm_exception;
+        emu[i].sfrread      = driven ? &farm_sfrread : NULL;
+        emu[i].sfrwrite     = &farm_sfrwrite;
+        emu[i].xread = NULL;
+        emu[i].xwrite = NULL;
+        emu[i].mContext = &aJobs[i];
+        reset(&emu[i], 1);
+    }
+    if (load_obj(&emu[0], aJobs[0].hexfile) != 0)
+    {
+        for (i = 0; i < aCount; i++)
+            aJobs[i].stopreason = STOP_LOAD;
+    }
+    // only the first translator would hear of the load; create them after it
+    if (aJobs[0].farm->jit)
+    {
+        for (i = 0; i < aCount; i++)
+            emu[i].mJit = jit_create(&emu[i]);
+    }
+
+    start = getTime();
+
+    for (;;)
+    {
+        int chunk = 0x40000000;
+        int count = 0;
+        for (i = 0; i < aCount; i++)
+        {
+            if (aJobs[i].stopreason != STOP_NONE)
+                continue;
+            if (aJobs[i].cycles == aJobs[i].maxcycles)
+            {
+                aJobs[i].stopreason = STOP_CYCLES;
+                continue;
+            }
+            // the jobs still running have all run the same ticks
+            if (aJobs[i].maxcycles - aJobs[i].cycles < (unsigned long long)chunk)
+                chunk = aJobs[i].maxcycles - aJobs[i].cycles;
+            running[count++] = &emu[i];
+        }
+        if (count == 0)
+            break;
+
+        run_interleaved(running, count, chunk, stop_pc(&aJobs[0]), ran);
+
+        for (i = 0; i < count; i++)
+        {
+            struct job *job = running[i]->mContext;
+            job->cycles += ran[i];
+            // callbacks set their own reason; otherwise it was the breakpoint
+            if (running[i]->mStop && job->stopreason == STOP_NONE)
+            {
+                job->stopreason = STOP_PC;
+            }
+        }
+    }
+
+    for (i = 0; i < aCount; i++)
+    {
+        struct job *job = &aJobs[i];
+
+        // interleaved jobs share the time
+        job->ms = (getTime() - start) / aCount;
+
+        switch (job->expect)
+        {
+        case EXPECT_PC:
+            job->pass = job->stopreason == STOP_PC;
+            break;
+        case EXPECT_SFR:
+            job->pass = job->stopreason == STOP_SFR &&
+                (job->expect_value == -1 || job->stopvalue == job->expect_value);
+            break;
+        case EXPECT_TIMEOUT:
+            job->pass = job->stopreason == STOP_CYCLES;
+            break;
+        }
+
+        if (emu[i].mJit)
+            jit_destroy(emu[i].mJit);
+        free(emu[i].mExtData);
+        free(emu[i].mLowerData);
+        free(emu[i].mUpperData);
+        free(emu[i].mSFR);
+    }
+    free(code);
+    free(decoded);
+    free(running);
+    free(ran);
+    free(emu);
+}
+
+static void *worker(void *aFarm)
+{
+    struct farm *f = aFarm;
+    for (;;)
+    {
+        int i;
+        pthread_mutex_lock(&f->lock);
+        i = f->next++;
+        pthread_mutex_unlock(&f->lock);
+        if (i >= f->groupcount)
+            break;
+        run_group(&f->jobs[f->groups[i]], f->groups[i + 1] - f->groups[i]);
+    }
+    return NULL;
+}
+
+// Consecutive jobs that run the same hex file with the same budget and
+// breakpoint go in one group, up to aFarm->group of them.
+static void make_groups(struct farm *aFarm)
+{
+    int i;
+    aFarm->groups = malloc((aFarm->jobcount + 1) * sizeof(int));
+    aFarm->groupcount = 0;
+    for (i = 0; i < aFarm->jobcount; i++)
+    {
+        struct job *first;
+        struct job *j = &aFarm->jobs[i];
+        if (aFarm->groupcount > 0)
+        {
+            int size = i - aFarm->groups[aFarm->groupcount - 1];
+            first = &aFarm->jobs[aFarm->groups[aFarm->groupcount - 1]];
+            if (size < aFarm->group &&
+                strcmp(first->hexfile, j->hexfile) == 0 &&
+                first->maxcycles == j->maxcycles &&
+                stop_pc(first) == stop_pc(j))
+                continue;
+        }
+        aFarm->groups[aFarm->groupcount++] = i;
+    }
+    aFarm->groups[aFarm->groupcount] = aFarm->jobcount;
+}
+
+// stimulus is "-" or a comma separated list of Pn=hh port pin levels
+static int parse_stimulus(struct job *aJob, char *aText)
+{
+    char *p = aText;
+    if (strcmp(p, "-") == 0)
+        return 0;
+    while (*p)
+    {
+        int port = p[1] - '0';
+        if ((p[0] != 'P' && p[0] != 'p') || port < 0 || port > 3 || p[2] != '=')
+            return -1;
+        aJob->ports[port] = strtol(p + 3, &p, 16) & 0xff;
+        if (*p == ',')
+            p++;
+        else
+        if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+static int parse_expect(struct job *aJob, char *aText)
+{
+    char *p;
+    if (strncmp("pc=", aText, 3) == 0)
+    {
+        aJob->expect = EXPECT_PC;
+        aJob->expect_addr = strtol(aText + 3, NULL, 16) & 0xffff;
+        return 0;
+    }
+    if (strncmp("exitsfr=", aText, 8) == 0)
+    {
+        aJob->expect = EXPECT_SFR;
+        aJob->expect_addr = strtol(aText + 8, &p, 16);
+        if (aJob->expect_addr < 0x80 || aJob->expect_addr > 0xff)
+            return -1;
+        if (*p == ':')
+            aJob->expect_value = strtol(p + 1, NULL, 16) & 0xff;
+        return 0;
+    }
+    if (strcmp("timeout", aText) == 0)
+    {
+        aJob->expect = EXPECT_TIMEOUT;
+        return 0;
+    }
+    return -1;
+}
+
+// Manifest lines are "hexfile stimulus cycles expect"; empty lines and
+// lines starting with # are skipped. Returns negative for errors.
+static int load_manifest(struct farm *aFarm, char *aFilename)
+{
+    FILE *f;
+    char line[1024];
+    int lineno = 0;
+    int room = 0;
+
+    f = fopen(aFilename, "r");
+    if (!f) return -1;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char hexfile[256], stimulus[256], expect[256];
+        struct job *j;
+        int fields;
+
+        lineno++;
+        fields = sscanf(line, "%255s %255s %*s %255s", hexfile, stimulus, expect);
+        if (fields <= 0 || hexfile[0] == '#')
+            continue;
+
+        if (aFarm->jobcount == room)
+        {
+            room = room ? room * 2 : 64;
+            aFarm->jobs = realloc(aFarm->jobs, room * sizeof(struct job));
+        }
+        j = &aFarm->jobs[aFarm->jobcount];
+        memset(j, 0, sizeof(struct job));
+        j->farm = aFarm;
+        j->line = lineno;
+        j->ports[0] = j->ports[1] = j->ports[2] = j->ports[3] = -1;
+        j->expect_value = -1;
+        strcpy(j->hexfile, hexfile);
+
+        if (fields != 3 ||
+            sscanf(line, "%*s %*s %llu", &j->maxcycles) != 1 ||
+            j->maxcycles == 0 ||
+            parse_stimulus(j, stimulus) != 0 ||
+            parse_expect(j, expect) != 0)
+        {
+            printf("%s:%d: expected \"hexfile stimulus cycles expect\"\n", aFilename, lineno);
+            fclose(f);
+            return -1;
+        }
+        aFarm->jobcount++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void report(struct job *aJob)
+{
+    printf("%s %4d %-24s %10llu cycles %10.1fms",
+        aJob->pass ? "PASS" : "FAIL",
+        aJob->line,
+        aJob->hexfile,
+        aJob->cycles,
+        aJob->ms);
+    switch (aJob->stopreason)
+    {
+    case STOP_PC:
+        printf("  pc %04X\n", aJob->expect_addr);
+        break;
+    case STOP_CYCLES:
+        printf("  budget exhausted\n");
+        break;
+    case STOP_SFR:
+        printf("  SFR %02X = %02X\n", aJob->expect_addr, aJob->stopvalue);
+        break;
+    case STOP_EXCEPTION:
+        printf("  exception: %s\n", exception_names[aJob->stopvalue]);
+        break;
+    case STOP_LOAD:
+        printf("  load failure\n");
+        break;
+    }
+}
+
+int main(int parc, char ** pars)
+{
+    struct farm farm;
+    pthread_t *threads;
+    char *manifest = NULL;
+    int threadcount = 0;
+    int failed = 0;
+    int i;
+    double start;
+
+    memset(&farm, 0, sizeof(farm));
+    farm.group = 1;
+    farm.exceptions = (1 << EXCEPTION_STACK) |
+                      (1 << EXCEPTION_ACC_TO_A) |
+                      (1 << EXCEPTION_IRET_PSW_MISMATCH) |
+                      (1 << EXCEPTION_IRET_SP_MISMATCH) |
+                      (1 << EXCEPTION_IRET_ACC_MISMATCH) |
+                      (1 << EXCEPTION_ILLEGAL_OPCODE);
+
+    for (i = 1; i < parc; i++)
+    {
+        if (pars[i][0] == '-')
+        {
+            if (strncmp("j=",pars[i]+1,2) == 0)
+            {
+                threadcount = atoi(pars[i]+3);
+            }
+            else
+            if (strncmp("group=",pars[i]+1,6) == 0)
+            {
+                farm.group = atoi(pars[i]+7);
+                if (farm.group < 1)
+                    farm.group = 1;
+            }
+            else
+            if (strcmp("jit",pars[i]+1) == 0)
+            {
+                farm.jit = 1;
+            }
+            else
+            if (strcmp("noexc_iret_sp",pars[i]+1) == 0 || strcmp("nosp",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_IRET_SP_MISMATCH);
+            }
+            else
+            if (strcmp("noexc_iret_acc",pars[i]+1) == 0 || strcmp("noacc",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_IRET_ACC_MISMATCH);
+            }
+            else
+            if (strcmp("noexc_iret_psw",pars[i]+1) == 0 || strcmp("nopsw",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_IRET_PSW_MISMATCH);
+            }
+            else
+            if (strcmp("noexc_acc_to_a",pars[i]+1) == 0 || strcmp("noaa",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_ACC_TO_A);
+            }
+            else
+            if (strcmp("noexc_stack",pars[i]+1) == 0 || strcmp("nostk",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_STACK);
+            }
+            else
+            if (strcmp("noexc_invalid_op",pars[i]+1) == 0 || strcmp("noiop",pars[i]+1) == 0)
+            {
+                farm.exceptions &= ~(1 << EXCEPTION_ILLEGAL_OPCODE);
+            }
+            else
+            {
+                printf("Help:\n\n"
+                    "emu8051-farm [options] manifest\n\n"
+                    "Runs every job of the manifest, several at a time, and reports\n"
+                    "pass/fail, cycles and wall time for each. Manifest lines are\n\n"
+                    "  hexfile stimulus cycles expect\n\n"
+                    "where stimulus is - or a list of port pin levels such as P1=5A,P3=FF,\n"
+                    "cycles is the machine cycle budget and expect is one of\n\n"
+                    "  pc=addr                     PC reaches addr (hex)\n"
+                    "  exitsfr=addr[:value]        SFR at addr (hex) is written (with value)\n"
+                    "  timeout                     the budget runs out without exceptions\n\n"
+                    "Lines starting with # are skipped. Available options:\n\n"
+                    "Option            Alternate   description\n"
+                    "-j=count                      Number of threads; default is one per cpu\n"
+                    "-group=count                  Run up to count consecutive jobs of the same\n"
+                    "                              hex file, budget and pc in turn on one thread,\n"
+                    "                              sharing the code; helps large hex files only\n"
+                    "-jit                          Translate code to native code, if possible\n"
+                    "-noexc_iret_sp    -nosp       Disable sp iret exception\n"
+                    "-noexc_iret_acc   -noacc      Disable acc iret exception\n"
+                    "-noexc_iret_psw   -nopsw      Disable psw iret exception\n"
+                    "-noexc_acc_to_a   -noaa       Disable acc-to-a invalid instruction exception\n"
+                    "-noexc_stack      -nostk      Disable stack abnormal behaviour exception\n"
+                    "-noexc_invalid_op -noiop      Disable invalid opcode exception\n\n"
+                    "Exit code is 0 when all jobs pass and 1 otherwise.\n"
+                    );
+                return -1;
+            }
+        }
+        else
+        {
+            manifest = pars[i];
+        }
+    }
+
+    if (manifest == NULL)
+    {
+        printf("No manifest given; try emu8051-farm -help\n");
+        return -1;
+    }
+
+    if (load_manifest(&farm, manifest) != 0)
+    {
+        printf("Manifest '%s' load failure\n", manifest);
+        return -1;
+    }
+
+    make_groups(&farm);
+
+    if (threadcount <= 0)
+        threadcount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadcount > farm.groupcount)
+        threadcount = farm.groupcount;
+    if (threadcount <= 0)
+        threadcount = 1;
+
+    pthread_mutex_init(&farm.lock, NULL);
+    threads = malloc(threadcount * sizeof(pthread_t));
+    start = getTime();
+
+    for (i = 0; i < threadcount; i++)
+        pthread_create(&threads[i], NULL, &worker, &farm);
+    for (i = 0; i < threadcount; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < farm.jobcount; i++)
+    {
+        report(&farm.jobs[i]);
+        if (!farm.jobs[i].pass)
+            failed++;
+    }
+    printf("%d jobs, %d passed, %d failed; %d threads, %.1fms\n",
+        farm.jobcount, farm.jobcount - failed, failed, threadcount, getTime() - start);
+
+    pthread_mutex_destroy(&farm.lock);
+    free(threads);
+    free(farm.groups);
+    free(farm.jobs);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1091 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * fuzz.c
+ * Differential fuzzer; runs random code from random state through each
+ * of the core's ways of running operations, and through a reference
+ * model, and reports the first place they disagree
+ */
+
+// An input is the machine state to start from:
+//
+//   offset  size  contents
+//   0       128   lower internal RAM (00h-7Fh)
+//   128     128   upper internal RAM (80h-FFh, indirect)
+//   256     128   SFRs (80h-FFh); PCON's idle and power-down bits are cleared
+//   384     4096  code memory from 0000h; what's missing is NOPs
+//
+// Anything past the end of a short input is zeros. Code memory is 4K, and
+// external memory 4K filled with a fixed pattern.
+//
+// Each input is first run operation by operation, with no timers or
+// interrupts, through the reference model below, through the op[] table,
+// through do_op() and through the predecoded records, comparing the whole
+// state after every operation. Then it's run for a number of ticks with
+// timers and interrupts through tick(), and through run_cycles() without
+// and with predecoding and with the translator, comparing the state
+// every RUN_CHUNK ticks. run_cycles() goes through threaded dispatch when
+// built with DISPATCH=2.
+//
+// Without EM8051_LIBFUZZER this builds a program that tries random inputs,
+// or runs the input files it is given; for afl-fuzz, build with afl-gcc
+// and run "afl-fuzz -i seeds -o findings ./emu8051-fuzz @@". With
+// EM8051_LIBFUZZER it is a libFuzzer target ("make emu8051-libfuzzer").
+// A divergence aborts, so that both count it as a crash, except in
+// random runs, which save the input and exit with 2.
+//
+// seeds/ holds inputs that once showed a divergence in the core;
+// "make fuzz-seeds" runs them, and they do as a starting corpus for
+// afl-fuzz.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+enum FUZZ_LAYOUT
+{
+    FUZZ_LOWER = 0,
+    FUZZ_UPPER = 128,
+    FUZZ_SFR = 256,
+    FUZZ_CODE = 384,
+    FUZZ_CODE_SIZE = 4096,
+    FUZZ_EXT_SIZE = 4096,
+    FUZZ_INPUT_SIZE = FUZZ_CODE + FUZZ_CODE_SIZE
+};
+
+enum FUZZ_ENGINES
+{
+    ENGINE_MODEL,   // reference model
+    ENGINE_TABLE,   // op[] function pointers
+    ENGINE_SWITCH,  // do_op()
+    ENGINE_DECODED, // predecoded records
+    ENGINES
+};
+
+static const char *engine_names[] =
+{
+    "model",
+    "op[]",
+    "do_op",
+    "predecoded"
+};
+
+enum FUZZ_RUNNERS
+{
+    RUN_TICK,       // tick() one at a time
+    RUN_CYCLES,     // run_cycles()
+    RUN_DECODED,    // run_cycles() with predecoding
+    RUN_JIT,        // run_cycles() with the translator
+    RUNNERS
+};
+
+static const char *runner_names[] =
+{
+    "tick",
+    "run_cycles",
+    "run_cycles predecoded",
+    "run_cycles jit"
+};
+
+// ticks between state comparisons in the runners
+#define RUN_CHUNK 97
+
+static struct em8051 engines[ENGINES];
+static struct em8051 runners[RUNNERS];
+static int steps = 1000;
+static int ticks = 10000;
+
+//
+// Reference model
+//
+// A plain reading of the instruction set manual, sharing nothing with
+// opcodes.c but struct em8051. It keeps PSW up to date after each
+// operation and runs one operation per call, with no timers or
+// interrupts. Where the manual leaves the result open (DIV by zero) or
+// the core doesn't model the hardware (MOVX @Ri has no P2 page, and the
+// callbacks aren't used) it does what the core does. Returns the ticks
+// to delay, like the opcode handlers.
+
+static int model_code(struct em8051 *aCPU, int aOffset)
+{
+    return aCPU->mCodeMem[(aCPU->mPC + aOffset) & (aCPU->mCodeMemSize - 1)];
+}
+
+// Internal RAM below 80h; above it SFRs through direct addresses and the
+// upper RAM through indirect ones
+static int model_read(struct em8051 *aCPU, int aAddress, int aIndirect)
+{
+    if (aAddress < 0x80)
+        return aCPU->mLowerData[aAddress];
+    if (aIndirect)
+        return aCPU->mUpperData[aAddress - 0x80];
+    return aCPU->mSFR[aAddress - 0x80];
+}
+
+static void model_write(struct em8051 *aCPU, int aAddress, int aIndirect, int aValue)
+{
+    if (aAddress < 0x80)
+        aCPU->mLowerData[aAddress] = aValue;
+    else if (aIndirect)
+        aCPU->mUpperData[aAddress - 0x80] = aValue;
+    else
+        aCPU->mSFR[aAddress - 0x80] = aValue;
+}
+
+// Bits 00h-7Fh are in RAM bytes 20h-2Fh, the rest in the SFRs at
+// addresses divisible by 8
+static int model_bit_byte(int aBit)
+{
+    return aBit < 0x80 ? 0x20 + (aBit >> 3) : aBit & 0xf8;
+}
+
+static int model_read_bit(struct em8051 *aCPU, int aBit)
+{
+    return (model_read(aCPU, model_bit_byte(aBit), 0) >> (aBit & 7)) & 1;
+}
+
+static void model_write_bit(struct em8051 *aCPU, int aBit, int aValue)
+{
+    int address = model_bit_byte(aBit);
+    int value = model_read(aCPU, address, 0) & ~(1 << (aBit & 7));
+    model_write(aCPU, address, 0, value | (aValue << (aBit & 7)));
+}
+
+static int model_carry(struct em8051 *aCPU)
+{
+    return (aCPU->mSFR[REG_PSW] & PSW_CY_MASK) ? 1 : 0;
+}
+
+static void model_set_flag(struct em8051 *aCPU, int aMask, int aValue)
+{
+    if (aValue)
+        aCPU->mSFR[REG_PSW] |= aMask;
+    else
+        aCPU->mSFR[REG_PSW] &= ~aMask;
+}
+
+// The operand in columns 5 to F of the opcode map: a direct address, @R0
+// or @R1, or R0 to R7. Returns its address and sets aIndirect.
+static int model_operand(struct em8051 *aCPU, int aOpcode, int aDirect, int *aIndirect)
+{
+    int bank = aCPU->mSFR[REG_PSW] & (PSW_RS0_MASK | PSW_RS1_MASK);
+
+    *aIndirect = 0;
+    if ((aOpcode & 0x0f) == 5)
+        return aDirect;
+    if ((aOpcode & 0x0f) < 8)
+    {
+        *aIndirect = 1;
+        return aCPU->mLowerData[bank + (aOpcode & 1)];
+    }
+    return bank + (aOpcode & 7);
+}
+
+static void model_push(struct em8051 *aCPU, int aValue)
+{
+    aCPU->mSFR[REG_SP]++;
+    model_write(aCPU, aCPU->mSFR[REG_SP], 1, aValue);
+}
+
+static int model_pop(struct em8051 *aCPU)
+{
+    int value = model_read(aCPU, aCPU->mSFR[REG_SP], 1);
+    aCPU->mSFR[REG_SP]--;
+    return value;
+}
+
+// ADD and ADDC; also SUBB, which adds the complement with an inverted
+// carry, and sets CY and AC when there's no carry out
+static void model_add(struct em8051 *aCPU, int aValue, int aCarry, int aSubtract)
+{
+    int acc = aCPU->mSFR[REG_ACC];
+    int sum;
+    int carry;
+    int auxcarry;
+    int carry6;
+
+    if (aSubtract)
+    {
+        aValue ^= 0xff;
+        aCarry ^= 1;
+    }
+    sum = acc + aValue + aCarry;
+    carry = sum >> 8;
+    auxcarry = ((acc & 0x0f) + (aValue & 0x0f) + aCarry) >> 4;
+    carry6 = ((acc & 0x7f) + (aValue & 0x7f) + aCarry) >> 7;
+    aCPU->mSFR[REG_ACC] = sum;
+    model_set_flag(aCPU, PSW_CY_MASK, carry ^ aSubtract);
+    model_set_flag(aCPU, PSW_AC_MASK, auxcarry ^ aSubtract);
+    model_set_flag(aCPU, PSW_OV_MASK, carry ^ carry6);
+}
+
+static int model_step(struct em8051 *aCPU)
+{
+    int opcode = model_code(aCPU, 0);
+    int operand1 = model_code(aCPU, 1);
+    int operand2 = model_code(aCPU, 2);
+    int pc = aCPU->mPC & 0xffff;
+    int row = opcode >> 4;
+    int column = opcode & 0x0f;
+    int length = 1;
+    int cycles = 1;
+    int jump = -1; // where a taken jump goes
+    int acc = aCPU->mSFR[REG_ACC];
+    int dptr = (aCPU->mSFR[REG_DPH] << 8) | aCPU->mSFR[REG_DPL];
+    int address = 0;
+    int indirect = 0;
+    int value;
+    int parity;
+
+    if (column >= 5)
+        address = model_operand(aCPU, opcode, operand1, &indirect);
+
+    if ((opcode & 0x0f) == 0x01)
+    {
+        // AJMP and ACALL, within the 2K page of the next operation
+        int next = (pc + 2) & 0xffff;
+        length = 2;
+        cycles = 2;
+        if (opcode & 0x10)
+        {
+            model_push(aCPU, next & 0xff);
+            model_push(aCPU, next >> 8);
+        }
+        jump = (next & 0xf800) | ((opcode & 0xe0) << 3) | operand1;
+    }
+    else if (column < 5)
+    {
+        switch (opcode)
+        {
+        case 0x00: // NOP
+            break;
+        case 0x02: // LJMP addr16
+            length = 3;
+            cycles = 2;
+            jump = (operand1 << 8) | operand2;
+            break;
+        case 0x03: // RR A
+            aCPU->mSFR[REG_ACC] = (acc >> 1) | (acc << 7);
+            break;
+        case 0x04: // INC A
+            aCPU->mSFR[REG_ACC]++;
+            break;
+        case 0x10: // JBC bit, rel
+        case 0x20: // JB bit, rel
+        case 0x30: // JNB bit, rel
+            length = 3;
+            cycles = 2;
+            value = model_read_bit(aCPU, operand1);
+            if (value == (opcode != 0x30))
+                jump = (pc + 3 + (signed char)operand2) & 0xffff;
+            if (opcode == 0x10 && value)
+                model_write_bit(aCPU, operand1, 0);
+            break;
+        case 0x12: // LCALL addr16
+            length = 3;
+            cycles = 2;
+            model_push(aCPU, (pc + 3) & 0xff);
+            model_push(aCPU, ((pc + 3) >> 8) & 0xff);
+            jump = (operand1 << 8) | operand2;
+            break;
+        case 0x13: // RRC A
+            aCPU->mSFR[REG_ACC] = (acc >> 1) | (model_carry(aCPU) << 7);
+            model_set_flag(aCPU, PSW_CY_MASK, acc & 1);
+            break;
+        case 0x14: // DEC A
+            aCPU->mSFR[REG_ACC]--;
+            break;
+        case 0x22: // RET
+        case 0x32: // RETI
+            cycles = 2;
+            jump = model_pop(aCPU) << 8;
+            jump |= model_pop(aCPU);
+            if (opcode == 0x32)
+            {
+                // leave the interrupt level running
+                if (aCPU->mInterruptActive & 2)
+                    aCPU->mInterruptActive &= ~2;
+                else
+                    aCPU->mInterruptActive = 0;
+            }
+            break;
+        case 0x23: // RL A
+            aCPU->mSFR[REG_ACC] = (acc << 1) | (acc >> 7);
+            break;
+        case 0x24: // ADD A, #data
+        case 0x34: // ADDC A, #data
+        case 0x94: // SUBB A, #data
+            length = 2;
+            model_add(aCPU, operand1, opcode == 0x24 ? 0 : model_carry(aCPU), opcode == 0x94);
+            break;
+        case 0x33: // RLC A
+            aCPU->mSFR[REG_ACC] = (acc << 1) | model_carry(aCPU);
+            model_set_flag(aCPU, PSW_CY_MASK, acc >> 7);
+            break;
+        case 0x40: // JC rel
+        case 0x50: // JNC rel
+        case 0x60: // JZ rel
+        case 0x70: // JNZ rel
+        case 0x80: // SJMP rel
+            length = 2;
+            cycles = 2;
+            switch (opcode)
+            {
+            case 0x40: value = model_carry(aCPU); break;
+            case 0x50: value = !model_carry(aCPU); break;
+            case 0x60: value = acc == 0; break;
+            case 0x70: value = acc != 0; break;
+            default: value = 1; break;
+            }
+            if (value)
+                jump = (pc + 2 + (signed char)operand1) & 0xffff;
+            break;
+        case 0x42: // ORL direct, A
+        case 0x52: // ANL direct, A
+        case 0x62: // XRL direct, A
+        case 0x43: // ORL direct, #data
+        case 0x53: // ANL direct, #data
+        case 0x63: // XRL direct, #data
+            value = (opcode & 1) ? operand2 : acc;
+            length = (opcode & 1) ? 3 : 2;
+            cycles = (opcode & 1) ? 2 : 1;
+            if (row == 4)
+                value |= model_read(aCPU, operand1, 0);
+            else if (row == 5)
+                value &= model_read(aCPU, operand1, 0);
+            else
+                value ^= model_read(aCPU, operand1, 0);
+            model_write(aCPU, operand1, 0, value);
+            break;
+        case 0x44: // ORL A, #data
+            length = 2;
+            aCPU->mSFR[REG_ACC] |= operand1;
+            break;
+        case 0x54: // ANL A, #data
+            length = 2;
+            aCPU->mSFR[REG_ACC] &= operand1;
+            break;
+        case 0x64: // XRL A, #data
+            length = 2;
+            aCPU->mSFR[REG_ACC] ^= operand1;
+            break;
+        case 0x72: // ORL C, bit
+        case 0x82: // ANL C, bit
+        case 0xa0: // ORL C, /bit
+        case 0xb0: // ANL C, /bit
+            length = 2;
+            cycles = 2;
+            value = model_read_bit(aCPU, operand1) ^ (row >= 0xa);
+            if (opcode == 0x72 || opcode == 0xa0)
+                value |= model_carry(aCPU);
+            else
+                value &= model_carry(aCPU);
+            model_set_flag(aCPU, PSW_CY_MASK, value);
+            break;
+        case 0x73: // JMP @A+DPTR
+            cycles = 2;
+            jump = (dptr + acc) & 0xffff;
+            break;
+        case 0x74: // MOV A, #data
+            length = 2;
+            aCPU->mSFR[REG_ACC] = operand1;
+            break;
+        case 0x83: // MOVC A, @A+PC
+            cycles = 2;
+            aCPU->mSFR[REG_ACC] = aCPU->mCodeMem[(pc + 1 + acc) & (aCPU->mCodeMemSize - 1)];
+            break;
+        case 0x84: // DIV AB
+            cycles = 4;
+            value = aCPU->mSFR[REG_B];
+            model_set_flag(aCPU, PSW_CY_MASK, 0);
+            model_set_flag(aCPU, PSW_OV_MASK, value == 0);
+            if (value)
+            {
+                aCPU->mSFR[REG_ACC] = acc / value;
+                aCPU->mSFR[REG_B] = acc % value;
+            }
+            break;
+        case 0x90: // MOV DPTR, #data16
+            length = 3;
+            cycles = 2;
+            aCPU->mSFR[REG_DPH] = operand1;
+            aCPU->mSFR[REG_DPL] = operand2;
+            break;
+        case 0x92: // MOV bit, C
+            length = 2;
+            cycles = 2;
+            model_write_bit(aCPU, operand1, model_carry(aCPU));
+            break;
+        case 0x93: // MOVC A, @A+DPTR
+            cycles = 2;
+            aCPU->mSFR[REG_ACC] = aCPU->mCodeMem[(dptr + acc) & (aCPU->mCodeMemSize - 1)];
+            break;
+        case 0xa2: // MOV C, bit
+            length = 2;
+            model_set_flag(aCPU, PSW_CY_MASK, model_read_bit(aCPU, operand1));
+            break;
+        case 0xa3: // INC DPTR
+            cycles = 2;
+            dptr++;
+            aCPU->mSFR[REG_DPH] = dptr >> 8;
+            aCPU->mSFR[REG_DPL] = dptr;
+            break;
+        case 0xa4: // MUL AB
+            cycles = 4;
+            value = acc * aCPU->mSFR[REG_B];
+            aCPU->mSFR[REG_ACC] = value;
+            aCPU->mSFR[REG_B] = value >> 8;
+            model_set_flag(aCPU, PSW_CY_MASK, 0);
+            model_set_flag(aCPU, PSW_OV_MASK, value > 0xff);
+            break;
+        case 0xb2: // CPL bit
+            length = 2;
+            model_write_bit(aCPU, operand1, !model_read_bit(aCPU, operand1));
+            break;
+        case 0xb3: // CPL C
+            model_set_flag(aCPU, PSW_CY_MASK, !model_carry(aCPU));
+            break;
+        case 0xb4: // CJNE A, #data, rel
+            length = 3;
+            cycles = 2;
+            model_set_flag(aCPU, PSW_CY_MASK, acc < operand1);
+            if (acc != operand1)
+                jump = (pc + 3 + (signed char)operand2) & 0xffff;
+            break;
+        case 0xc0: // PUSH direct
+            length = 2;
+            cycles = 2;
+            model_push(aCPU, model_read(aCPU, operand1, 0));
+            break;
+        case 0xc2: // CLR bit
+            length = 2;
+            model_write_bit(aCPU, operand1, 0);
+            break;
+        case 0xc3: // CLR C
+            model_set_flag(aCPU, PSW_CY_MASK, 0);
+            break;
+        case 0xc4: // SWAP A
+            aCPU->mSFR[REG_ACC] = (acc << 4) | (acc >> 4);
+            break;
+        case 0xd0: // POP direct
+            length = 2;
+            cycles = 2;
+            value = model_pop(aCPU);
+            model_write(aCPU, operand1, 0, value);
+            break;
+        case 0xd2: // SETB bit
+            length = 2;
+            model_write_bit(aCPU, operand1, 1);
+            break;
+        case 0xd3: // SETB C
+            model_set_flag(aCPU, PSW_CY_MASK, 1);
+            break;
+        case 0xd4: // DA A
+            // each adjustment may set the carry, but neither clears it
+            value = acc;
+            if ((value & 0x0f) > 9 || (aCPU->mSFR[REG_PSW] & PSW_AC_MASK))
+                value += 0x06;
+            if (value > 0xff)
+                model_set_flag(aCPU, PSW_CY_MASK, 1);
+            if ((value & 0xf0) > 0x90 || model_carry(aCPU))
+                value = (value & 0xff) + 0x60;
+            if (value > 0xff)
+                model_set_flag(aCPU, PSW_CY_MASK, 1);
+            aCPU->mSFR[REG_ACC] = value;
+            break;
+        case 0xe0: // MOVX A, @DPTR
+            cycles = 2;
+            aCPU->mSFR[REG_ACC] = aCPU->mExtData[dptr & (aCPU->mExtDataSize - 1)];
+            break;
+        case 0xe2: // MOVX A, @R0
+        case 0xe3: // MOVX A, @R1
+            cycles = 2;
+            value = model_read(aCPU, (aCPU->mSFR[REG_PSW] & (PSW_RS0_MASK | PSW_RS1_MASK)) + (opcode & 1), 0);
+            aCPU->mSFR[REG_ACC] = aCPU->mExtData[value & (aCPU->mExtDataSize - 1)];
+            break;
+        case 0xe4: // CLR A
+            aCPU->mSFR[REG_ACC] = 0;
+            break;
+        case 0xf0: // MOVX @DPTR, A
+            cycles = 2;
+            aCPU->mExtData[dptr & (aCPU->mExtDataSize - 1)] = acc;
+            break;
+        case 0xf2: // MOVX @R0, A
+        case 0xf3: // MOVX @R1, A
+            cycles = 2;
+            value = model_read(aCPU, (aCPU->mSFR[REG_PSW] & (PSW_RS0_MASK | PSW_RS1_MASK)) + (opcode & 1), 0);
+            aCPU->mExtData[value & (aCPU->mExtDataSize - 1)] = acc;
+            break;
+        case 0xf4: // CPL A
+            aCPU->mSFR[REG_ACC] = ~acc;
+            break;
+        }
+    }
+    else
+    {
+        // columns 5 to F: the operand is a direct address, @Ri or Rn
+        if (column == 5)
+            length = 2;
+        switch (row)
+        {
+        case 0x0: // INC operand
+            model_write(aCPU, address, indirect, model_read(aCPU, address, indirect) + 1);
+            break;
+        case 0x1: // DEC operand
+            model_write(aCPU, address, indirect, model_read(aCPU, address, indirect) - 1);
+            break;
+        case 0x2: // ADD A, operand
+            model_add(aCPU, model_read(aCPU, address, indirect), 0, 0);
+            break;
+        case 0x3: // ADDC A, operand
+            model_add(aCPU, model_read(aCPU, address, indirect), model_carry(aCPU), 0);
+            break;
+        case 0x4: // ORL A, operand
+            aCPU->mSFR[REG_ACC] |= model_read(aCPU, address, indirect);
+            break;
+        case 0x5: // ANL A, operand
+            aCPU->mSFR[REG_ACC] &= model_read(aCPU, address, indirect);
+            break;
+        case 0x6: // XRL A, operand
+            aCPU->mSFR[REG_ACC] ^= model_read(aCPU, address, indirect);
+            break;
+        case 0x7: // MOV operand, #data
+            length++;
+            if (column == 5)
+            {
+                cycles = 2;
+                model_write(aCPU, address, indirect, operand2);
+            }
+            else
+            {
+                model_write(aCPU, address, indirect, operand1);
+            }
+            break;
+        case 0x8: // MOV direct, operand; the destination comes last
+            length++;
+            cycles = 2;
+            value = model_read(aCPU, address, indirect);
+            model_write(aCPU, column == 5 ? operand2 : operand1, 0, value);
+            break;
+        case 0x9: // SUBB A, operand
+            model_add(aCPU, model_read(aCPU, address, indirect), model_carry(aCPU), 1);
+            break;
+        case 0xa: // MOV operand, direct
+            if (column == 5) // A5h is unused
+            {
+                length = 1;
+                break;
+            }
+            length = 2;
+            cycles = 2;
+            model_write(aCPU, address, indirect, model_read(aCPU, operand1, 0));
+            break;
+        case 0xb: // CJNE A, direct, rel; CJNE operand, #data, rel
+            length = 3;
+            cycles = 2;
+            if (column == 5)
+            {
+                value = model_read(aCPU, operand1, 0);
+                model_set_flag(aCPU, PSW_CY_MASK, acc < value);
+                if (acc != value)
+                    jump = (pc + 3 + (signed char)operand2) & 0xffff;
+            }
+            else
+            {
+                value = model_read(aCPU, address, indirect);
+                model_set_flag(aCPU, PSW_CY_MASK, value < operand1);
+                if (value != operand1)
+                    jump = (pc + 3 + (signed char)operand2) & 0xffff;
+            }
+            break;
+        case 0xc: // XCH A, operand
+            aCPU->mSFR[REG_ACC] = model_read(aCPU, address, indirect);
+            model_write(aCPU, address, indirect, acc);
+            break;
+        case 0xd: // DJNZ direct, rel; XCHD A, @Ri; DJNZ Rn, rel
+            if (column == 6 || column == 7)
+            {
+                value = model_read(aCPU, address, indirect);
+                aCPU->mSFR[REG_ACC] = (acc & 0xf0) | (value & 0x0f);
+                model_write(aCPU, address, indirect, (value & 0xf0) | (acc & 0x0f));
+                break;
+            }
+            length++;
+            cycles = 2;
+            value = (model_read(aCPU, address, indirect) - 1) & 0xff;
+            model_write(aCPU, address, indirect, value);
+            if (value)
+                jump = (pc + length + (signed char)(column == 5 ? operand2 : operand1)) & 0xffff;
+            break;
+        case 0xe: // MOV A, operand
+            aCPU->mSFR[REG_ACC] = model_read(aCPU, address, indirect);
+            break;
+        case 0xf: // MOV operand, A
+            model_write(aCPU, address, indirect, acc);
+            break;
+        }
+    }
+
+    if (jump >= 0)
+        aCPU->mPC = jump & 0xffff;
+    else
+        aCPU->mPC = (pc + length) & 0xffff;
+
+    // the parity flag follows ACC
+    value = aCPU->mSFR[REG_ACC];
+    for (parity = 0; value; value >>= 1)
+        parity ^= value & 1;
+    model_set_flag(aCPU, PSW_P_MASK, parity);
+
+    return cycles - 1;
+}
+
+//
+// Engines and runners
+//
+
+// One operation through an engine, the way the core's execute() runs it,
+// with PSW brought up to date first only where the core would.
+static int engine_step(struct em8051 *aCPU, int aEngine)
+{
+    int pc = aCPU->mPC & (aCPU->mCodeMemSize - 1);
+    struct em8051decoded *d;
+    int flags;
+
+    if (aEngine == ENGINE_MODEL)
+        return model_step(aCPU);
+
+    if (aEngine == ENGINE_DECODED)
+    {
+        d = aCPU->mDecoded + pc;
+        if (d->mLength == 0)
+            op_predecode(aCPU, pc);
+        if (d->mFlags & (DECODED_SFR | DECODED_CALLBACK | DECODED_PSW))
+            psw_sync(aCPU);
+        return d->mOp(aCPU);
+    }
+
+    flags = op_flags(aCPU, pc);
+    if (flags & (DECODED_SFR | DECODED_CALLBACK | DECODED_PSW))
+        psw_sync(aCPU);
+    if (aEngine == ENGINE_SWITCH)
+        return do_op(aCPU);
+    return aCPU->op[aCPU->mCodeMem[pc]](aCPU);
+}
+
+static void setup(struct em8051 *aCPU, int aDecoded)
+{
+    memset(aCPU, 0, sizeof(*aCPU));
+    aCPU->mCodeMem     = malloc(FUZZ_CODE_SIZE);
+    aCPU->mCodeMemSize = FUZZ_CODE_SIZE;
+    aCPU->mExtData     = malloc(FUZZ_EXT_SIZE);
+    aCPU->mExtDataSize = FUZZ_EXT_SIZE;
+    aCPU->mLowerData   = malloc(128);
+    aCPU->mUpperData   = malloc(128);
+    aCPU->mSFR         = malloc(128);
+    if (aDecoded)
+        aCPU->mDecoded = calloc(FUZZ_CODE_SIZE, sizeof(struct em8051decoded));
+    reset(aCPU, 1);
+}
+
+static void setup_all(void)
+{
+    static int done = 0;
+    int i;
+
+    if (done)
+        return;
+    done = 1;
+
+    for (i = 0; i < ENGINES; i++)
+        setup(&engines[i], i == ENGINE_DECODED);
+    for (i = 0; i < RUNNERS; i++)
+        setup(&runners[i], i >= RUN_DECODED);
+    runners[RUN_JIT].mJit = jit_create(&runners[RUN_JIT]);
+}
+
+// Set up the state an input describes
+static void load_input(struct em8051 *aCPU, const unsigned char *aData, int aSize)
+{
+    unsigned char input[FUZZ_INPUT_SIZE];
+    int i;
+
+    if (aSize > FUZZ_INPUT_SIZE)
+        aSize = FUZZ_INPUT_SIZE;
+    memset(input, 0, sizeof(input));
+    memcpy(input, aData, aSize);
+
+    reset(aCPU, 1);
+    memcpy(aCPU->mLowerData, input + FUZZ_LOWER, 128);
+    memcpy(aCPU->mUpperData, input + FUZZ_UPPER, 128);
+    memcpy(aCPU->mSFR, input + FUZZ_SFR, 128);
+    aCPU->mSFR[REG_PCON] &= ~(PCON_IDL_MASK | PCON_PD_MASK);
+    memcpy(aCPU->mCodeMem, input + FUZZ_CODE, FUZZ_CODE_SIZE);
+    for (i = 0; i < FUZZ_EXT_SIZE; i++)
+        aCPU->mExtData[i] = (i * 167 + (i >> 8)) & 0xff;
+
+    predecode_invalidate(aCPU, 0, FUZZ_CODE_SIZE);
+    timer_sync(aCPU);
+    psw_sync(aCPU);
+}
+
+static const char *sfr_name(int aAddress)
+{
+    switch (aAddress - 0x80)
+    {
+    case REG_ACC: return "A";
+    case REG_B: return "B";
+    case REG_PSW: return "PSW";
+    case REG_SP: return "SP";
+    case REG_DPL: return "DPL";
+    case REG_DPH: return "DPH";
+    }
+    return NULL;
+}
+
+// Compare a byte; describes the first difference in aReport
+static int differ(const char *aWhat, int aAddress, int aWidth, int aValue1, int aValue2,
+    const char *aName1, const char *aName2, char *aReport)
+{
+    char what[32];
+
+    if (aValue1 == aValue2)
+        return 0;
+    if (aAddress < 0)
+        sprintf(what, "%s", aWhat);
+    else
+        sprintf(what, "%s %0*Xh", aWhat, aWidth, aAddress);
+    sprintf(aReport, "    %s: %s %0*X, %s %0*X\n", what, aName1, aWidth, aValue1, aName2, aWidth, aValue2);
+    return 1;
+}
+
+// PSW as psw_sync() would leave it, leaving the emulator as it is;
+// syncing the emulator itself would change how it goes on
+static int synced_psw(struct em8051 *aCPU)
+{
+    int flagsop = aCPU->mFlagsOp;
+    int psw = aCPU->mSFR[REG_PSW];
+    int synced;
+
+    psw_sync(aCPU);
+    synced = aCPU->mSFR[REG_PSW];
+    aCPU->mFlagsOp = flagsop;
+    aCPU->mSFR[REG_PSW] = psw;
+    return synced;
+}
+
+// Compare the state of two emulators, with up to date PSW. Returns
+// nonzero, with the first difference described in aReport, if they
+// differ.
+static int compare(struct em8051 *aCPU1, struct em8051 *aCPU2, const char *aName1, const char *aName2, char *aReport)
+{
+    static const int registers[] = { REG_ACC, REG_B, REG_PSW, REG_SP, REG_DPL, REG_DPH };
+    unsigned char sfr1[128];
+    unsigned char sfr2[128];
+    char what[8];
+    int bank;
+    int i;
+
+    memcpy(sfr1, aCPU1->mSFR, 128);
+    memcpy(sfr2, aCPU2->mSFR, 128);
+    sfr1[REG_PSW] = synced_psw(aCPU1);
+    sfr2[REG_PSW] = synced_psw(aCPU2);
+
+    // the usual case
+    if ((aCPU1->mPC & 0xffff) == (aCPU2->mPC & 0xffff) &&
+        aCPU1->mInterruptActive == aCPU2->mInterruptActive &&
+        memcmp(sfr1, sfr2, 128) == 0 &&
+        memcmp(aCPU1->mLowerData, aCPU2->mLowerData, 128) == 0 &&
+        memcmp(aCPU1->mUpperData, aCPU2->mUpperData, 128) == 0 &&
+        memcmp(aCPU1->mExtData, aCPU2->mExtData, FUZZ_EXT_SIZE) == 0)
+        return 0;
+
+    if (differ("PC", -1, 4, aCPU1->mPC & 0xffff, aCPU2->mPC & 0xffff, aName1, aName2, aReport))
+        return 1;
+    for (i = 0; i < (int)(sizeof(registers) / sizeof(registers[0])); i++)
+        if (differ(sfr_name(registers[i] + 0x80), -1, 2, sfr1[registers[i]], sfr2[registers[i]], aName1, aName2, aReport))
+            return 1;
+    bank = sfr1[REG_PSW] & (PSW_RS0_MASK | PSW_RS1_MASK);
+    for (i = 0; i < 8; i++)
+    {
+        sprintf(what, "R%d", i);
+        if (differ(what, -1, 2, aCPU1->mLowerData[bank + i], aCPU2->mLowerData[bank + i], aName1, aName2, aReport))
+            return 1;
+    }
+    for (i = 0; i < 128; i++)
+        if (differ("SFR", i + 0x80, 2, sfr1[i], sfr2[i], aName1, aName2, aReport))
+            return 1;
+    for (i = 0; i < 128; i++)
+        if (differ("IRAM", i, 2, aCPU1->mLowerData[i], aCPU2->mLowerData[i], aName1, aName2, aReport))
+            return 1;
+    for (i = 0; i < 128; i++)
+        if (differ("IRAM", i + 0x80, 2, aCPU1->mUpperData[i], aCPU2->mUpperData[i], aName1, aName2, aReport))
+            return 1;
+    for (i = 0; i < FUZZ_EXT_SIZE; i++)
+        if (differ("XRAM", i, 4, aCPU1->mExtData[i], aCPU2->mExtData[i], aName1, aName2, aReport))
+            return 1;
+    if (differ("interrupt level", -1, 1, aCPU1->mInterruptActive, aCPU2->mInterruptActive, aName1, aName2, aReport))
+        return 1;
+    return 0;
+}
+
+// Run an input through the engines operation by operation. Returns
+// nonzero, with the divergence described in aReport, if they disagree.
+static int fuzz_engines(const unsigned char *aData, int aSize, char *aReport)
+{
+    unsigned char text[64];
+    char detail[256];
+    struct em8051decoded *d;
+    int delay[ENGINES];
+    int diverged = 0;
+    int pc;
+    int step;
+    int i;
+
+    for (i = 0; i < ENGINES; i++)
+        load_input(&engines[i], aData, aSize);
+
+    for (step = 0; step < steps && !diverged; step++)
+    {
+        pc = engines[ENGINE_MODEL].mPC & 0xffff;
+        for (i = 0; i < ENGINES; i++)
+            delay[i] = engine_step(&engines[i], i);
+
+        for (i = 1; i < ENGINES && !diverged; i++)
+        {
+            diverged = compare(&engines[ENGINE_MODEL], &engines[i], engine_names[ENGINE_MODEL], engine_names[i], detail) ||
+                differ("ticks", -1, 1, delay[ENGINE_MODEL], delay[i], engine_names[ENGINE_MODEL], engine_names[i], detail);
+        }
+
+        // the tables run_cycles() goes by
+        d = engines[ENGINE_DECODED].mDecoded + (pc & (FUZZ_CODE_SIZE - 1));
+        if (!diverged)
+            diverged = differ("op_ticks[]", -1, 1, delay[ENGINE_MODEL], d->mTicks, engine_names[ENGINE_MODEL], "table", detail);
+        if (!diverged && !(d->mFlags & DECODED_JUMP))
+            diverged = differ("op_lengths[]", -1, 1, (engines[ENGINE_MODEL].mPC - pc) & 0xffff, d->mLength, engine_names[ENGINE_MODEL], "table", detail);
+    }
+
+    if (diverged)
+    {
+        decode(&engines[ENGINE_MODEL], pc, text);
+        sprintf(aReport, "Divergence at operation %d, %04X: %s\n%s", step, pc, text, detail);
+    }
+    return diverged;
+}
+
+// Run an input through the runners, with timers and interrupts. Returns
+// nonzero, with the divergence described in aReport, if they disagree.
+static int fuzz_runners(const unsigned char *aData, int aSize, char *aReport)
+{
+    char detail[256];
+    int done;
+    int chunk;
+    int ran;
+    int i;
+
+    for (i = 0; i < RUNNERS; i++)
+        load_input(&runners[i], aData, aSize);
+
+    for (done = 0; done < ticks; done += chunk)
+    {
+        chunk = ticks - done < RUN_CHUNK ? ticks - done : RUN_CHUNK;
+        for (i = 0; i < chunk; i++)
+            tick(&runners[RUN_TICK]);
+        timer_sync(&runners[RUN_TICK]);
+
+        for (i = RUN_CYCLES; i < RUNNERS; i++)
+        {
+            if (i == RUN_JIT && !runners[RUN_JIT].mJit)
+                continue;
+            for (ran = 0; ran < chunk; )
+                ran += run_cycles(&runners[i], chunk - ran, -1);
+            timer_sync(&runners[i]);
+
+            if (compare(&runners[RUN_TICK], &runners[i], runner_names[RUN_TICK], runner_names[i], detail) ||
+                differ("ticks to delay", -1, 1, runners[RUN_TICK].mTickDelay, runners[i].mTickDelay, runner_names[RUN_TICK], runner_names[i], detail))
+            {
+                sprintf(aReport, "Divergence in ticks %d-%d\n%s", done + 1, done + chunk, detail);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int fuzz_input(const unsigned char *aData, int aSize, char *aReport)
+{
+    setup_all();
+    return fuzz_engines(aData, aSize, aReport) || fuzz_runners(aData, aSize, aReport);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *aData, size_t aSize)
+{
+    char report[1024];
+
+    if (fuzz_input(aData, (int)aSize, report))
+    {
+        printf("%s", report);
+        fflush(stdout);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef EM8051_LIBFUZZER
+
+static unsigned int random_state;
+
+static int random_byte(void)
+{
+    // xorshift
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state >> 24;
+}
+
+static int run_file(char *aFilename)
+{
+    static unsigned char input[FUZZ_INPUT_SIZE];
+    FILE *f;
+    int size;
+
+    if (strcmp(aFilename, "-") == 0)
+        f = stdin;
+    else
+        f = fopen(aFilename, "rb");
+    if (!f)
+    {
+        printf("File '%s' load failure\n", aFilename);
+        return -1;
+    }
+    size = fread(input, 1, FUZZ_INPUT_SIZE, f);
+    if (f != stdin)
+        fclose(f);
+
+    LLVMFuzzerTestOneInput(input, size);
+    return 0;
+}
+
+int main(int parc, char ** pars)
+{
+    static unsigned char input[FUZZ_INPUT_SIZE];
+    char report[1024];
+    char *savefile = "fuzz-divergence.bin";
+    unsigned int seed = 1;
+    int runs = 10000;
+    int files = 0;
+    int run;
+    int size;
+    int i;
+
+    for (i = 1; i < parc; i++)
+    {
+        if (strncmp("-runs=",pars[i],6) == 0)
+        {
+            runs = atoi(pars[i]+6);
+        }
+        else
+        if (strncmp("-seed=",pars[i],6) == 0)
+        {
+            seed = strtoul(pars[i]+6, NULL, 0);
+        }
+        else
+        if (strncmp("-steps=",pars[i],7) == 0)
+        {
+            steps = atoi(pars[i]+7);
+        }
+        else
+        if (strncmp("-ticks=",pars[i],7) == 0)
+        {
+            ticks = atoi(pars[i]+7);
+        }
+        else
+        if (strncmp("-save=",pars[i],6) == 0)
+        {
+            savefile = pars[i]+6;
+        }
+        else
+        if (pars[i][0] != '-' || pars[i][1] == 0)
+        {
+            files++;
+        }
+        else
+        {
+            printf("Help:\n\n"
+                "emu8051-fuzz [options] [input files]\n\n"
+                "Runs random code through the core's ways of running operations and a\n"
+                "reference model, and reports the first place they disagree. Input\n"
+                "files (\"-\" for stdin) are run instead of random inputs, and abort\n"
+                "on a divergence. Available options:\n\n"
+                "Option            Alternate   description\n"
+                "-runs=count                   Random inputs to try (default 10000)\n"
+                "-seed=value                   Seed for the random inputs (default 1)\n"
+                "-steps=count                  Operations to compare one by one (default 1000)\n"
+                "-ticks=count                  Ticks to compare with timers and interrupts\n"
+                "                              (default 10000)\n"
+                "-save=file                    Where to save the input of a divergence\n"
+                "                              (default fuzz-divergence.bin)\n"
+                );
+            return -1;
+        }
+    }
+
+    if (files)
+    {
+        for (i = 1; i < parc; i++)
+            if (pars[i][0] != '-' || pars[i][1] == 0)
+                if (run_file(pars[i]) < 0)
+                    return -1;
+        return 0;
+    }
+
+    random_state = seed ? seed : 1;
+    for (run = 0; run < runs; run++)
+    {
+        // random state, and from none to all of code memory
+        size = FUZZ_CODE + (random_byte() << 8 | random_byte()) % (FUZZ_CODE_SIZE + 1);
+        for (i = 0; i < size; i++)
+            input[i] = random_byte();
+
+        if (fuzz_input(input, size, report))
+        {
+            FILE *f;
+            printf("Run %d:\n%s", run + 1, report);
+            f = fopen(savefile, "wb");
+            if (!f || fwrite(input, 1, size, f) != (size_t)size || fclose(f) != 0)
+            {
+                printf("File '%s' save failure\n", savefile);
+                return -1;
+            }
+            printf("Input saved to '%s'\n", savefile);
+            return 2;
+        }
+    }
+    printf("%d runs, no divergence\n", runs);
+    return 0;
+}
+
+#endif
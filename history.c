@@ -0,0 +1,221 @@
+/* 8051 emulator 
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * history.c
+ * Execution history for the curses-based emulator front-end
+ */
+
+// The history is a ring of variable-sized records, one per operation, each
+// holding the PC of the operation and the bytes of the SFRs and of the first
+// 64 bytes of the lower memory that it changed, with their old values:
+//
+//   count, PC low, PC high, count * (offset, old value), count
+//
+// The state after the newest operation is kept as a whole in the image, and
+// earlier states are had by undoing records from the newest back; the
+// count at both ends lets the ring be walked either way. Most operations
+// change a byte or two, so a record usually takes 6 to 8 bytes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+#include "emulator.h"
+
+// bytes of ring per line asked for
+#define HISTORY_RECORD_BYTES 8
+// the largest record, every byte changed
+#define HISTORY_RECORD_MAX (4 + 2 * (128 + 64))
+
+// positions are at most one lap outside the ring
+static unsigned char ring_get(struct history *aHistory, int aPos)
+{
+    if (aPos >= aHistory->size)
+        aPos -= aHistory->size;
+    return aHistory->ring[aPos];
+}
+
+// bytes taken by the record starting at aPos
+static int record_size(struct history *aHistory, int aPos)
+{
+    return 4 + 2 * ring_get(aHistory, aPos);
+}
+
+// bytes taken by the record ending at aPos
+static int record_size_back(struct history *aHistory, int aPos)
+{
+    return 4 + 2 * ring_get(aHistory, aPos + aHistory->size - 1);
+}
+
+// undo the record ending at aPos on aImage; returns its start and PC
+static int record_undo(struct history *aHistory, int aPos, unsigned char *aImage, int *aPC)
+{
+    int start = aPos - record_size_back(aHistory, aPos);
+    int count;
+    int i;
+
+    if (start < 0)
+        start += aHistory->size;
+    count = ring_get(aHistory, start);
+    *aPC = ring_get(aHistory, start + 1) | (ring_get(aHistory, start + 2) << 8);
+    for (i = 0; i < count; i++)
+        aImage[ring_get(aHistory, start + 3 + i * 2)] = ring_get(aHistory, start + 4 + i * 2);
+    return start;
+}
+
+void history_init(struct em8051 *aCPU, int aLines)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct history *h = &ctx->history;
+
+    free(h->ring);
+    h->size = aLines * HISTORY_RECORD_BYTES;
+    if (h->size < HISTORY_RECORD_MAX)
+        h->size = HISTORY_RECORD_MAX;
+    h->ring = malloc(h->size);
+    if (!h->ring)
+        h->size = 0;
+    h->head = 0;
+    h->used = 0;
+    h->entries = 0;
+    memcpy(h->image, aCPU->mSFR, 128);
+    memcpy(h->image + 128, aCPU->mLowerData, 64);
+}
+
+// Append the bytes of aNow that differ from aImage to aRecord, after aCount
+// changes already there, and bring aImage up to date; aOffset is the
+// position of aImage in the image. Compares eight bytes at a time in place,
+// as few of them change. Returns the new count.
+static int record_changes(unsigned char *aRecord, int aCount, unsigned char *aImage, const unsigned char *aNow, int aOffset, int aLength)
+{
+    unsigned long long was, now;
+    int i, j;
+
+    for (i = 0; i < aLength; i += 8)
+    {
+        memcpy(&was, aImage + i, 8);
+        memcpy(&now, aNow + i, 8);
+        if (was == now)
+            continue;
+        // write every byte out, but only move on past the changed ones
+        for (j = i; j < i + 8; j++)
+        {
+            aRecord[3 + aCount * 2] = aOffset + j;
+            aRecord[4 + aCount * 2] = aImage[j];
+            aCount += aImage[j] != aNow[j];
+        }
+        memcpy(aImage + i, aNow + i, 8);
+    }
+    return aCount;
+}
+
+void history_add(struct em8051 *aCPU, int aOldPC)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct history *h = &ctx->history;
+    unsigned char record[HISTORY_RECORD_MAX];
+    int count;
+    int i;
+
+    ctx->icount++;
+
+    timer_sync(aCPU);
+
+    if (h->size == 0)
+        return;
+
+    count = record_changes(record, 0, h->image, aCPU->mSFR, 0, 128);
+    count = record_changes(record, count, h->image + 128, aCPU->mLowerData, 128, 64);
+
+    record[0] = count;
+    record[1] = aOldPC & 0xff;
+    record[2] = (aOldPC >> 8) & 0xff;
+    record[3 + count * 2] = count;
+
+    // make room by forgetting the oldest
+    while (h->used + 4 + count * 2 > h->size)
+    {
+        int tail = h->head - h->used;
+        h->used -= record_size(h, tail < 0 ? tail + h->size : tail);
+        h->entries--;
+    }
+
+    if (h->head + 4 + count * 2 <= h->size)
+    {
+        memcpy(h->ring + h->head, record, 4 + count * 2);
+    }
+    else
+    {
+        for (i = 0; i < 4 + count * 2; i++)
+            h->ring[(h->head + i) % h->size] = record[i];
+    }
+    h->head += 4 + count * 2;
+    if (h->head >= h->size)
+        h->head -= h->size;
+    h->used += 4 + count * 2;
+    h->entries++;
+    h->newest = ctx->icount;
+}
+
+int history_read(struct em8051 *aCPU, int aCount, int *aPC, unsigned char aImage[][128 + 64])
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct history *h = &ctx->history;
+    unsigned char image[128 + 64];
+    int pos = h->head;
+    int i;
+
+    if (aCount > h->entries)
+        aCount = h->entries;
+    memcpy(image, h->image, sizeof(image));
+    for (i = aCount - 1; i >= 0; i--)
+    {
+        memcpy(aImage[i], image, sizeof(image));
+        pos = record_undo(h, pos, image, &aPC[i]);
+    }
+    return aCount;
+}
+
+void history_rewind(struct em8051 *aCPU, unsigned int aCount)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct history *h = &ctx->history;
+    int pc;
+
+    while (h->entries && h->newest != aCount)
+    {
+        h->used -= record_size_back(h, h->head);
+        h->head = record_undo(h, h->head, h->image, &pc);
+        h->entries--;
+        h->newest--;
+    }
+    // went back past the oldest; start over from the machine, which
+    // the caller has put back to that point
+    if (h->newest != aCount)
+    {
+        h->newest = aCount;
+        memcpy(h->image, aCPU->mSFR, 128);
+        memcpy(h->image + 128, aCPU->mLowerData, 64);
+    }
+}
@@ -0,0 +1,540 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * jit.c
+ * Basic block translator for x86-64 hosts
+ */
+
+// Straight runs of operations are translated into native code, without
+// going through the interrupt, timer and breakpoint checks between them.
+// A block only holds operations that can't affect those checks: no SFR or
+// timer access, no jumps and no callbacks to the front-end. The last
+// operation of a block may also be a jump, call, return, stack operation
+// or MOVX, as the checks are done again right after it. The ticks of the
+// whole block are known when it is translated, and are counted in one go.
+//
+// Moves, increments, decrements and logic operations between A, R0-R7,
+// immediates and lower RAM are written out as native instructions on
+// mLowerData and mSFR; the register bank is read from PSW where needed.
+// The PC is only brought up to date before the other operations, which
+// call their handlers, and at the end of the block. PSW is brought up to
+// date before operations that use the carry flags and before a last
+// operation that calls the front-end; the parity flag is worked out from
+// A when PSW is, so the native code needn't keep it.
+//
+// Where no block can start, the predecoded record gets DECODED_NOBLOCK, so
+// that run_cycles() goes straight to the interpreter there. The pages of
+// the code buffer that a block is written into are only writable while it
+// is being written.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_MAX_OPS 32
+// longest block in bytes; a block can't cover more than this
+#define JIT_MAX_SPAN (JIT_MAX_OPS * 3)
+// room needed for translating one block
+#define JIT_BLOCK_ROOM (JIT_MAX_OPS * 64 + 32)
+
+enum BLOCK_STATES
+{
+    BLOCK_NEW,      // not translated yet
+    BLOCK_READY,    // translated
+    BLOCK_INTERPRET // too short to be worth translating; interpret
+};
+
+struct jitblock
+{
+    void (*mCode)(struct em8051 *aCPU);
+    int mTicks; // ticks from the block start to its last operation
+    int mLast; // offset of the last operation from the block start
+    int mLastTicks; // ticks the last operation delays
+    int mState; // see BLOCK_STATES
+};
+
+struct em8051jit
+{
+    unsigned char *mCode; // executable buffer for the translations
+    int mCodeUsed;
+    struct jitblock *mBlocks; // one per code memory address
+    struct em8051decoded *mDecoded; // the emulator's predecoded records
+    int mSize;
+    int mPageSize;
+};
+
+struct em8051jit *jit_create(struct em8051 *aCPU)
+{
+    struct em8051jit *jit;
+
+    if (!aCPU->mDecoded)
+        return NULL;
+
+    jit = malloc(sizeof(struct em8051jit));
+    if (!jit)
+        return NULL;
+    jit->mCode = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, 
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->mCode == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    // some systems don't let writable memory become executable
+    if (mprotect(jit->mCode, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(jit->mCode, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+    jit->mDecoded = aCPU->mDecoded;
+    jit->mSize = aCPU->mCodeMemSize;
+    jit->mPageSize = (int)sysconf(_SC_PAGESIZE);
+    jit->mBlocks = calloc(jit->mSize, sizeof(struct jitblock));
+    if (!jit->mBlocks)
+    {
+        munmap(jit->mCode, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+    jit->mCodeUsed = 0;
+    return jit;
+}
+
+void jit_destroy(struct em8051jit *aJit)
+{
+    if (!aJit)
+        return;
+    munmap(aJit->mCode, JIT_CODE_SIZE);
+    free(aJit->mBlocks);
+    free(aJit);
+}
+
+void jit_invalidate(struct em8051jit *aJit, int aAddress, int aLength)
+{
+    int i;
+
+    if (aLength >= aJit->mSize)
+    {
+        memset(aJit->mBlocks, 0, aJit->mSize * sizeof(struct jitblock));
+        aJit->mCodeUsed = 0;
+        return;
+    }
+
+    // the blocks are left in the code buffer until it gets flushed
+    for (i = aAddress - JIT_MAX_SPAN; i < aAddress + aLength; i++)
+    {
+        aJit->mBlocks[i & (aJit->mSize - 1)].mState = BLOCK_NEW;
+        aJit->mDecoded[i & (aJit->mSize - 1)].mFlags &= ~DECODED_NOBLOCK;
+    }
+}
+
+static void emit(struct em8051jit *aJit, const void *aBytes, int aLength)
+{
+    memcpy(aJit->mCode + aJit->mCodeUsed, aBytes, aLength);
+    aJit->mCodeUsed += aLength;
+}
+
+// Change the protection of the pages from aStart to aEnd in the code buffer
+static int protect(struct em8051jit *aJit, int aStart, int aEnd, int aProt)
+{
+    int first = aStart & ~(aJit->mPageSize - 1);
+    int last = (aEnd + aJit->mPageSize - 1) & ~(aJit->mPageSize - 1);
+
+    if (last > JIT_CODE_SIZE)
+        last = JIT_CODE_SIZE;
+    return mprotect(aJit->mCode + first, last - first, aProt);
+}
+
+// Where a native operation finds its byte. The translation keeps
+// mLowerData in r12, mSFR in r13 and, once read, the register bank in rax.
+enum NATIVE_PLACES
+{
+    PLACE_SFR,   // [r13 + offset]
+    PLACE_DIRECT, // [r12 + address]
+    PLACE_REG    // [r12 + rax + register]
+};
+
+// Emit an instruction with a byte in memory as its r/m operand, and aReg
+// in its reg field
+static void emit_place(struct em8051jit *aJit, const char *aOpcode, int aLength, int aReg, int aPlace, int aValue)
+{
+    unsigned char code[8];
+    int n = 0;
+
+    code[n++] = 0x41; // REX.B, for r12 and r13
+    memcpy(code + n, aOpcode, aLength);
+    n += aLength;
+    switch (aPlace)
+    {
+    case PLACE_SFR:
+        code[n++] = 0x45 | (aReg << 3);
+        break;
+    case PLACE_DIRECT:
+        code[n++] = 0x44 | (aReg << 3);
+        code[n++] = 0x24;
+        break;
+    case PLACE_REG:
+        code[n++] = 0x44 | (aReg << 3);
+        code[n++] = 0x04;
+        break;
+    }
+    code[n++] = aValue;
+    emit(aJit, code, n);
+}
+
+// register numbers in the reg field
+#define HOST_ECX 1
+#define HOST_EDX 2
+
+static void emit_load(struct em8051jit *aJit, int aReg, int aPlace, int aValue)
+{
+    emit_place(aJit, "\x0f\xb6", 2, aReg, aPlace, aValue); // movzx reg, byte [place]
+}
+
+static void emit_store(struct em8051jit *aJit, int aReg, int aPlace, int aValue)
+{
+    emit_place(aJit, "\x88", 1, aReg, aPlace, aValue); // mov byte [place], reg
+}
+
+static void emit_store_imm(struct em8051jit *aJit, int aPlace, int aValue, int aImmediate)
+{
+    unsigned char imm = aImmediate;
+    emit_place(aJit, "\xc6", 1, 0, aPlace, aValue); // mov byte [place], imm
+    emit(aJit, &imm, 1);
+}
+
+// Nonzero if the operation can be written out as native code; any direct
+// address it has is in lower RAM, as blocks hold no SFR access
+static int native_op(int aOpcode)
+{
+    switch (aOpcode)
+    {
+    case 0x00: // nop
+    case 0x04: case 0x05: case 0x14: case 0x15: // inc, dec a / direct
+    case 0x42: case 0x43: case 0x44: case 0x45: // orl
+    case 0x52: case 0x53: case 0x54: case 0x55: // anl
+    case 0x62: case 0x63: case 0x64: case 0x65: // xrl
+    case 0x74: case 0x75: case 0x85: // mov a / direct, #data; mov direct, direct
+    case 0xc5: case 0xe4: case 0xe5: case 0xf4: case 0xf5: // xch, clr, mov, cpl, mov
+        return 1;
+    }
+    switch (aOpcode & 0xf8)
+    {
+    case 0x08: case 0x18: // inc, dec rx
+    case 0x48: case 0x58: case 0x68: // orl, anl, xrl a, rx
+    case 0x78: case 0x88: case 0xa8: // mov rx, #data; mov direct, rx; mov rx, direct
+    case 0xc8: case 0xe8: case 0xf8: // xch a, rx; mov a, rx; mov rx, a
+        return 1;
+    }
+    return 0;
+}
+
+// Write out a native_op() operation. aBank is nonzero while rax holds the
+// register bank.
+static void emit_native(struct em8051jit *aJit, int aOpcode, int aOperand1, int aOperand2, int *aBank)
+{
+    // the operand besides A: a register or a direct address
+    int place = (aOpcode & 0x08) ? PLACE_REG : PLACE_DIRECT;
+    int value = (aOpcode & 0x08) ? (aOpcode & 7) : aOperand1;
+    unsigned char imm;
+
+    if (place == PLACE_REG && !*aBank)
+    {
+        emit_load(aJit, 0, PLACE_SFR, REG_PSW); // movzx eax, byte [psw]
+        emit(aJit, "\x83\xe0\x18", 3);          // and eax, 18h
+        *aBank = 1;
+    }
+
+    switch (aOpcode)
+    {
+    case 0x00:
+        return;
+    case 0x04: case 0x14: // inc, dec a
+        emit_place(aJit, "\xfe", 1, aOpcode >> 4, PLACE_SFR, REG_ACC);
+        return;
+    case 0x42: case 0x52: case 0x62: // orl, anl, xrl direct, a
+        emit_load(aJit, HOST_ECX, PLACE_SFR, REG_ACC);
+        emit_place(aJit, aOpcode == 0x42 ? "\x08" : aOpcode == 0x52 ? "\x20" : "\x30", 1, HOST_ECX, PLACE_DIRECT, aOperand1);
+        return;
+    case 0x43: case 0x53: case 0x63: // orl, anl, xrl direct, #data
+        emit_place(aJit, "\x80", 1, aOpcode == 0x43 ? 1 : aOpcode == 0x53 ? 4 : 6, PLACE_DIRECT, aOperand1);
+        imm = aOperand2;
+        emit(aJit, &imm, 1);
+        return;
+    case 0x44: case 0x54: case 0x64: // orl, anl, xrl a, #data
+        emit_place(aJit, "\x80", 1, aOpcode == 0x44 ? 1 : aOpcode == 0x54 ? 4 : 6, PLACE_SFR, REG_ACC);
+        imm = aOperand1;
+        emit(aJit, &imm, 1);
+        return;
+    case 0x74: // mov a, #data
+        emit_store_imm(aJit, PLACE_SFR, REG_ACC, aOperand1);
+        return;
+    case 0x75: // mov direct, #data
+        emit_store_imm(aJit, PLACE_DIRECT, aOperand1, aOperand2);
+        return;
+    case 0x85: // mov direct, direct; the destination is the second one
+        emit_load(aJit, HOST_ECX, PLACE_DIRECT, aOperand1);
+        emit_store(aJit, HOST_ECX, PLACE_DIRECT, aOperand2);
+        return;
+    case 0xe4: // clr a
+        emit_store_imm(aJit, PLACE_SFR, REG_ACC, 0);
+        return;
+    case 0xf4: // cpl a
+        emit_place(aJit, "\xf6", 1, 2, PLACE_SFR, REG_ACC); // not byte [acc]
+        return;
+    }
+
+    switch (aOpcode & 0xf0)
+    {
+    case 0x00: case 0x10: // inc, dec direct / rx
+        emit_place(aJit, "\xfe", 1, aOpcode >> 4, place, value);
+        return;
+    case 0x40: case 0x50: case 0x60: // orl, anl, xrl a, direct / rx
+        emit_load(aJit, HOST_ECX, place, value);
+        emit_place(aJit, aOpcode < 0x50 ? "\x08" : aOpcode < 0x60 ? "\x20" : "\x30", 1, HOST_ECX, PLACE_SFR, REG_ACC);
+        return;
+    case 0x70: // mov rx, #data
+        emit_store_imm(aJit, PLACE_REG, value, aOperand1);
+        return;
+    case 0x80: // mov direct, rx
+        emit_load(aJit, HOST_ECX, PLACE_REG, value);
+        emit_store(aJit, HOST_ECX, PLACE_DIRECT, aOperand1);
+        return;
+    case 0xa0: // mov rx, direct
+        emit_load(aJit, HOST_ECX, PLACE_DIRECT, aOperand1);
+        emit_store(aJit, HOST_ECX, PLACE_REG, value);
+        return;
+    case 0xc0: // xch a, direct / rx
+        emit_load(aJit, HOST_ECX, PLACE_SFR, REG_ACC);
+        emit_load(aJit, HOST_EDX, place, value);
+        emit_store(aJit, HOST_EDX, PLACE_SFR, REG_ACC);
+        emit_store(aJit, HOST_ECX, place, value);
+        return;
+    case 0xe0: // mov a, direct / rx
+        emit_load(aJit, HOST_ECX, place, value);
+        emit_store(aJit, HOST_ECX, PLACE_SFR, REG_ACC);
+        return;
+    case 0xf0: // mov direct / rx, a
+        emit_load(aJit, HOST_ECX, PLACE_SFR, REG_ACC);
+        emit_store(aJit, HOST_ECX, place, value);
+        return;
+    }
+}
+
+// Emit add dword [rbx + mPC], aBytes
+static void emit_pc_add(struct em8051jit *aJit, int aBytes)
+{
+    int offset = offsetof(struct em8051, mPC);
+    emit(aJit, "\x81\x83", 2);
+    emit(aJit, &offset, 4);
+    emit(aJit, &aBytes, 4);
+}
+
+// Emit a call of aFunction(aCPU)
+static void emit_call(struct em8051jit *aJit, const void *aFunction)
+{
+    emit(aJit, "\x48\x89\xdf", 3); // mov rdi, rbx
+    emit(aJit, "\x48\xb8", 2);     // mov rax, function
+    emit(aJit, aFunction, 8);
+    emit(aJit, "\xff\xd0", 2);     // call rax
+}
+
+static void translate(struct em8051 *aCPU, int aPosition)
+{
+    struct em8051jit *jit = aCPU->mJit;
+    struct jitblock *block = jit->mBlocks + aPosition;
+    struct em8051decoded *d;
+    em8051operation ops[JIT_MAX_OPS];
+    int sync[JIT_MAX_OPS];
+    int offsets[JIT_MAX_OPS + 1];
+    void (*pswsync)(struct em8051 *) = &psw_sync;
+    int mask = aCPU->mCodeMemSize - 1;
+    int lower = offsetof(struct em8051, mLowerData);
+    int sfr = offsetof(struct em8051, mSFR);
+    int offset = 0;
+    int ticks = 0;
+    int count = 0;
+    int last = 0;
+    int lastticks = 0;
+    int start;
+    int pcdone; // offset the PC is at in the translation
+    int bank = 0;
+    int native = 0;
+    int i;
+
+    // collect the operations
+    while (count < JIT_MAX_OPS)
+    {
+        d = aCPU->mDecoded + ((aPosition + offset) & mask);
+        if (d->mLength == 0)
+            op_predecode(aCPU, aPosition + offset);
+        if (d->mFlags & (DECODED_SFR | DECODED_TIMER))
+            break;
+        // every operation but the last takes at least one tick
+        if (count)
+            ticks += lastticks ? lastticks : 1;
+        sync[count] = d->mFlags & (DECODED_CALLBACK | DECODED_PSW);
+        offsets[count] = offset;
+        ops[count++] = d->mOp;
+        last = offset;
+        lastticks = d->mTicks;
+        offset += d->mLength;
+        if (d->mFlags & (DECODED_JUMP | DECODED_CALLBACK))
+            break;
+    }
+    offsets[count] = offset;
+
+    if (count < 2)
+    {
+        block->mState = BLOCK_INTERPRET;
+        jit->mDecoded[aPosition].mFlags |= DECODED_NOBLOCK;
+        return;
+    }
+
+    if (jit->mCodeUsed + JIT_BLOCK_ROOM > JIT_CODE_SIZE)
+    {
+        // out of room; start over
+        jit_invalidate(jit, 0, jit->mSize);
+    }
+
+    start = jit->mCodeUsed;
+    if (protect(jit, start, start + JIT_BLOCK_ROOM, PROT_READ | PROT_WRITE) != 0)
+    {
+        block->mState = BLOCK_INTERPRET;
+        return;
+    }
+
+    block->mCode = (void (*)(struct em8051 *))(jit->mCode + start);
+    block->mTicks = ticks;
+    block->mLast = last;
+    block->mLastTicks = lastticks;
+
+    emit(jit, "\x53", 1);             // push rbx
+    emit(jit, "\x41\x54", 2);         // push r12
+    emit(jit, "\x41\x55", 2);         // push r13
+    emit(jit, "\x48\x89\xfb", 3);     // mov rbx, rdi
+    emit(jit, "\x4c\x8b\xa3", 3);     // mov r12, [rbx + mLowerData]
+    emit(jit, &lower, 4);
+    emit(jit, "\x4c\x8b\xab", 3);     // mov r13, [rbx + mSFR]
+    emit(jit, &sfr, 4);
+    pcdone = 0;
+    for (i = 0; i < count; i++)
+    {
+        int pos = aPosition + offsets[i];
+        int opcode = aCPU->mCodeMem[pos & mask];
+        native = native_op(opcode);
+        if (native)
+        {
+            emit_native(jit, opcode, aCPU->mCodeMem[(pos + 1) & mask], aCPU->mCodeMem[(pos + 2) & mask], &bank);
+            continue;
+        }
+        if (pcdone != offsets[i])
+            emit_pc_add(jit, offsets[i] - pcdone);
+        if (sync[i])
+            emit_call(jit, &pswsync);
+        emit_call(jit, &ops[i]);
+        pcdone = offsets[i + 1];
+        bank = 0;
+    }
+    // a last handler has set the PC already
+    if (native)
+        emit_pc_add(jit, offsets[count] - pcdone);
+    emit(jit, "\x41\x5d", 2);         // pop r13
+    emit(jit, "\x41\x5c", 2);         // pop r12
+    emit(jit, "\x5b", 1);             // pop rbx
+    emit(jit, "\xc3", 1);             // ret
+
+    if (protect(jit, start, start + JIT_BLOCK_ROOM, PROT_READ | PROT_EXEC) != 0)
+    {
+        // none of the blocks on those pages can run any more
+        for (i = 0; i < jit->mSize; i++)
+            jit->mBlocks[i].mState = BLOCK_INTERPRET;
+        return;
+    }
+    block->mState = BLOCK_READY;
+}
+
+int jit_run(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aDelay)
+{
+    struct em8051jit *jit = aCPU->mJit;
+    int pc = aCPU->mPC & (aCPU->mCodeMemSize - 1);
+    struct jitblock *block = jit->mBlocks + pc;
+    int bp;
+
+    if (block->mState == BLOCK_NEW)
+        translate(aCPU, pc);
+    if (block->mState != BLOCK_READY)
+        return 0;
+
+    // interpret if the block would run past the cycle budget, the next
+    // timer overflow or the breakpoint
+    if (block->mTicks > aCycles)
+        return 0;
+    if (aCPU->mTimerTicks + block->mTicks >= aCPU->mTimerEvent)
+        return 0;
+    if (aBreakpoint >= 0)
+    {
+        bp = (aBreakpoint - aCPU->mPC) & 0xffff;
+        if (bp > 0 && bp <= block->mLast)
+            return 0;
+    }
+
+    block->mCode(aCPU);
+
+    *aDelay = block->mLastTicks;
+    return block->mTicks + 1;
+}
+
+#else
+
+// no translator for this host; the core interprets everything
+
+struct em8051jit *jit_create(struct em8051 *aCPU)
+{
+    return NULL;
+}
+
+void jit_destroy(struct em8051jit *aJit)
+{
+}
+
+void jit_invalidate(struct em8051jit *aJit, int aAddress, int aLength)
+{
+}
+
+int jit_run(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aDelay)
+{
+    return 0;
+}
+
+#endif
@@ -34,100 +34,91 @@
 #include "emulator.h"
 
 static int position;
-static int logicmode = 0;
 static int portmode = 0;
-static int oldports[7];
-static unsigned char shiftregisters[7*4];
-static int audiotick = 0;
-static FILE *audioout = NULL;
-static FILE *rawout = NULL;
-
-// for the 2x16 character display
-static unsigned char chardisplayram[0x80];
-static unsigned char chardisplaycgram[0x40];
-static int chardisplaycp = 0;
-static int chardisplayofs = 0;
-static int chardisplaydir = 1;
-static int chardisplayshift = 0;
-static int chardisplaydcb = 7;
-static int chardisplaychargen = 0;
-static int chardisplaydata = 0;
-static int chardisplay4bmode = 0;
-static int chardisplaytick = 0;
-static int chardisplaybusy = 0;
-
-static void closeaudio(void)
+
+static void closeaudio(struct logicboard *lb)
 {
-    int len = ftell(audioout);
-    fseek(audioout, 4, SEEK_SET);
+    int len = ftell(lb->audioout);
+    fseek(lb->audioout, 4, SEEK_SET);
     len -= 8;
-    fwrite(&len,1,4,audioout);
-    fseek(audioout, 40, SEEK_SET);
+    fwrite(&len,1,4,lb->audioout);
+    fseek(lb->audioout, 40, SEEK_SET);
     len -= 32;
-    fwrite(&len,1,4,audioout);
-    fclose(audioout);
+    fwrite(&len,1,4,lb->audioout);
+    fclose(lb->audioout);
+    lb->audioout = NULL;
 }
 
-static void closeraw(void)
+void logicboard_close(struct em8051 *aCPU)
 {
-    fclose(rawout);
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
+    if (lb->audioout)
+        closeaudio(lb);
+    if (lb->rawout)
+    {
+        fclose(lb->rawout);
+        lb->rawout = NULL;
+    }
 }
 
 void logicboard_tick(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
     int i;
-    if (logicmode == 2)
+    if (lb->logicmode == 2)
     {
         for (i = 0; i < 4; i++)
         {
             int clockmask = 2 << (i * 2);
-            if ((oldports[0] & clockmask) == 0 && (aCPU->mSFR[REG_P0] & clockmask))
+            if ((lb->oldports[0] & clockmask) == 0 && (aCPU->mSFR[REG_P0] & clockmask))
             {
-                shiftregisters[i] <<= 1;
-                shiftregisters[i] |= (aCPU->mSFR[REG_P0] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i] <<= 1;
+                lb->shiftregisters[i] |= (aCPU->mSFR[REG_P0] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[1] & clockmask) == 0 && (aCPU->mSFR[REG_P1] & clockmask))
+            if ((lb->oldports[1] & clockmask) == 0 && (aCPU->mSFR[REG_P1] & clockmask))
             {
-                shiftregisters[i + 4] <<= 1;
-                shiftregisters[i + 4] |= (aCPU->mSFR[REG_P1] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 4] <<= 1;
+                lb->shiftregisters[i + 4] |= (aCPU->mSFR[REG_P1] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[2] & clockmask) == 0 && (aCPU->mSFR[REG_P2] & clockmask))
+            if ((lb->oldports[2] & clockmask) == 0 && (aCPU->mSFR[REG_P2] & clockmask))
             {
-                shiftregisters[i + 8] <<= 1;
-                shiftregisters[i + 8] |= (aCPU->mSFR[REG_P2] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 8] <<= 1;
+                lb->shiftregisters[i + 8] |= (aCPU->mSFR[REG_P2] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[3] & clockmask) == 0 && (aCPU->mSFR[REG_P3] & clockmask))
+            if ((lb->oldports[3] & clockmask) == 0 && (aCPU->mSFR[REG_P3] & clockmask))
             {
-                shiftregisters[i + 12] <<= 1;
-                shiftregisters[i + 12] |= (aCPU->mSFR[REG_P3] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 12] <<= 1;
+                lb->shiftregisters[i + 12] |= (aCPU->mSFR[REG_P3] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[4] & clockmask) == 0 && (aCPU->mSFR[REG_P4] & clockmask))
+            if ((lb->oldports[4] & clockmask) == 0 && (aCPU->mSFR[REG_P4] & clockmask))
             {
-                shiftregisters[i + 16] <<= 1;
-                shiftregisters[i + 16] |= (aCPU->mSFR[REG_P4] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 16] <<= 1;
+                lb->shiftregisters[i + 16] |= (aCPU->mSFR[REG_P4] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[5] & clockmask) == 0 && (aCPU->mSFR[REG_P5] & clockmask))
+            if ((lb->oldports[5] & clockmask) == 0 && (aCPU->mSFR[REG_P5] & clockmask))
             {
-                shiftregisters[i + 20] <<= 1;
-                shiftregisters[i + 20] |= (aCPU->mSFR[REG_P5] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 20] <<= 1;
+                lb->shiftregisters[i + 20] |= (aCPU->mSFR[REG_P5] & (clockmask >> 1)) != 0;
             }
-            if ((oldports[6] & clockmask) == 0 && (aCPU->mSFR[REG_P6] & clockmask))
+            if ((lb->oldports[6] & clockmask) == 0 && (aCPU->mSFR[REG_P6] & clockmask))
             {
-                shiftregisters[i + 24] <<= 1;
-                shiftregisters[i + 24] |= (aCPU->mSFR[REG_P6] & (clockmask >> 1)) != 0;
+                lb->shiftregisters[i + 24] <<= 1;
+                lb->shiftregisters[i + 24] |= (aCPU->mSFR[REG_P6] & (clockmask >> 1)) != 0;
             }
             
         }
     }
 
-	if (logicmode == 3)
+	if (lb->logicmode == 3)
 	{
 		// 44780 -style character display
 
-		if (chardisplaybusy > 0)
-			chardisplaybusy--;
+		if (lb->chardisplaybusy > 0)
+			lb->chardisplaybusy--;
 
-		if (((aCPU->mSFR[REG_P4] & 0x01) == 0x01) && ((oldports[4] & 0x04) == 0) && ((aCPU->mSFR[REG_P4] & 0x04) != 0)) 
+		if (((aCPU->mSFR[REG_P4] & 0x01) == 0x01) && ((lb->oldports[4] & 0x04) == 0) && ((aCPU->mSFR[REG_P4] & 0x04) != 0)) 
 		{
 			// Read op
 			// - E level rises from low to high on read ops			
@@ -137,31 +128,31 @@ void logicboard_tick(struct em8051 *aCPU)
 			{   // P4.1
 				// memory IO mode
 
-				if (!chardisplaybusy)
+				if (!lb->chardisplaybusy)
 				{
 					// memory IO mode
-					if (chardisplaychargen == 0)
+					if (lb->chardisplaychargen == 0)
 					{
 						// read from display
-						chardisplaydata = chardisplayram[chardisplaycp & 0x7f];
-						if (!chardisplay4bmode || chardisplaytick)
+						lb->chardisplaydata = lb->chardisplayram[lb->chardisplaycp & 0x7f];
+						if (!lb->chardisplay4bmode || lb->chardisplaytick)
 						{
-							chardisplaycp += chardisplaydir; 
-							if (chardisplayshift)
-								chardisplayofs += chardisplaydir;
+							lb->chardisplaycp += lb->chardisplaydir; 
+							if (lb->chardisplayshift)
+								lb->chardisplayofs += lb->chardisplaydir;
 							// busy for 250 microseconds
-							chardisplaybusy = 250*opt_clock_hz / 12000000;
+							lb->chardisplaybusy = 250*ctx->opt_clock_hz / 12000000;
 						}
 					}
 					else
 					{
 						// read from chargen ram
-						chardisplaydata = chardisplaycgram[chardisplaycp & 0x3f];
-						if (!chardisplay4bmode || chardisplaytick)
+						lb->chardisplaydata = lb->chardisplaycgram[lb->chardisplaycp & 0x3f];
+						if (!lb->chardisplay4bmode || lb->chardisplaytick)
 						{
-							chardisplaycp++; // assumed; not clear from data sheet
+							lb->chardisplaycp++; // assumed; not clear from data sheet
 							// busy for 250 microseconds
-							chardisplaybusy = 250*opt_clock_hz / 12000000;
+							lb->chardisplaybusy = 250*ctx->opt_clock_hz / 12000000;
 						}
 					}
 				}
@@ -169,296 +160,391 @@ void logicboard_tick(struct em8051 *aCPU)
 			else
 			{
 				// instruction mode				
-				chardisplaydata = chardisplaycp & 0x7f;
-				if (chardisplaybusy)
-					chardisplaydata |= 0x80;
+				lb->chardisplaydata = lb->chardisplaycp & 0x7f;
+				if (lb->chardisplaybusy)
+					lb->chardisplaydata |= 0x80;
 				// doesn't cause busy states
 			}
 
-			if (chardisplay4bmode == 0)
+			if (lb->chardisplay4bmode == 0)
 			{
-				p1out = chardisplaydata;
+				ctx->p1out = lb->chardisplaydata;
 			}
 			else
 			{	
-				if (chardisplaytick)
-					p1out = (chardisplaydata << 4) & 0xf0;
+				if (lb->chardisplaytick)
+					ctx->p1out = (lb->chardisplaydata << 4) & 0xf0;
 				else
-					p1out = (chardisplaydata << 0) & 0xf0;
-				chardisplaytick = !chardisplaytick;
+					ctx->p1out = (lb->chardisplaydata << 0) & 0xf0;
+				lb->chardisplaytick = !lb->chardisplaytick;
 			}
 		}
 
 		if (((aCPU->mSFR[REG_P4] & 0x01) != 0x01) && 
-			 ((oldports[4] & 0x04) != 0) &&
+			 ((lb->oldports[4] & 0x04) != 0) &&
 			 ((aCPU->mSFR[REG_P4] & 0x04) == 0))
 		{	// P4.2
 			// Write op
 			// - E level drops from high to low on write ops
 			
-			if (chardisplay4bmode == 0)
+			if (lb->chardisplay4bmode == 0)
 			{
-				chardisplaydata = aCPU->mSFR[REG_P5];
+				lb->chardisplaydata = aCPU->mSFR[REG_P5];
 			}
 			else
 			{
-				if (!chardisplaytick)
+				if (!lb->chardisplaytick)
 				{
-					chardisplaydata = (chardisplaydata & 0xf) | (aCPU->mSFR[REG_P5] & 0xf0);
+					lb->chardisplaydata = (lb->chardisplaydata & 0xf) | (aCPU->mSFR[REG_P5] & 0xf0);
 				}
 				else
 				{
-					chardisplaydata = (chardisplaydata & 0xf0) | ((aCPU->mSFR[REG_P5] & 0xf0) >> 4);
+					lb->chardisplaydata = (lb->chardisplaydata & 0xf0) | ((aCPU->mSFR[REG_P5] & 0xf0) >> 4);
 				}
-				chardisplaytick = !chardisplaytick;
+				lb->chardisplaytick = !lb->chardisplaytick;
 			}
 
-			if (!chardisplaytick || !chardisplay4bmode)
+			if (!lb->chardisplaytick || !lb->chardisplay4bmode)
 			{
 				if (aCPU->mSFR[REG_P4] & 0x02)
 				{ // P4.1
-					if (!chardisplaybusy)
+					if (!lb->chardisplaybusy)
 					{
 						// memory IO mode
-						if (chardisplaychargen == 0)
+						if (lb->chardisplaychargen == 0)
 						{
 							// write to display
-							chardisplayram[chardisplaycp & 0x7f] = chardisplaydata;
-							chardisplaycp += chardisplaydir; 
-							if (chardisplayshift)
-								chardisplayofs += chardisplaydir;
+							lb->chardisplayram[lb->chardisplaycp & 0x7f] = lb->chardisplaydata;
+							lb->chardisplaycp += lb->chardisplaydir; 
+							if (lb->chardisplayshift)
+								lb->chardisplayofs += lb->chardisplaydir;
 							// busy for 250 microseconds
-							chardisplaybusy = 250*opt_clock_hz / 12000000;
+							lb->chardisplaybusy = 250*ctx->opt_clock_hz / 12000000;
 						}
 						else
 						{
 							// write to chargen ram
-							chardisplaycgram[chardisplaycp & 0x3f] = chardisplaydata;
-							chardisplaycp++;  // assumed: not clear from data sheet
+							lb->chardisplaycgram[lb->chardisplaycp & 0x3f] = lb->chardisplaydata;
+							lb->chardisplaycp++;  // assumed: not clear from data sheet
 							// busy for 250 microseconds
-							chardisplaybusy = 250*opt_clock_hz / 12000000;
+							lb->chardisplaybusy = 250*ctx->opt_clock_hz / 12000000;
 						}
 					}
 				}
 				else
 				{
 					// instruction mode				
-					if (chardisplaybusy)
+					if (lb->chardisplaybusy)
 					{
 						// if busy, only let the user read the busy state.
 					}
 					else
-					if (chardisplaydata == 1)
+					if (lb->chardisplaydata == 1)
 					{
 						// Clear display
 						for (i = 0; i < 0x80; i++)
-							chardisplayram[i] = 0x20;
-						chardisplaycp = 0;
-						chardisplayofs = 0;
-						chardisplaydir = 1; // based on HD44780U data sheet
+							lb->chardisplayram[i] = 0x20;
+						lb->chardisplaycp = 0;
+						lb->chardisplayofs = 0;
+						lb->chardisplaydir = 1; // based on HD44780U data sheet
 						// busy for 2 milliseconds
-						chardisplaybusy = 2*opt_clock_hz / 12000;
+						lb->chardisplaybusy = 2*ctx->opt_clock_hz / 12000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~1)) == 2)
+					if ((lb->chardisplaydata & (0xff & ~1)) == 2)
 					{
 						// return home
-						chardisplaycp = 0;
-						chardisplayofs = 0;
+						lb->chardisplaycp = 0;
+						lb->chardisplayofs = 0;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~3)) == 4)
+					if ((lb->chardisplaydata & (0xff & ~3)) == 4)
 					{
 						// entry mode set.
-						if (chardisplaydata & 1)
-							chardisplayshift = 1;
+						if (lb->chardisplaydata & 1)
+							lb->chardisplayshift = 1;
 						else
-							chardisplayshift = 0;
-						if (chardisplaydata & 2)
-							chardisplaydir = 1;
+							lb->chardisplayshift = 0;
+						if (lb->chardisplaydata & 2)
+							lb->chardisplaydir = 1;
 						else
-							chardisplaydir = -1;
+							lb->chardisplaydir = -1;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~7)) == 8)
+					if ((lb->chardisplaydata & (0xff & ~7)) == 8)
 					{
 						// display on/off setting.
-						chardisplaydcb = chardisplaydata & 0x7;
+						lb->chardisplaydcb = lb->chardisplaydata & 0x7;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~0xf)) == 0x10)
+					if ((lb->chardisplaydata & (0xff & ~0xf)) == 0x10)
 					{
 						// cursor or display shift.
-						if (chardisplaydata & 8)
+						if (lb->chardisplaydata & 8)
 						{
 							// move cursor
-							if (chardisplaydata & 4)
-								chardisplaycp++;
+							if (lb->chardisplaydata & 4)
+								lb->chardisplaycp++;
 							else
-								chardisplaycp--;
+								lb->chardisplaycp--;
 						}
 						else
 						{
 							// shift display
-							if (chardisplaydata & 4)
-								chardisplayofs++;
+							if (lb->chardisplaydata & 4)
+								lb->chardisplayofs++;
 							else
-								chardisplayofs--;
+								lb->chardisplayofs--;
 						}
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~0x1f)) == 0x20)
+					if ((lb->chardisplaydata & (0xff & ~0x1f)) == 0x20)
 					{
 						// function set (4/8 bit interface, font size). 
-						chardisplay4bmode = (chardisplaydata & 16) == 0;
-						chardisplaytick = 0;
+						lb->chardisplay4bmode = (lb->chardisplaydata & 16) == 0;
+						lb->chardisplaytick = 0;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~0x3f)) == 0x40)
+					if ((lb->chardisplaydata & (0xff & ~0x3f)) == 0x40)
 					{
 						// character gen address set. 
-						chardisplaychargen = 1;
+						lb->chardisplaychargen = 1;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 					else
-					if ((chardisplaydata & (0xff & ~0x7f)) == 0x80)
+					if ((lb->chardisplaydata & (0xff & ~0x7f)) == 0x80)
 					{
 						// cursor position address set
-						chardisplaycp = chardisplaydata & 0x7f;
-						chardisplaychargen = 0;
+						lb->chardisplaycp = lb->chardisplaydata & 0x7f;
+						lb->chardisplaychargen = 0;
 						// busy for 200 microseconds
-						chardisplaybusy = 200*opt_clock_hz / 12000000;
+						lb->chardisplaybusy = 200*ctx->opt_clock_hz / 12000000;
 					}
 				}
 			}
 		}
-		if (chardisplaybusy < 0)
-			chardisplaybusy = 0;
+		if (lb->chardisplaybusy < 0)
+			lb->chardisplaybusy = 0;
 	}
 
-    if (logicmode == 4)
+    // the output files already have what a replay would write again
+    if (lb->logicmode == 4 && !ctx->reverse.replaying)
     {
-        if (audioout == NULL)
+        if (lb->audioout == NULL)
         {
-            audioout = fopen("audioout.wav", "wb");
+            lb->audioout = fopen("audioout.wav", "wb");
             // RIFF signature
-            fputc('R', audioout);
-            fputc('I', audioout);
-            fputc('F', audioout);
-            fputc('F', audioout);
+            fputc('R', lb->audioout);
+            fputc('I', lb->audioout);
+            fputc('F', lb->audioout);
+            fputc('F', lb->audioout);
 
             // file length - 8 bytes
-            fputc(0, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
 
             // file type
-            fputc('W', audioout);
-            fputc('A', audioout);
-            fputc('V', audioout);
-            fputc('E', audioout);
+            fputc('W', lb->audioout);
+            fputc('A', lb->audioout);
+            fputc('V', lb->audioout);
+            fputc('E', lb->audioout);
 
             // format chunk
-            fputc('f', audioout);
-            fputc('m', audioout);
-            fputc('t', audioout);
-            fputc(' ', audioout);
+            fputc('f', lb->audioout);
+            fputc('m', lb->audioout);
+            fputc('t', lb->audioout);
+            fputc(' ', lb->audioout);
 
             // format size
-            fputc(16, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
+            fputc(16, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
 
             // PCM
-            fputc(1, audioout);
-            fputc(0, audioout);
+            fputc(1, lb->audioout);
+            fputc(0, lb->audioout);
 
             // mono
-            fputc(1, audioout);
-            fputc(0, audioout);
+            fputc(1, lb->audioout);
+            fputc(0, lb->audioout);
 
             // 44khz
-            fputc(0x44, audioout);
-            fputc(0xAC, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
+            fputc(0x44, lb->audioout);
+            fputc(0xAC, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
 
             // bytes / sec
-            fputc(0x44, audioout);
-            fputc(0xAC, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
+            fputc(0x44, lb->audioout);
+            fputc(0xAC, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
 
             // block align
-            fputc(1, audioout);
-            fputc(0, audioout);
+            fputc(1, lb->audioout);
+            fputc(0, lb->audioout);
 
             // bits per sample
-            fputc(8, audioout);
-            fputc(0, audioout);
+            fputc(8, lb->audioout);
+            fputc(0, lb->audioout);
 /*
             // extra format bytes
             fputc(0, audioout);
             fputc(0, audioout);
 */
             // data chunk
-            fputc('d', audioout);
-            fputc('a', audioout);
-            fputc('t', audioout);
-            fputc('a', audioout);
+            fputc('d', lb->audioout);
+            fputc('a', lb->audioout);
+            fputc('t', lb->audioout);
+            fputc('a', lb->audioout);
 
             // chunk size
-            fputc(0, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
-            fputc(0, audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
+            fputc(0, lb->audioout);
 
             // ..and we're ready to write data finally.
-            audiotick = 0;
-
-            atexit(closeaudio);
+            lb->audiotick = 0;
         }
-        audiotick++;
-        if (audiotick > opt_clock_hz / (44100 * 12))
+        lb->audiotick++;
+        if (lb->audiotick > ctx->opt_clock_hz / (44100 * 12))
         {
-            fputc(aCPU->mSFR[REG_P3] & 0x80, audioout);
-            audiotick -= opt_clock_hz / (44100 * 12);
+            fputc(aCPU->mSFR[REG_P3] & 0x80, lb->audioout);
+            lb->audiotick -= ctx->opt_clock_hz / (44100 * 12);
         }
     }
 
-    if (logicmode == 5)
+    if (lb->logicmode == 5 && !ctx->reverse.replaying)
     {
-        if (rawout == NULL)
+        if (lb->rawout == NULL)
         {
-            rawout = fopen("rawout.bin", "wb");
-            fputc('B', rawout);
-            fputc('I', rawout);
-            fputc('N', rawout);
-            atexit(closeraw);
+            lb->rawout = fopen("rawout.bin", "wb");
+            fputc('B', lb->rawout);
+            fputc('I', lb->rawout);
+            fputc('N', lb->rawout);
         }
-        fputc(aCPU->mSFR[REG_P5], rawout);
+        fputc(aCPU->mSFR[REG_P5], lb->rawout);
     }    
     
-    oldports[0] = aCPU->mSFR[REG_P0];
-    oldports[1] = aCPU->mSFR[REG_P1];
-    oldports[2] = aCPU->mSFR[REG_P2];
-    oldports[3] = aCPU->mSFR[REG_P3];
-    oldports[4] = aCPU->mSFR[REG_P4];
-    oldports[5] = aCPU->mSFR[REG_P5];
-    oldports[6] = aCPU->mSFR[REG_P6];    
+    lb->oldports[0] = aCPU->mSFR[REG_P0];
+    lb->oldports[1] = aCPU->mSFR[REG_P1];
+    lb->oldports[2] = aCPU->mSFR[REG_P2];
+    lb->oldports[3] = aCPU->mSFR[REG_P3];
+    lb->oldports[4] = aCPU->mSFR[REG_P4];
+    lb->oldports[5] = aCPU->mSFR[REG_P5];
+    lb->oldports[6] = aCPU->mSFR[REG_P6];    
+}
+
+// Catch up with ticks the core skipped over (see idle_skip()), the same
+// as that many logicboard_tick() calls. Nothing but the timers runs during
+// a skip, so the ports stay as they are and there are no edges to see;
+// only the display's busy time and the sound and raw outputs move on.
+void logicboard_skip(struct em8051 *aCPU, int aTicks)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
+
+    if (lb->logicmode == 3)
+    {
+        lb->chardisplaybusy -= aTicks;
+        if (lb->chardisplaybusy < 0)
+            lb->chardisplaybusy = 0;
+    }
+    else if (lb->logicmode > 3)
+    {
+        // a sample or byte per tick or so; no quicker way to write them
+        while (aTicks-- > 0)
+            logicboard_tick(aCPU);
+    }
+}
+
+static unsigned char *board_put(unsigned char *aDest, int aValue)
+{
+    aDest[0] = aValue & 0xff;
+    aDest[1] = (aValue >> 8) & 0xff;
+    aDest[2] = (aValue >> 16) & 0xff;
+    aDest[3] = (aValue >> 24) & 0xff;
+    return aDest + 4;
+}
+
+static const unsigned char *board_get(const unsigned char *aSrc, int *aValue)
+{
+    *aValue = aSrc[0] | (aSrc[1] << 8) | (aSrc[2] << 16) | ((unsigned int)aSrc[3] << 24);
+    return aSrc + 4;
+}
+
+// Write the logic board hardware into LOGICBOARD_STATE_SIZE bytes, for
+// snapshots; field by field and little-endian, so that the bytes don't
+// depend on the host. The output files aren't part of it.
+void logicboard_save_state(struct logicboard *aBoard, unsigned char *aBuffer)
+{
+    unsigned char *p = aBuffer;
+    int i;
+
+    p = board_put(p, aBoard->logicmode);
+    for (i = 0; i < 7; i++)
+        p = board_put(p, aBoard->oldports[i]);
+    memcpy(p, aBoard->shiftregisters, sizeof(aBoard->shiftregisters));
+    p += sizeof(aBoard->shiftregisters);
+    p = board_put(p, aBoard->audiotick);
+    memcpy(p, aBoard->chardisplayram, sizeof(aBoard->chardisplayram));
+    p += sizeof(aBoard->chardisplayram);
+    memcpy(p, aBoard->chardisplaycgram, sizeof(aBoard->chardisplaycgram));
+    p += sizeof(aBoard->chardisplaycgram);
+    p = board_put(p, aBoard->chardisplaycp);
+    p = board_put(p, aBoard->chardisplayofs);
+    p = board_put(p, aBoard->chardisplaydir);
+    p = board_put(p, aBoard->chardisplayshift);
+    p = board_put(p, aBoard->chardisplaydcb);
+    p = board_put(p, aBoard->chardisplaychargen);
+    p = board_put(p, aBoard->chardisplaydata);
+    p = board_put(p, aBoard->chardisplay4bmode);
+    p = board_put(p, aBoard->chardisplaytick);
+    board_put(p, aBoard->chardisplaybusy);
+}
+
+// Read back what logicboard_save_state() wrote; the output files stay as
+// they are.
+void logicboard_load_state(struct logicboard *aBoard, const unsigned char *aBuffer)
+{
+    const unsigned char *p = aBuffer;
+    int i;
+
+    p = board_get(p, &aBoard->logicmode);
+    for (i = 0; i < 7; i++)
+        p = board_get(p, &aBoard->oldports[i]);
+    memcpy(aBoard->shiftregisters, p, sizeof(aBoard->shiftregisters));
+    p += sizeof(aBoard->shiftregisters);
+    p = board_get(p, &aBoard->audiotick);
+    memcpy(aBoard->chardisplayram, p, sizeof(aBoard->chardisplayram));
+    p += sizeof(aBoard->chardisplayram);
+    memcpy(aBoard->chardisplaycgram, p, sizeof(aBoard->chardisplaycgram));
+    p += sizeof(aBoard->chardisplaycgram);
+    p = board_get(p, &aBoard->chardisplaycp);
+    p = board_get(p, &aBoard->chardisplayofs);
+    p = board_get(p, &aBoard->chardisplaydir);
+    p = board_get(p, &aBoard->chardisplayshift);
+    p = board_get(p, &aBoard->chardisplaydcb);
+    p = board_get(p, &aBoard->chardisplaychargen);
+    p = board_get(p, &aBoard->chardisplaydata);
+    p = board_get(p, &aBoard->chardisplay4bmode);
+    p = board_get(p, &aBoard->chardisplaytick);
+    board_get(p, &aBoard->chardisplaybusy);
 }
 
 static void logicboard_render_7segs(struct em8051 *aCPU)
@@ -474,30 +560,30 @@ static void logicboard_render_7segs(struct em8051 *aCPU)
     mvprintw(6, 40, " %c%c  %c%c  %c%c  %c%c", " -"[(input4 >> 3)&1], " ."[(input4 >> 7)&1], " -"[(input3 >> 3)&1], " ."[(input3 >> 7)&1], " -"[(input2 >> 3)&1], " ."[(input2 >> 7)&1], " -"[(input1 >> 3)&1], " ."[(input1 >> 7)&1]);
 }
 
-static void logicboard_render_registers()
+static void logicboard_render_registers(struct logicboard *lb)
 {
-    mvprintw(2, 40, "P0.0/1: %02Xh     P3.0/1: %02Xh", shiftregisters[0], shiftregisters[12]);
-    mvprintw(3, 40, "P0.2/3: %02Xh     P3.2/3: %02Xh", shiftregisters[1], shiftregisters[13]);
-    mvprintw(4, 40, "P0.4/5: %02Xh     P3.4/5: %02Xh", shiftregisters[2], shiftregisters[14]);
-    mvprintw(5, 40, "P0.6/7: %02Xh     P3.6/7: %02Xh", shiftregisters[3], shiftregisters[15]);    
-    mvprintw(6, 40, "P1.0/1: %02Xh     P4.0/1: %02Xh", shiftregisters[4], shiftregisters[16]);
-    mvprintw(7, 40, "P1.2/3: %02Xh     P4.2/3: %02Xh", shiftregisters[5], shiftregisters[17]);
-    mvprintw(8, 40, "P1.4/5: %02Xh     P4.4/5: %02Xh", shiftregisters[6], shiftregisters[18]);
-    mvprintw(9, 40, "P1.6/7: %02Xh     P4.6/7: %02Xh", shiftregisters[7], shiftregisters[19]);    
-    mvprintw(10, 40, "P2.0/1: %02Xh     P5.0/1: %02Xh", shiftregisters[8], shiftregisters[20]);
-    mvprintw(11, 40, "P2.2/3: %02Xh     P5.2/3: %02Xh", shiftregisters[9], shiftregisters[21]);
-    mvprintw(12, 40, "P2.4/5: %02Xh     P5.4/5: %02Xh", shiftregisters[10], shiftregisters[22]);
-    mvprintw(13, 40, "P2.6/7: %02Xh     P5.6/7: %02Xh", shiftregisters[11], shiftregisters[23]);   
+    mvprintw(2, 40, "P0.0/1: %02Xh     P3.0/1: %02Xh", lb->shiftregisters[0], lb->shiftregisters[12]);
+    mvprintw(3, 40, "P0.2/3: %02Xh     P3.2/3: %02Xh", lb->shiftregisters[1], lb->shiftregisters[13]);
+    mvprintw(4, 40, "P0.4/5: %02Xh     P3.4/5: %02Xh", lb->shiftregisters[2], lb->shiftregisters[14]);
+    mvprintw(5, 40, "P0.6/7: %02Xh     P3.6/7: %02Xh", lb->shiftregisters[3], lb->shiftregisters[15]);    
+    mvprintw(6, 40, "P1.0/1: %02Xh     P4.0/1: %02Xh", lb->shiftregisters[4], lb->shiftregisters[16]);
+    mvprintw(7, 40, "P1.2/3: %02Xh     P4.2/3: %02Xh", lb->shiftregisters[5], lb->shiftregisters[17]);
+    mvprintw(8, 40, "P1.4/5: %02Xh     P4.4/5: %02Xh", lb->shiftregisters[6], lb->shiftregisters[18]);
+    mvprintw(9, 40, "P1.6/7: %02Xh     P4.6/7: %02Xh", lb->shiftregisters[7], lb->shiftregisters[19]);    
+    mvprintw(10, 40, "P2.0/1: %02Xh     P5.0/1: %02Xh", lb->shiftregisters[8], lb->shiftregisters[20]);
+    mvprintw(11, 40, "P2.2/3: %02Xh     P5.2/3: %02Xh", lb->shiftregisters[9], lb->shiftregisters[21]);
+    mvprintw(12, 40, "P2.4/5: %02Xh     P5.4/5: %02Xh", lb->shiftregisters[10], lb->shiftregisters[22]);
+    mvprintw(13, 40, "P2.6/7: %02Xh     P5.6/7: %02Xh", lb->shiftregisters[11], lb->shiftregisters[23]);   
 }
 
-static void logicboard_render_chardisplay()
+static void logicboard_render_chardisplay(struct logicboard *lb)
 {
 	int i;	
 	mvprintw(2, 40, "[");
 	for (i = 0; i < 16; i++)
 	{
-		int c = chardisplayram[(i + chardisplayofs) & 0x7f];
-		if ((chardisplaydcb & 4) == 0) c = ' ';
+		int c = lb->chardisplayram[(i + lb->chardisplayofs) & 0x7f];
+		if ((lb->chardisplaydcb & 4) == 0) c = ' ';
 		if (c == 0) c = ' ';		
 		if (c < 32 || c > 126)
 			c = '?';
@@ -508,8 +594,8 @@ static void logicboard_render_chardisplay()
 	mvprintw(3, 40, "[");
 	for (i = 0; i < 16; i++)
 	{
-		int c = chardisplayram[(i + chardisplayofs + 0x40) & 0x7f];
-		if ((chardisplaydcb & 4) == 0) c = ' ';
+		int c = lb->chardisplayram[(i + lb->chardisplayofs + 0x40) & 0x7f];
+		if ((lb->chardisplaydcb & 4) == 0) c = ' ';
 		if (c == 0) c = ' ';
 		if (c < 32 || c > 126)
 			c = '?';
@@ -518,9 +604,9 @@ static void logicboard_render_chardisplay()
 	printw("]");
 
 	
-	mvprintw(4, 40, "Display %3s, Cursor %3s", (chardisplaydcb & 4)?"on":"off", (chardisplaydcb & 2)?"on":"off");
-	mvprintw(5, 40, "Blinking %3s, 4bit %3s", (chardisplaydcb & 1)?"on":"off", (chardisplay4bmode & 1)?"on":"off");
-	mvprintw(6, 40, "4b tick:%d Busy:%-7d", chardisplaytick, chardisplaybusy);
+	mvprintw(4, 40, "Display %3s, Cursor %3s", (lb->chardisplaydcb & 4)?"on":"off", (lb->chardisplaydcb & 2)?"on":"off");
+	mvprintw(5, 40, "Blinking %3s, 4bit %3s", (lb->chardisplaydcb & 1)?"on":"off", (lb->chardisplay4bmode & 1)?"on":"off");
+	mvprintw(6, 40, "4b tick:%d Busy:%-7d", lb->chardisplaytick, lb->chardisplaybusy);
 
 	mvprintw(10, 40, "P5.0-7 = DB0-7");
 	mvprintw(11, 40, "P4.7   = EN");
@@ -528,16 +614,16 @@ static void logicboard_render_chardisplay()
 	mvprintw(13, 40, "P4.5   = RW");
 }
 
-static void logicboard_entermode()
+static void logicboard_entermode(struct logicboard *lb)
 {
 	int i;
 	for (i = 0; i < 0x80; i++)
-		chardisplayram[i] = 0x20;
+		lb->chardisplayram[i] = 0x20;
 }
 
-static void logicboard_leavemode()
+static void logicboard_leavemode(struct logicboard *lb)
 {
-    switch (logicmode)
+    switch (lb->logicmode)
     {
     case 1:
         mvprintw(2, 40, "                           ");
@@ -574,38 +660,44 @@ static void logicboard_leavemode()
     }
 }
 
-void wipe_logicboard_view()
+void wipe_logicboard_view(struct em8051 *aCPU)
 {
-    logicboard_leavemode();
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
+    logicboard_leavemode(lb);
 }
 
 void build_logicboard_view(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
     erase();
-    logicboard_entermode();
+    logicboard_entermode(lb);
 }
 
 void logicboard_editor_keys(struct em8051 *aCPU, int ch)
 {
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
     int xorvalue = -1;
     switch (ch)
     {
     case KEY_RIGHT:
         if (position == 6)
         {
-            logicboard_leavemode();
-            logicmode++;
-            if (logicmode > 5) logicmode = 5;
-            logicboard_entermode();
+            logicboard_leavemode(lb);
+            lb->logicmode++;
+            if (lb->logicmode > 5) lb->logicmode = 5;
+            logicboard_entermode(lb);
         }
         break;
     case KEY_LEFT:
         if (position == 6)
         {
-            logicboard_leavemode();
-            logicmode--;
-            if (logicmode < 0) logicmode = 0;
-            logicboard_entermode();
+            logicboard_leavemode(lb);
+            lb->logicmode--;
+            if (lb->logicmode < 0) lb->logicmode = 0;
+            logicboard_entermode(lb);
         }
         break;
     case KEY_DOWN:
@@ -646,22 +738,22 @@ void logicboard_editor_keys(struct em8051 *aCPU, int ch)
         switch (position)
         {
         case 0:
-            p0out ^= 1 << xorvalue;
+            ctx->p0out ^= 1 << xorvalue;
             break;
         case 1:
-            p1out ^= 1 << xorvalue;
+            ctx->p1out ^= 1 << xorvalue;
             break;
         case 2:
-            p2out ^= 1 << xorvalue;
+            ctx->p2out ^= 1 << xorvalue;
             break;
         case 3:
-            p3out ^= 1 << xorvalue;
+            ctx->p3out ^= 1 << xorvalue;
             break;
         case 4:
-            p4out ^= 1 << xorvalue;
+            ctx->p4out ^= 1 << xorvalue;
             break;
         case 5:
-            p5out ^= 1 << xorvalue;
+            ctx->p5out ^= 1 << xorvalue;
             break;        
         }
     }
@@ -669,6 +761,8 @@ void logicboard_editor_keys(struct em8051 *aCPU, int ch)
 
 void logicboard_update(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
+    struct logicboard *lb = &ctx->logicboard;
     char ledstate[]="_*";
     char swstate[]="01";
     int data;
@@ -686,7 +780,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p0out;
+    data = ctx->p0out;
     mvprintw( 5, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -708,7 +802,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p1out;
+    data = ctx->p1out;
     mvprintw( 8, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -730,7 +824,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p2out;
+    data = ctx->p2out;
     mvprintw(11, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -752,7 +846,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p3out;
+    data = ctx->p3out;
     mvprintw(14, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -774,7 +868,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p4out;
+    data = ctx->p4out;
     mvprintw(17, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -796,7 +890,7 @@ void logicboard_update(struct em8051 *aCPU)
         ledstate[(data>>1)&1],
         ledstate[(data>>0)&1]);
 
-    data = p5out;
+    data = ctx->p5out;
     mvprintw(20, 2, "   %c %c %c %c %c %c %c %c",
         swstate[(data>>7)&1],
         swstate[(data>>6)&1],
@@ -811,7 +905,7 @@ void logicboard_update(struct em8051 *aCPU)
     mvprintw(23, 2, "  ");
 
     attron(A_REVERSE);
-    switch (logicmode)
+    switch (lb->logicmode)
     {
     case 0:
         mvprintw(23, 4, "< No additional hw     >");
@@ -836,16 +930,16 @@ void logicboard_update(struct em8051 *aCPU)
 
     mvprintw(position*3+5,2,"->");
 
-    switch (logicmode)
+    switch (lb->logicmode)
     {
     case 1:
         logicboard_render_7segs(aCPU);
         break;
     case 2:
-        logicboard_render_registers();
+        logicboard_render_registers(lb);
         break;
 	case 3:
-		logicboard_render_chardisplay();
+		logicboard_render_chardisplay(lb);
 		break;
     }
 
@@ -41,9 +41,6 @@
     can happen is that the disassembly looks wrong.
  */
 
-// Last clock we updated the view
-static unsigned int lastclock = 0;
-
 // Memory editor mode
 static int memmode = 0;
 
@@ -59,9 +56,6 @@ static int cursorpos = 0;
 // memory window offset
 static int memoffset = 0;
 
-// pointer to the memory area being viewed
-static unsigned char *memarea = NULL;
-
 // code box (PC, opcode, assembly)
 WINDOW *codebox = NULL, *codeoutput = NULL;
 
@@ -122,6 +116,7 @@ void wipe_main_view()
 
 void build_main_view(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     erase();
 
     oldcols = COLS;
@@ -194,9 +189,9 @@ void build_main_view(struct em8051 *aCPU)
     wrefresh(ioregoutput);
     wrefresh(spregoutput);
 
-    lastclock = icount - 8;
+    ctx->lastclock = ctx->icount - 8;
 
-    memarea = aCPU->mLowerData;
+    ctx->memarea = aCPU->mLowerData;
 
 }
 
@@ -276,6 +271,7 @@ void setregoutput(struct em8051 *aCPU, int pos, int val)
 
 void mainview_editor_keys(struct em8051 *aCPU, int ch)
 {
+    struct emu_context *ctx = aCPU->mContext;
     int insert_value = -1;
     int maxmem;
     switch(ch)
@@ -301,19 +297,19 @@ void mainview_editor_keys(struct em8051 *aCPU, int ch)
         switch (memmode)
         {
         case 0:
-            memarea = aCPU->mLowerData;
+            ctx->memarea = aCPU->mLowerData;
             break;
         case 1:
-            memarea = aCPU->mUpperData;
+            ctx->memarea = aCPU->mUpperData;
             break;
         case 2:
-            memarea = aCPU->mSFR;
+            ctx->memarea = aCPU->mSFR;
             break;
         case 3:
-            memarea = aCPU->mExtData;
+            ctx->memarea = aCPU->mExtData;
             break;
         case 4:
-            memarea = aCPU->mCodeMem;
+            ctx->memarea = aCPU->mCodeMem;
             break;
         }
         mvwaddstr(rambox, 0, 4, memtypes[memmode]);
@@ -405,9 +401,11 @@ void mainview_editor_keys(struct em8051 *aCPU, int ch)
         if (focus == 0)
         {
             if (memcursorpos & 1)
-                memarea[memoffset + (memcursorpos / 2)] = (memarea[memoffset + (memcursorpos / 2)] & 0xf0) | insert_value;
+                ctx->memarea[memoffset + (memcursorpos / 2)] = (ctx->memarea[memoffset + (memcursorpos / 2)] & 0xf0) | insert_value;
             else
-                memarea[memoffset + (memcursorpos / 2)] = (memarea[memoffset + (memcursorpos / 2)] & 0x0f) | (insert_value << 4);
+                ctx->memarea[memoffset + (memcursorpos / 2)] = (ctx->memarea[memoffset + (memcursorpos / 2)] & 0x0f) | (insert_value << 4);
+            if (ctx->memarea == aCPU->mCodeMem)
+                predecode_invalidate(aCPU, memoffset + (memcursorpos / 2), 1);
             memcursorpos++;
         }
         if (focus == 1)
@@ -428,6 +426,7 @@ void mainview_editor_keys(struct em8051 *aCPU, int ch)
             if (cursorpos > 23)
                 cursorpos = 23;
         }
+        reverse_edited(aCPU);
     }
 
     while (memcursorpos < 0)
@@ -492,35 +491,33 @@ void refresh_regoutput(struct em8051 *aCPU, int cursor)
 
 void mainview_update(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     int bytevalue;
     int i;
 
     int opcode_bytes;
     int stringpos;
     int rx;
-    unsigned int hline;
+    int lines;
+    int line;
+    int pc[HISTORY_LINES];
+    unsigned char image[HISTORY_LINES][128 + 64];
 
-    if ((speed != 0 || !runmode) && lastclock != icount)
+    if ((ctx->speed != 0 || !ctx->runmode) && ctx->lastclock != ctx->icount)
     {
         // make sure we only display HISTORY_LINES worth of data
-        if (icount - lastclock > HISTORY_LINES)
-            lastclock = icount - HISTORY_LINES;
+        if (ctx->icount - ctx->lastclock > HISTORY_LINES)
+            ctx->lastclock = ctx->icount - HISTORY_LINES;
 
-        // + HISTORY_LINES to force positive result
-        hline = historyline - (icount - lastclock) + HISTORY_LINES;
+        lines = history_read(aCPU, ctx->icount - ctx->lastclock, pc, image);
 
-        while (lastclock != icount)
+        for (line = 0; line < lines; line++)
         {
             char assembly[128];
             char temp[256];
-            int old_pc;
-            int hoffs;
-            
-            hline = (hline + 1) % HISTORY_LINES;
+            int old_pc = pc[line];
+            unsigned char *h = image[line];
 
-            hoffs = (hline * (128 + 64 + sizeof(int)));
-
-            memcpy(&old_pc, history + hoffs + 128 + 64, sizeof(int));
             opcode_bytes = decode(aCPU, old_pc, assembly);
             stringpos = 0;
             stringpos += sprintf(temp + stringpos,"\n%04X  ", old_pc & 0xffff);
@@ -535,82 +532,81 @@ void mainview_update(struct em8051 *aCPU)
 
             wprintw(codeoutput, "%s", temp);
 
-            rx = 8 * ((history[hoffs + REG_PSW] & (PSW_RS0_MASK|PSW_RS1_MASK))>>PSW_RS0);
+            rx = 8 * ((h[REG_PSW] & (PSW_RS0_MASK|PSW_RS1_MASK))>>PSW_RS0);
             
             sprintf(temp, "\n%02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %04X",
-                history[hoffs + REG_ACC],
-                history[hoffs + 128 + 0 + rx],
-                history[hoffs + 128 + 1 + rx],
-                history[hoffs + 128 + 2 + rx],
-                history[hoffs + 128 + 3 + rx],
-                history[hoffs + 128 + 4 + rx],
-                history[hoffs + 128 + 5 + rx],
-                history[hoffs + 128 + 6 + rx],
-                history[hoffs + 128 + 7 + rx],
-                history[hoffs + REG_B],
-                (history[hoffs + REG_DPH]<<8)|history[hoffs + REG_DPL]);
+                h[REG_ACC],
+                h[128 + 0 + rx],
+                h[128 + 1 + rx],
+                h[128 + 2 + rx],
+                h[128 + 3 + rx],
+                h[128 + 4 + rx],
+                h[128 + 5 + rx],
+                h[128 + 6 + rx],
+                h[128 + 7 + rx],
+                h[REG_B],
+                (h[REG_DPH]<<8)|h[REG_DPL]);
             if (focus == 1)
                 refresh_regoutput(aCPU, 0);
             wprintw(regoutput,"%s",temp);
 
             sprintf(temp, "\n%d %d %d %d %d %d %d %d",
-                (history[hoffs + REG_PSW] >> 7) & 1,
-                (history[hoffs + REG_PSW] >> 6) & 1,
-                (history[hoffs + REG_PSW] >> 5) & 1,
-                (history[hoffs + REG_PSW] >> 4) & 1,
-                (history[hoffs + REG_PSW] >> 3) & 1,
-                (history[hoffs + REG_PSW] >> 2) & 1,
-                (history[hoffs + REG_PSW] >> 1) & 1,
-                (history[hoffs + REG_PSW] >> 0) & 1);
+                (h[REG_PSW] >> 7) & 1,
+                (h[REG_PSW] >> 6) & 1,
+                (h[REG_PSW] >> 5) & 1,
+                (h[REG_PSW] >> 4) & 1,
+                (h[REG_PSW] >> 3) & 1,
+                (h[REG_PSW] >> 2) & 1,
+                (h[REG_PSW] >> 1) & 1,
+                (h[REG_PSW] >> 0) & 1);
             wprintw(pswoutput,"%s",temp);
 
             sprintf(temp, "\n%02X %02X %02X %02X %02X %02X %02X",
-                history[hoffs + REG_SP],
-                history[hoffs + REG_P0],
-                history[hoffs + REG_P1],
-                history[hoffs + REG_P2],
-                history[hoffs + REG_P3],
-                history[hoffs + REG_P4],
-                history[hoffs + REG_P5]);
+                h[REG_SP],
+                h[REG_P0],
+                h[REG_P1],
+                h[REG_P2],
+                h[REG_P3],
+                h[REG_P4],
+                h[REG_P5]);
             wprintw(ioregoutput,"%s",temp);
 
             sprintf(temp, "\n%02X  %02X  %02X %02X %02X %02X %02X  %02X  %02X %02X %02X %02X",
-                history[hoffs + REG_TMOD],
-                history[hoffs + REG_TCON],
-                history[hoffs + REG_TH0],
-                history[hoffs + REG_TL0],
-                history[hoffs + REG_TH1],
-                history[hoffs + REG_TL1],
-                history[hoffs + REG_SCON],
-                history[hoffs + REG_PCON],
-                history[hoffs + REG_IP0],
-                history[hoffs + REG_IEN0],
-                history[hoffs + REG_IP1],
-                history[hoffs + REG_IEN1]);                
+                h[REG_TMOD],
+                h[REG_TCON],
+                h[REG_TH0],
+                h[REG_TL0],
+                h[REG_TH1],
+                h[REG_TL1],
+                h[REG_SCON],
+                h[REG_PCON],
+                h[REG_IP0],
+                h[REG_IEN0],
+                h[REG_IP1],
+                h[REG_IEN1]);                
             wprintw(spregoutput, "%s", temp);
-
-            lastclock++;
         }
+        ctx->lastclock = ctx->icount;
     }
 
 
     werase(miscview);
-    wprintw(miscview, "\nCycles :% 10u\n", clocks);
-    wprintw(miscview, "Time   :% 14.3fms\n", 1000.0f * clocks * (1.0f/opt_clock_hz));
-    wprintw(miscview, "HW     : Super8051 @%0.1fMHz", opt_clock_hz / (1000*1000.0f));
+    wprintw(miscview, "\nCycles :% 10u\n", ctx->clocks);
+    wprintw(miscview, "Time   :% 14.3fms\n", 1000.0f * ctx->clocks * (1.0f/ctx->opt_clock_hz));
+    wprintw(miscview, "HW     : Super8051 @%0.1fMHz", ctx->opt_clock_hz / (1000*1000.0f));
 
     werase(ramview);
     for (i = 0; i < 8; i++)
     {
         wprintw(ramview,"%04X %02X %02X %02X %02X %02X %02X %02X %02X\n", 
             i*8+memoffset, 
-            memarea[i*8+0+memoffset], memarea[i*8+1+memoffset], memarea[i*8+2+memoffset], memarea[i*8+3+memoffset],
-            memarea[i*8+4+memoffset], memarea[i*8+5+memoffset], memarea[i*8+6+memoffset], memarea[i*8+7+memoffset]);
+            ctx->memarea[i*8+0+memoffset], ctx->memarea[i*8+1+memoffset], ctx->memarea[i*8+2+memoffset], ctx->memarea[i*8+3+memoffset],
+            ctx->memarea[i*8+4+memoffset], ctx->memarea[i*8+5+memoffset], ctx->memarea[i*8+6+memoffset], ctx->memarea[i*8+7+memoffset]);
     }
 
     if (focus == 0)
     {
-        bytevalue = memarea[memcursorpos / 2 + memoffset];
+        bytevalue = ctx->memarea[memcursorpos / 2 + memoffset];
         wattron(ramview, A_REVERSE);
         wmove(ramview, memcursorpos / 16, 5 + ((memcursorpos % 16) / 2) * 3 + (memcursorpos & 1));
         wprintw(ramview,"%X", (bytevalue >> (4 * (!(memcursorpos & 1)))) & 0xf);
@@ -663,14 +659,14 @@ void mainview_update(struct em8051 *aCPU)
 			wprintw(stackview," %02X\n", aCPU->mUpperData[offset - 0x80]);
     }
 
-    if (speed != 0 || runmode == 0)
+    if (ctx->speed != 0 || ctx->runmode == 0)
     {
         wrefresh(ramview);
         wrefresh(stackview);
     }
     werase(stackview);
     wrefresh(miscview);
-    if (speed != 0 || runmode == 0)
+    if (ctx->speed != 0 || ctx->runmode == 0)
     {
         wrefresh(codeoutput);
         wrefresh(regoutput);
@@ -204,6 +204,9 @@ void memeditor_editor_keys(struct em8051 *aCPU, int ch)
             eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] = (eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] & 0xf0) | insert_value;
         else
             eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] = (eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] & 0x0f) | (insert_value << 4);
+        if (eds[focus].memarea == aCPU->mCodeMem)
+            predecode_invalidate(aCPU, eds[focus].memoffset + (eds[focus].cursorpos / 2), 1);
+        reverse_edited(aCPU);
         eds[focus].cursorpos++;
     }
 
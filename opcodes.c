@@ -109,28 +109,19 @@ static int pop_from_stack(struct em8051 *aCPU)
 }
 
 
+// The flags are only worked out by psw_sync(), when something uses them
 static void add_solve_flags(struct em8051 * aCPU, int value1, int value2, int acc)
 {
-    /* Carry: overflow from 7th bit to 8th bit */
-    int carry = ((value1 & 255) + (value2 & 255) + acc) >> 8;
-    
-    /* Auxiliary carry: overflow from 3th bit to 4th bit */
-    int auxcarry = ((value1 & 7) + (value2 & 7) + acc) >> 3;
-    
-    /* Overflow: overflow from 6th or 7th bit, but not both */
-    int overflow = (((value1 & 127) + (value2 & 127) + acc) >> 7)^carry;
-    
-    PSW = (PSW & ~(PSW_CY_MASK | PSW_AC_MASK | PSW_OV_MASK)) |
-          (carry << PSW_CY) | (auxcarry << PSW_AC) | (overflow << PSW_OV);
+    aCPU->mFlagsOp = acc ? FLAGS_ADDC : FLAGS_ADD;
+    aCPU->mFlagsValue1 = value1;
+    aCPU->mFlagsValue2 = value2;
 }
 
-static void sub_solve_flags(struct em8051 * aCPU, int value1, int value2)
+static void sub_solve_flags(struct em8051 * aCPU, int value1, int value2, int carry)
 {
-    int carry = (((value1 & 255) - (value2 & 255)) >> 8) & 1;
-    int auxcarry = (((value1 & 7) - (value2 & 7)) >> 3) & 1;
-    int overflow = ((((value1 & 127) - (value2 & 127)) >> 7) & 1)^carry;
-    PSW = (PSW & ~(PSW_CY_MASK|PSW_AC_MASK|PSW_OV_MASK)) |
-                          (carry << PSW_CY) | (auxcarry << PSW_AC) | (overflow << PSW_OV);
+    aCPU->mFlagsOp = carry ? FLAGS_SUBB : FLAGS_SUB;
+    aCPU->mFlagsValue1 = value1;
+    aCPU->mFlagsValue2 = value2;
 }
 
 
@@ -926,7 +917,7 @@ static int anl_c_bitaddr(struct em8051 *aCPU)
         PSW = (PSW & ~PSW_CY_MASK) | (PSW_CY_MASK * value);
     }
     PC += 2;
-    return 0;
+    return 1;
 }
 
 static int movc_a_indir_a_pc(struct em8051 *aCPU)
@@ -934,7 +925,7 @@ static int movc_a_indir_a_pc(struct em8051 *aCPU)
     int address = PC + 1 + ACC;
     ACC = aCPU->mCodeMem[address & (aCPU->mCodeMemSize - 1)];
     PC++;
-    return 0;
+    return 1;
 }
 
 static int div_ab(struct em8051 *aCPU)
@@ -1062,7 +1053,7 @@ static int mov_bitaddr_c(struct em8051 *aCPU)
 
 static int movc_a_indir_a_dptr(struct em8051 *aCPU)
 {
-    int address = (aCPU->mSFR[REG_DPH] << 8) | (aCPU->mSFR[REG_DPL] << 0) + ACC;
+    int address = ((aCPU->mSFR[REG_DPH] << 8) | aCPU->mSFR[REG_DPL]) + ACC;
     ACC = aCPU->mCodeMem[address & (aCPU->mCodeMemSize - 1)];
     PC++;
     return 1;
@@ -1071,7 +1062,7 @@ static int movc_a_indir_a_dptr(struct em8051 *aCPU)
 static int subb_a_imm(struct em8051 *aCPU)
 {
     int carry = CARRY;
-    sub_solve_flags(aCPU, ACC, OPERAND1 + carry);
+    sub_solve_flags(aCPU, ACC, OPERAND1, carry);
     ACC -= OPERAND1 + carry;
     PC += 2;
     return 0;
@@ -1080,9 +1071,9 @@ static int subb_a_imm(struct em8051 *aCPU)
 static int subb_a_mem(struct em8051 *aCPU) 
 {
     int carry = CARRY;
-    int value = read_mem(aCPU, OPERAND1) + carry;
-    sub_solve_flags(aCPU, ACC, value);
-    ACC -= value;
+    int value = read_mem(aCPU, OPERAND1);
+    sub_solve_flags(aCPU, ACC, value, carry);
+    ACC -= value + carry;
 
     PC += 2;
     return 0;
@@ -1099,12 +1090,12 @@ static int subb_a_indir_rx(struct em8051 *aCPU)
             value = aCPU->mUpperData[address - 0x80];
         }
 
-        sub_solve_flags(aCPU, ACC, value);
-        ACC -= value;
+        sub_solve_flags(aCPU, ACC, value, carry);
+        ACC -= value + carry;
     }
     else
     {
-        sub_solve_flags(aCPU, ACC, aCPU->mLowerData[address] + carry);
+        sub_solve_flags(aCPU, ACC, aCPU->mLowerData[address], carry);
         ACC -= aCPU->mLowerData[address] + carry;
     }
     PC++;
@@ -1142,7 +1133,7 @@ static int orl_c_compl_bitaddr(struct em8051 *aCPU)
         PSW = (PSW & ~PSW_CY_MASK) | (PSW_CY_MASK * value);
     }
     PC += 2;
-    return 0;
+    return 1;
 }
 
 static int mov_c_bitaddr(struct em8051 *aCPU) 
@@ -1252,7 +1243,7 @@ static int anl_c_compl_bitaddr(struct em8051 *aCPU)
         PSW = (PSW & ~PSW_CY_MASK) | (PSW_CY_MASK * value);
     }
     PC += 2;
-    return 0;
+    return 1;
 }
 
 
@@ -1531,31 +1522,18 @@ static int setb_c(struct em8051 *aCPU)
 
 static int da_a(struct em8051 *aCPU)
 {
-    // data sheets for this operation are a bit unclear..
-    // - should AC (or C) ever be cleared?
-    // - should this be done in two steps?
-
+    // as the instruction set manual has it: each adjustment may set the
+    // carry flag, but neither clears it
     int result = ACC;
     if ((result & 0xf) > 9 || (PSW & PSW_AC_MASK))
         result += 0x6;
-    if ((result & 0xff0) > 0x90 || (PSW & PSW_CY_MASK))
-        result += 0x60;
-    if (result > 0x99)
+    if (result > 0xff)
         PSW |= PSW_CY_MASK;
-    ACC = result;
-
- /*
-    // this is basically what intel datasheet says the op should do..
-    int adder = 0;
-    if (ACC & 0xf > 9 || PSW & PSW_AC_MASK)
-        adder = 6;
-    if (ACC & 0xf0 > 0x90 || PSW & PSW_CY_MASK)
-        adder |= 0x60;
-    adder += aCPU[REG_ACC];
-    if (adder > 0x99)
+    if ((result & 0xf0) > 0x90 || (PSW & PSW_CY_MASK))
+        result = (result & 0xff) + 0x60;
+    if (result > 0xff)
         PSW |= PSW_CY_MASK;
-    aCPU[REG_ACC] = adder;
-*/
+    ACC = result;
     PC++;
     return 0;
 }
@@ -1603,7 +1581,7 @@ static int xchd_a_indir_rx(struct em8051 *aCPU)
     else
     {
         int value = aCPU->mLowerData[address];
-        aCPU->mLowerData[address] = (aCPU->mLowerData[address] & 0x0f) | (ACC & 0x0f);
+        aCPU->mLowerData[address] = (aCPU->mLowerData[address] & 0xf0) | (ACC & 0x0f);
         ACC = (ACC & 0xf0) | (value & 0x0f);
     }
     PC++;
@@ -1698,7 +1676,14 @@ static int movx_indir_dptr_a(struct em8051 *aCPU)
     else
     {
         if (aCPU->mExtData)
+        {
             aCPU->mExtData[dptr & (aCPU->mExtDataSize - 1)] = ACC;
+            if (aCPU->mDirty)
+                aCPU->mDirty[(aCPU->mCodeMemSize + (dptr & (aCPU->mExtDataSize - 1))) >> EM8051_PAGE_SHIFT] = 1;
+        }
+        // self-modifying code, if code and external memory are the same
+        if (aCPU->mExtData == aCPU->mCodeMem)
+            predecode_invalidate(aCPU, dptr, 1);
     }
 
     PC++;
@@ -1716,7 +1701,14 @@ static int movx_indir_rx_a(struct em8051 *aCPU)
     else
     {
         if (aCPU->mExtData)
+        {
             aCPU->mExtData[address & (aCPU->mExtDataSize - 1)] = ACC;
+            if (aCPU->mDirty)
+                aCPU->mDirty[(aCPU->mCodeMemSize + (address & (aCPU->mExtDataSize - 1))) >> EM8051_PAGE_SHIFT] = 1;
+        }
+        // self-modifying code, if code and external memory are the same
+        if (aCPU->mExtData == aCPU->mCodeMem)
+            predecode_invalidate(aCPU, address, 1);
     }
 
     PC++;
@@ -1863,7 +1855,7 @@ static int subb_a_rx(struct em8051 *aCPU)
 {
     int rx = RX_ADDRESS;
     int carry = CARRY;
-    sub_solve_flags(aCPU, ACC, aCPU->mLowerData[rx] + carry);
+    sub_solve_flags(aCPU, ACC, aCPU->mLowerData[rx], carry);
     ACC -= aCPU->mLowerData[rx] + carry;
     PC++;
     return 0;
@@ -2408,3 +2400,556 @@ int do_op(struct em8051 *aCPU)
     return 0;
 }
 
+
+// Which operands of each opcode hold a direct or bit address: 1 for
+// OPERAND1, 2 for OPERAND2 (only "mov direct, direct" has both).
+// Bit addresses 0x88-0x8f are in TCON, so both kinds of address can be
+// checked against the timer registers the same way.
+static const unsigned char direct_operands[256] = 
+{
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 10
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 30
+    0, 0, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 40
+    0, 0, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 50
+    0, 0, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60
+    0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70
+    0, 0, 1, 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80
+    0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 90
+    1, 0, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A0
+    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // B0
+    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // C0
+    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // D0
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // E0
+    0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0  // F0
+};
+
+
+// Operation lengths in bytes
+static const unsigned char op_lengths[256] = 
+{
+    1, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 00
+    3, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 10
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 20
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 30
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 40
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 50
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 60
+    2, 2, 2, 1, 2, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 70
+    2, 2, 2, 1, 1, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 80
+    3, 2, 2, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 90
+    2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // A0
+    2, 2, 2, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // B0
+    2, 2, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // C0
+    2, 2, 2, 1, 1, 3, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, // D0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // E0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1  // F0
+};
+
+// Values the operation handlers return (ticks to delay after the operation)
+static const unsigned char op_ticks[256] = 
+{
+    0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00
+    1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 10
+    1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20
+    1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 30
+    1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 40
+    1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 50
+    1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60
+    1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70
+    1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80
+    1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 90
+    1, 1, 0, 1, 3, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A0
+    1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // B0
+    1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // C0
+    1, 1, 0, 0, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, // D0
+    1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // E0
+    1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0  // F0
+};
+
+int op_idle_loop(struct em8051 *aCPU)
+{
+    int address;
+    int value;
+
+    switch (OPCODE)
+    {
+    case 0x80: // sjmp $
+        if (OPERAND1 != 0xfe)
+            return 0;
+        break;
+    case 0x20: // jb bit, $
+    case 0x30: // jnb bit, $
+        if (OPERAND2 != 0xfd)
+            return 0;
+        // bits in RAM, or the TCON flags unless they're read through
+        // the front-end
+        address = OPERAND1;
+        if (address > 0x7f)
+        {
+            if ((address & 0xf8) != 0x88 || aCPU->sfrread)
+                return 0;
+            value = aCPU->mSFR[REG_TCON];
+        }
+        else
+        {
+            value = aCPU->mLowerData[0x20 + (address >> 3)];
+        }
+        // it only loops while the jump is taken
+        if (((value >> (address & 7)) & 1) != (OPCODE == 0x20))
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    return op_ticks[OPCODE] ? op_ticks[OPCODE] : 1;
+}
+
+// DECODED_JUMP, DECODED_CALLBACK and DECODED_PSW flags of each opcode:
+// jumps, calls and returns, operations that may call the front-end (calls
+// and returns through stack exceptions, push, pop, movx, the illegal
+// opcode), and operations that use the carry flags other than ADD, ADDC
+// and SUBB setting them (ADDC and SUBB read the carry)
+static const unsigned char op_control[256] = 
+{
+     0,  4,  4,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 00
+     4, 12, 12, 16,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 10
+     4,  4, 12,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 20
+     4, 12, 12, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, // 30
+    20,  4,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 40
+    20, 12,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 50
+     4,  4,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 60
+     4, 12, 16,  4,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 70
+     4,  4, 16,  0, 16,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 80
+     0, 12, 16,  0, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, // 90
+    16,  4, 16,  0, 16,  8,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // A0
+    16, 12,  0, 16, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, // B0
+     8,  4,  0, 16,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // C0
+     8, 12,  0, 16, 16,  4,  0,  0,  4,  4,  4,  4,  4,  4,  4,  4, // D0
+     8,  4,  8,  8,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // E0
+     8, 12,  8,  8,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0  // F0
+};
+
+int op_length(int aOpcode)
+{
+    return op_lengths[aOpcode & 0xff];
+}
+
+int op_flags(struct em8051 *aCPU, int aPosition)
+{
+    int mask = aCPU->mCodeMemSize - 1;
+    int opcode = aCPU->mCodeMem[aPosition & mask];
+    int flags = op_control[opcode];
+    int address;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (direct_operands[opcode] & (1 << i))
+        {
+            address = aCPU->mCodeMem[(aPosition + 1 + i) & mask];
+            if (address > 0x7f)
+                flags |= DECODED_SFR;
+            if ((address & 0xf8) == 0x88)
+                flags |= DECODED_TIMER;
+            if ((address & 0xf8) == 0xa8 || address == 0xb9 || address == 0x87)
+                flags |= DECODED_INTERRUPT;
+        }
+    }
+    return flags;
+}
+
+// the byte holding the bit at bit address aBit
+static int bit_byte(int aBit, int *aSpace)
+{
+    if (aBit > 0x7f)
+    {
+        *aSpace = TRACE_SFR;
+        return aBit & 0xf8;
+    }
+    *aSpace = TRACE_IDATA;
+    return 0x20 + (aBit >> 3);
+}
+
+static int direct_space(int aAddress)
+{
+    return (aAddress > 0x7f) ? TRACE_SFR : TRACE_IDATA;
+}
+
+int op_writes(struct em8051 *aCPU, int *aSpace, int *aAddress)
+{
+    int opcode = OPCODE;
+
+    switch (opcode)
+    {
+    case 0x05: case 0x15: // inc, dec direct
+    case 0x42: case 0x43: case 0x52: case 0x53: case 0x62: case 0x63: // orl, anl, xrl direct
+    case 0x75: case 0x86: case 0x87: // mov direct, #data / @ri
+    case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8c: case 0x8d: case 0x8e: case 0x8f: // mov direct, rx
+    case 0xc5: case 0xd5: case 0xf5: // xch a, direct; djnz direct; mov direct, a
+    case 0xd0: // pop direct
+        aAddress[0] = OPERAND1;
+        aSpace[0] = direct_space(aAddress[0]);
+        return 1;
+    case 0x85: // mov direct, direct; the destination is the second one
+        aAddress[0] = OPERAND2;
+        aSpace[0] = direct_space(aAddress[0]);
+        return 1;
+    case 0x10: case 0x92: case 0xb2: case 0xc2: case 0xd2: // jbc, mov, cpl, clr, setb bit
+        aAddress[0] = bit_byte(OPERAND1, &aSpace[0]);
+        return 1;
+    case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x0e: case 0x0f: // inc rx
+    case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x1e: case 0x1f: // dec rx
+    case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f: // mov rx, #data
+    case 0xa8: case 0xa9: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf: // mov rx, direct
+    case 0xc8: case 0xc9: case 0xca: case 0xcb: case 0xcc: case 0xcd: case 0xce: case 0xcf: // xch a, rx
+    case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde: case 0xdf: // djnz rx
+    case 0xf8: case 0xf9: case 0xfa: case 0xfb: case 0xfc: case 0xfd: case 0xfe: case 0xff: // mov rx, a
+        aAddress[0] = RX_ADDRESS;
+        aSpace[0] = TRACE_IDATA;
+        return 1;
+    case 0x06: case 0x07: case 0x16: case 0x17: // inc, dec @ri
+    case 0x76: case 0x77: case 0xa6: case 0xa7: // mov @ri, #data / direct
+    case 0xc6: case 0xc7: case 0xd6: case 0xd7: // xch, xchd a, @ri
+    case 0xf6: case 0xf7: // mov @ri, a
+        aAddress[0] = INDIR_RX_ADDRESS;
+        aSpace[0] = TRACE_IDATA;
+        return 1;
+    case 0xc0: // push direct
+        aAddress[0] = (aCPU->mSFR[REG_SP] + 1) & 0xff;
+        aSpace[0] = TRACE_IDATA;
+        return 1;
+    case 0x12: // lcall
+    case 0x11: case 0x31: case 0x51: case 0x71: case 0x91: case 0xb1: case 0xd1: case 0xf1: // acall
+        aAddress[0] = (aCPU->mSFR[REG_SP] + 1) & 0xff;
+        aAddress[1] = (aCPU->mSFR[REG_SP] + 2) & 0xff;
+        aSpace[0] = TRACE_IDATA;
+        aSpace[1] = TRACE_IDATA;
+        return 2;
+    case 0xf0: // movx @dptr, a
+        aAddress[0] = (aCPU->mSFR[REG_DPH] << 8) | aCPU->mSFR[REG_DPL];
+        aSpace[0] = TRACE_XDATA;
+        return 1;
+    case 0xf2: case 0xf3: // movx @ri, a
+        aAddress[0] = INDIR_RX_ADDRESS;
+        aSpace[0] = TRACE_XDATA;
+        return 1;
+    case 0x90: case 0xa3: // mov dptr, #data; inc dptr
+        aAddress[0] = REG_DPL + 0x80;
+        aAddress[1] = REG_DPH + 0x80;
+        aSpace[0] = TRACE_SFR;
+        aSpace[1] = TRACE_SFR;
+        return 2;
+    case 0x84: case 0xa4: // div, mul ab
+        aAddress[0] = REG_B + 0x80;
+        aSpace[0] = TRACE_SFR;
+        return 1;
+    }
+    return 0;
+}
+
+void op_predecode(struct em8051 *aCPU, int aPosition)
+{
+    int mask = aCPU->mCodeMemSize - 1;
+    struct em8051decoded *d = aCPU->mDecoded + (aPosition & mask);
+    int opcode = aCPU->mCodeMem[aPosition & mask];
+
+    d->mOp = aCPU->op[opcode];
+    d->mLength = op_lengths[opcode];
+    d->mTicks = op_ticks[opcode];
+    d->mFlags = op_flags(aCPU, aPosition);
+}
+
+// The DECODED_FLAGS of the operation at PC, from its predecoded record
+// if there is one
+static int threaded_flags(struct em8051 *aCPU)
+{
+    int pc = PC & (aCPU->mCodeMemSize - 1);
+
+    if (aCPU->mDecoded)
+    {
+        struct em8051decoded *d = aCPU->mDecoded + pc;
+        if (d->mLength == 0)
+            op_predecode(aCPU, pc);
+        return d->mFlags;
+    }
+    return op_flags(aCPU, pc);
+}
+
+// Nonzero if the operation at PC, with aFlags, can run without going back
+// to the core: any but those on the timer registers, which the core
+// brings up to date around them. The rest get an up to date PSW where
+// execute() would give them one.
+static int threaded_plain(struct em8051 *aCPU, int aFlags)
+{
+    if (aFlags & DECODED_TIMER)
+        return 0;
+    if (aFlags & (DECODED_SFR | DECODED_CALLBACK | DECODED_PSW))
+        psw_sync(aCPU);
+    return 1;
+}
+
+// Nonzero if the core would have nothing to do after an operation with
+// aFlags: it didn't call the front-end, which it can't if aCallbacks is
+// 0 (none of the callbacks are set), and didn't make an interrupt or
+// idle mode due.
+static int threaded_quiet(struct em8051 *aCPU, int aFlags, int aCallbacks)
+{
+    if ((aFlags & (DECODED_CALLBACK | DECODED_SFR)) && aCallbacks)
+        return 0;
+    // RETI may let a waiting interrupt in
+    if ((aFlags & DECODED_CALLBACK) && aCPU->mInterruptPending)
+        return 0;
+    if (aFlags & DECODED_INTERRUPT)
+    {
+        interrupt_update(aCPU);
+        if (aCPU->mInterruptPending)
+            return 0;
+    }
+    return 1;
+}
+
+// After an operation, continue with the next one if the core's checks
+// in between would do nothing: the operation was quiet, didn't stop at
+// the breakpoint, and the next one starts before the end of the budget
+// and the next timer overflow, and doesn't access the timers.
+#define THREADED_CONTINUE \
+    (threaded_quiet(aCPU, flags, callbacks) && \
+     (PC & 0xffff) != aBreakpoint && \
+     ticks + (delay ? delay : 1) <= limit && \
+     threaded_plain(aCPU, flags = threaded_flags(aCPU)))
+
+int op_run_threaded(struct em8051 *aCPU, int aCycles, int aBreakpoint, int *aDelay)
+{
+    int opcode = OPCODE;
+    int flags = threaded_flags(aCPU);
+    int callbacks = aCPU->sfrread || aCPU->sfrwrite || aCPU->xread || aCPU->xwrite || aCPU->except;
+    int limit;
+    int ticks = 0;
+    int delay;
+
+#ifdef __GNUC__
+    // labels-as-values; each operation dispatches the next one by itself,
+    // which gives the branch predictor a history per operation
+    static void *labels[256] = 
+    {
+        &&nop_, &&ajmp_offset_, &&ljmp_address_, &&rr_a_, // 00
+        &&inc_a_, &&inc_mem_, &&inc_indir_rx_, &&inc_indir_rx_, // 04
+        &&inc_rx_, &&inc_rx_, &&inc_rx_, &&inc_rx_, // 08
+        &&inc_rx_, &&inc_rx_, &&inc_rx_, &&inc_rx_, // 0C
+        &&jbc_bitaddr_offset_, &&acall_offset_, &&lcall_address_, &&rrc_a_, // 10
+        &&dec_a_, &&dec_mem_, &&dec_indir_rx_, &&dec_indir_rx_, // 14
+        &&dec_rx_, &&dec_rx_, &&dec_rx_, &&dec_rx_, // 18
+        &&dec_rx_, &&dec_rx_, &&dec_rx_, &&dec_rx_, // 1C
+        &&jb_bitaddr_offset_, &&ajmp_offset_, &&ret_, &&rl_a_, // 20
+        &&add_a_imm_, &&add_a_mem_, &&add_a_indir_rx_, &&add_a_indir_rx_, // 24
+        &&add_a_rx_, &&add_a_rx_, &&add_a_rx_, &&add_a_rx_, // 28
+        &&add_a_rx_, &&add_a_rx_, &&add_a_rx_, &&add_a_rx_, // 2C
+        &&jnb_bitaddr_offset_, &&acall_offset_, &&reti_, &&rlc_a_, // 30
+        &&addc_a_imm_, &&addc_a_mem_, &&addc_a_indir_rx_, &&addc_a_indir_rx_, // 34
+        &&addc_a_rx_, &&addc_a_rx_, &&addc_a_rx_, &&addc_a_rx_, // 38
+        &&addc_a_rx_, &&addc_a_rx_, &&addc_a_rx_, &&addc_a_rx_, // 3C
+        &&jc_offset_, &&ajmp_offset_, &&orl_mem_a_, &&orl_mem_imm_, // 40
+        &&orl_a_imm_, &&orl_a_mem_, &&orl_a_indir_rx_, &&orl_a_indir_rx_, // 44
+        &&orl_a_rx_, &&orl_a_rx_, &&orl_a_rx_, &&orl_a_rx_, // 48
+        &&orl_a_rx_, &&orl_a_rx_, &&orl_a_rx_, &&orl_a_rx_, // 4C
+        &&jnc_offset_, &&acall_offset_, &&anl_mem_a_, &&anl_mem_imm_, // 50
+        &&anl_a_imm_, &&anl_a_mem_, &&anl_a_indir_rx_, &&anl_a_indir_rx_, // 54
+        &&anl_a_rx_, &&anl_a_rx_, &&anl_a_rx_, &&anl_a_rx_, // 58
+        &&anl_a_rx_, &&anl_a_rx_, &&anl_a_rx_, &&anl_a_rx_, // 5C
+        &&jz_offset_, &&ajmp_offset_, &&xrl_mem_a_, &&xrl_mem_imm_, // 60
+        &&xrl_a_imm_, &&xrl_a_mem_, &&xrl_a_indir_rx_, &&xrl_a_indir_rx_, // 64
+        &&xrl_a_rx_, &&xrl_a_rx_, &&xrl_a_rx_, &&xrl_a_rx_, // 68
+        &&xrl_a_rx_, &&xrl_a_rx_, &&xrl_a_rx_, &&xrl_a_rx_, // 6C
+        &&jnz_offset_, &&acall_offset_, &&orl_c_bitaddr_, &&jmp_indir_a_dptr_, // 70
+        &&mov_a_imm_, &&mov_mem_imm_, &&mov_indir_rx_imm_, &&mov_indir_rx_imm_, // 74
+        &&mov_rx_imm_, &&mov_rx_imm_, &&mov_rx_imm_, &&mov_rx_imm_, // 78
+        &&mov_rx_imm_, &&mov_rx_imm_, &&mov_rx_imm_, &&mov_rx_imm_, // 7C
+        &&sjmp_offset_, &&ajmp_offset_, &&anl_c_bitaddr_, &&movc_a_indir_a_pc_, // 80
+        &&div_ab_, &&mov_mem_mem_, &&mov_mem_indir_rx_, &&mov_mem_indir_rx_, // 84
+        &&mov_mem_rx_, &&mov_mem_rx_, &&mov_mem_rx_, &&mov_mem_rx_, // 88
+        &&mov_mem_rx_, &&mov_mem_rx_, &&mov_mem_rx_, &&mov_mem_rx_, // 8C
+        &&mov_dptr_imm_, &&acall_offset_, &&mov_bitaddr_c_, &&movc_a_indir_a_dptr_, // 90
+        &&subb_a_imm_, &&subb_a_mem_, &&subb_a_indir_rx_, &&subb_a_indir_rx_, // 94
+        &&subb_a_rx_, &&subb_a_rx_, &&subb_a_rx_, &&subb_a_rx_, // 98
+        &&subb_a_rx_, &&subb_a_rx_, &&subb_a_rx_, &&subb_a_rx_, // 9C
+        &&orl_c_compl_bitaddr_, &&ajmp_offset_, &&mov_c_bitaddr_, &&inc_dptr_, // A0
+        &&mul_ab_, &&nop_, &&mov_indir_rx_mem_, &&mov_indir_rx_mem_, // A4
+        &&mov_rx_mem_, &&mov_rx_mem_, &&mov_rx_mem_, &&mov_rx_mem_, // A8
+        &&mov_rx_mem_, &&mov_rx_mem_, &&mov_rx_mem_, &&mov_rx_mem_, // AC
+        &&anl_c_compl_bitaddr_, &&acall_offset_, &&cpl_bitaddr_, &&cpl_c_, // B0
+        &&cjne_a_imm_offset_, &&cjne_a_mem_offset_, &&cjne_indir_rx_imm_offset_, &&cjne_indir_rx_imm_offset_, // B4
+        &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, // B8
+        &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, &&cjne_rx_imm_offset_, // BC
+        &&push_mem_, &&ajmp_offset_, &&clr_bitaddr_, &&clr_c_, // C0
+        &&swap_a_, &&xch_a_mem_, &&xch_a_indir_rx_, &&xch_a_indir_rx_, // C4
+        &&xch_a_rx_, &&xch_a_rx_, &&xch_a_rx_, &&xch_a_rx_, // C8
+        &&xch_a_rx_, &&xch_a_rx_, &&xch_a_rx_, &&xch_a_rx_, // CC
+        &&pop_mem_, &&acall_offset_, &&setb_bitaddr_, &&setb_c_, // D0
+        &&da_a_, &&djnz_mem_offset_, &&xchd_a_indir_rx_, &&xchd_a_indir_rx_, // D4
+        &&djnz_rx_offset_, &&djnz_rx_offset_, &&djnz_rx_offset_, &&djnz_rx_offset_, // D8
+        &&djnz_rx_offset_, &&djnz_rx_offset_, &&djnz_rx_offset_, &&djnz_rx_offset_, // DC
+        &&movx_a_indir_dptr_, &&ajmp_offset_, &&movx_a_indir_rx_, &&movx_a_indir_rx_, // E0
+        &&clr_a_, &&mov_a_mem_, &&mov_a_indir_rx_, &&mov_a_indir_rx_, // E4
+        &&mov_a_rx_, &&mov_a_rx_, &&mov_a_rx_, &&mov_a_rx_, // E8
+        &&mov_a_rx_, &&mov_a_rx_, &&mov_a_rx_, &&mov_a_rx_, // EC
+        &&movx_indir_dptr_a_, &&acall_offset_, &&movx_indir_rx_a_, &&movx_indir_rx_a_, // F0
+        &&cpl_a_, &&mov_mem_a_, &&mov_indir_rx_a_, &&mov_indir_rx_a_, // F4
+        &&mov_rx_a_, &&mov_rx_a_, &&mov_rx_a_, &&mov_rx_a_, // F8
+        &&mov_rx_a_, &&mov_rx_a_, &&mov_rx_a_, &&mov_rx_a_ // FC
+    };
+
+#define THREADED_OP(handler) \
+    handler##_: \
+        delay = handler(aCPU); \
+        if (!THREADED_CONTINUE) \
+            goto done; \
+        ticks += delay ? delay : 1; \
+        opcode = OPCODE; \
+        goto *labels[opcode];
+
+#endif
+
+    if (!threaded_plain(aCPU, flags))
+        return 0;
+
+    // the last operation must start within the budget, and before the
+    // tick the next timer overflow is due
+    limit = aCPU->mTimerEvent - aCPU->mTimerTicks - 1;
+    if (limit > aCycles)
+        limit = aCycles;
+
+#ifdef __GNUC__
+    goto *labels[opcode];
+
+    THREADED_OP(nop)
+    THREADED_OP(ajmp_offset)
+    THREADED_OP(ljmp_address)
+    THREADED_OP(rr_a)
+    THREADED_OP(inc_a)
+    THREADED_OP(inc_mem)
+    THREADED_OP(inc_indir_rx)
+    THREADED_OP(inc_rx)
+    THREADED_OP(jbc_bitaddr_offset)
+    THREADED_OP(acall_offset)
+    THREADED_OP(lcall_address)
+    THREADED_OP(rrc_a)
+    THREADED_OP(dec_a)
+    THREADED_OP(dec_mem)
+    THREADED_OP(dec_indir_rx)
+    THREADED_OP(dec_rx)
+    THREADED_OP(jb_bitaddr_offset)
+    THREADED_OP(ret)
+    THREADED_OP(rl_a)
+    THREADED_OP(add_a_imm)
+    THREADED_OP(add_a_mem)
+    THREADED_OP(add_a_indir_rx)
+    THREADED_OP(add_a_rx)
+    THREADED_OP(jnb_bitaddr_offset)
+    THREADED_OP(reti)
+    THREADED_OP(rlc_a)
+    THREADED_OP(addc_a_imm)
+    THREADED_OP(addc_a_mem)
+    THREADED_OP(addc_a_indir_rx)
+    THREADED_OP(addc_a_rx)
+    THREADED_OP(jc_offset)
+    THREADED_OP(orl_mem_a)
+    THREADED_OP(orl_mem_imm)
+    THREADED_OP(orl_a_imm)
+    THREADED_OP(orl_a_mem)
+    THREADED_OP(orl_a_indir_rx)
+    THREADED_OP(orl_a_rx)
+    THREADED_OP(jnc_offset)
+    THREADED_OP(anl_mem_a)
+    THREADED_OP(anl_mem_imm)
+    THREADED_OP(anl_a_imm)
+    THREADED_OP(anl_a_mem)
+    THREADED_OP(anl_a_indir_rx)
+    THREADED_OP(anl_a_rx)
+    THREADED_OP(jz_offset)
+    THREADED_OP(xrl_mem_a)
+    THREADED_OP(xrl_mem_imm)
+    THREADED_OP(xrl_a_imm)
+    THREADED_OP(xrl_a_mem)
+    THREADED_OP(xrl_a_indir_rx)
+    THREADED_OP(xrl_a_rx)
+    THREADED_OP(jnz_offset)
+    THREADED_OP(orl_c_bitaddr)
+    THREADED_OP(jmp_indir_a_dptr)
+    THREADED_OP(mov_a_imm)
+    THREADED_OP(mov_mem_imm)
+    THREADED_OP(mov_indir_rx_imm)
+    THREADED_OP(mov_rx_imm)
+    THREADED_OP(sjmp_offset)
+    THREADED_OP(anl_c_bitaddr)
+    THREADED_OP(movc_a_indir_a_pc)
+    THREADED_OP(div_ab)
+    THREADED_OP(mov_mem_mem)
+    THREADED_OP(mov_mem_indir_rx)
+    THREADED_OP(mov_mem_rx)
+    THREADED_OP(mov_dptr_imm)
+    THREADED_OP(mov_bitaddr_c)
+    THREADED_OP(movc_a_indir_a_dptr)
+    THREADED_OP(subb_a_imm)
+    THREADED_OP(subb_a_mem)
+    THREADED_OP(subb_a_indir_rx)
+    THREADED_OP(subb_a_rx)
+    THREADED_OP(orl_c_compl_bitaddr)
+    THREADED_OP(mov_c_bitaddr)
+    THREADED_OP(inc_dptr)
+    THREADED_OP(mul_ab)
+    THREADED_OP(mov_indir_rx_mem)
+    THREADED_OP(mov_rx_mem)
+    THREADED_OP(anl_c_compl_bitaddr)
+    THREADED_OP(cpl_bitaddr)
+    THREADED_OP(cpl_c)
+    THREADED_OP(cjne_a_imm_offset)
+    THREADED_OP(cjne_a_mem_offset)
+    THREADED_OP(cjne_indir_rx_imm_offset)
+    THREADED_OP(cjne_rx_imm_offset)
+    THREADED_OP(push_mem)
+    THREADED_OP(clr_bitaddr)
+    THREADED_OP(clr_c)
+    THREADED_OP(swap_a)
+    THREADED_OP(xch_a_mem)
+    THREADED_OP(xch_a_indir_rx)
+    THREADED_OP(xch_a_rx)
+    THREADED_OP(pop_mem)
+    THREADED_OP(setb_bitaddr)
+    THREADED_OP(setb_c)
+    THREADED_OP(da_a)
+    THREADED_OP(djnz_mem_offset)
+    THREADED_OP(xchd_a_indir_rx)
+    THREADED_OP(djnz_rx_offset)
+    THREADED_OP(movx_a_indir_dptr)
+    THREADED_OP(movx_a_indir_rx)
+    THREADED_OP(clr_a)
+    THREADED_OP(mov_a_mem)
+    THREADED_OP(mov_a_indir_rx)
+    THREADED_OP(mov_a_rx)
+    THREADED_OP(movx_indir_dptr_a)
+    THREADED_OP(movx_indir_rx_a)
+    THREADED_OP(cpl_a)
+    THREADED_OP(mov_mem_a)
+    THREADED_OP(mov_indir_rx_a)
+    THREADED_OP(mov_rx_a)
+#undef THREADED_OP
+
+#else
+    // portable version; one dispatch point in do_op()
+    for (;;)
+    {
+        delay = do_op(aCPU);
+        if (!THREADED_CONTINUE)
+            goto done;
+        ticks += delay ? delay : 1;
+        opcode = OPCODE;
+    }
+#endif
+
+done:
+    *aDelay = delay;
+    return ticks + 1;
+}
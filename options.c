@@ -35,17 +35,6 @@
 
 static int activerow = 0;
 
-int opt_exception_iret_sp = 1;
-int opt_exception_iret_acc = 1;
-int opt_exception_iret_psw = 1;
-int opt_exception_acc_to_a = 1;
-int opt_exception_stack = 1;
-int opt_exception_invalid = 1;
-int opt_input_outputlow = 1;
-int opt_clock_select = 3;
-int opt_clock_hz = 12*1000*1000;
-int opt_step_instruction = 0;
-
 int clockspeeds[] = { 
     33*1000*1000,
     24*1000*1000, 
@@ -72,6 +61,7 @@ void build_options_view(struct em8051 *aCPU)
 
 void options_editor_keys(struct em8051 *aCPU, int ch)
 {
+    struct emu_context *ctx = aCPU->mContext;
     switch (ch)
     {
     case KEY_UP:
@@ -96,36 +86,36 @@ void options_editor_keys(struct em8051 *aCPU, int ch)
         switch (activerow)
         {
         case 1:
-            opt_clock_select--;
-            if (opt_clock_select < 0)
-                opt_clock_select = 0;
-            opt_clock_hz = clockspeeds[opt_clock_select];
+            ctx->opt_clock_select--;
+            if (ctx->opt_clock_select < 0)
+                ctx->opt_clock_select = 0;
+            ctx->opt_clock_hz = clockspeeds[ctx->opt_clock_select];
             break;
         case 2:
-            opt_input_outputlow--;
-            if (opt_input_outputlow < 0)
-                opt_input_outputlow = 0;
+            ctx->opt_input_outputlow--;
+            if (ctx->opt_input_outputlow < 0)
+                ctx->opt_input_outputlow = 0;
             break;
         case 3:
-            opt_step_instruction = !opt_step_instruction;
+            ctx->opt_step_instruction = !ctx->opt_step_instruction;
             break;
         case 4:
-            opt_exception_iret_sp = !opt_exception_iret_sp;
+            ctx->opt_exception_iret_sp = !ctx->opt_exception_iret_sp;
             break;
         case 5:
-            opt_exception_iret_acc = !opt_exception_iret_acc;
+            ctx->opt_exception_iret_acc = !ctx->opt_exception_iret_acc;
             break;
         case 6:
-            opt_exception_iret_psw = !opt_exception_iret_psw;
+            ctx->opt_exception_iret_psw = !ctx->opt_exception_iret_psw;
             break;
         case 7:
-            opt_exception_acc_to_a = !opt_exception_acc_to_a;
+            ctx->opt_exception_acc_to_a = !ctx->opt_exception_acc_to_a;
             break;
         case 8:
-            opt_exception_stack = !opt_exception_stack;
+            ctx->opt_exception_stack = !ctx->opt_exception_stack;
             break;
         case 9:
-            opt_exception_invalid = !opt_exception_invalid;
+            ctx->opt_exception_invalid = !ctx->opt_exception_invalid;
             break;
         }
         break;
@@ -133,41 +123,41 @@ void options_editor_keys(struct em8051 *aCPU, int ch)
         switch (activerow)
         {
         case 1:
-            opt_clock_select++;
-            if (opt_clock_select > 12)
-                opt_clock_select = 12;
-            if (opt_clock_select == 12)
-                opt_clock_hz = emu_readhz(aCPU, "Enter custom clock speed", opt_clock_hz);
+            ctx->opt_clock_select++;
+            if (ctx->opt_clock_select > 12)
+                ctx->opt_clock_select = 12;
+            if (ctx->opt_clock_select == 12)
+                ctx->opt_clock_hz = emu_readhz(aCPU, "Enter custom clock speed", ctx->opt_clock_hz);
             else
-                opt_clock_hz = clockspeeds[opt_clock_select];
-            if (opt_clock_hz == 0) 
-                opt_clock_hz = 1;
+                ctx->opt_clock_hz = clockspeeds[ctx->opt_clock_select];
+            if (ctx->opt_clock_hz == 0) 
+                ctx->opt_clock_hz = 1;
             break;
         case 2:
-            opt_input_outputlow++;
-            if (opt_input_outputlow > 2)
-                opt_input_outputlow = 2;
+            ctx->opt_input_outputlow++;
+            if (ctx->opt_input_outputlow > 2)
+                ctx->opt_input_outputlow = 2;
             break;
         case 3:
-            opt_step_instruction = !opt_step_instruction;
+            ctx->opt_step_instruction = !ctx->opt_step_instruction;
             break;
         case 4:
-            opt_exception_iret_sp = !opt_exception_iret_sp;
+            ctx->opt_exception_iret_sp = !ctx->opt_exception_iret_sp;
             break;
         case 5:
-            opt_exception_iret_acc = !opt_exception_iret_acc;
+            ctx->opt_exception_iret_acc = !ctx->opt_exception_iret_acc;
             break;
         case 6:
-            opt_exception_iret_psw = !opt_exception_iret_psw;
+            ctx->opt_exception_iret_psw = !ctx->opt_exception_iret_psw;
             break;
         case 7:
-            opt_exception_acc_to_a = !opt_exception_acc_to_a;
+            ctx->opt_exception_acc_to_a = !ctx->opt_exception_acc_to_a;
             break;
         case 8:
-            opt_exception_stack = !opt_exception_stack;
+            ctx->opt_exception_stack = !ctx->opt_exception_stack;
             break;
         case 9:
-            opt_exception_invalid = !opt_exception_invalid;
+            ctx->opt_exception_invalid = !ctx->opt_exception_invalid;
             break;
         }
         break;
@@ -176,24 +166,25 @@ void options_editor_keys(struct em8051 *aCPU, int ch)
 
 void options_update(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     int i;
     mvprintw(1, 1, "Options");
     for (i = 0; i < 10; i++)
         mvprintw(i * 2 + 3, 2, "  ");
     attron(A_REVERSE);
     mvprintw(3, 4, "< Hardware: 'super' 8051 >");
-    mvprintw(5, 4, "< Clock at % 8.3f MHz >", opt_clock_hz / (1000*1000.0f));
-    mvprintw(9, 4, "< Step steps %s >", opt_step_instruction ? "single instruction" : "single cpu cycle  ");
+    mvprintw(5, 4, "< Clock at % 8.3f MHz >", ctx->opt_clock_hz / (1000*1000.0f));
+    mvprintw(9, 4, "< Step steps %s >", ctx->opt_step_instruction ? "single instruction" : "single cpu cycle  ");
     /*
     mvprintw(7, 4, "< option >");
     */
-    mvprintw(7, 4, "< High inputs from ports with low out level should be %c >", "01?"[opt_input_outputlow]);
-    mvprintw(11, 4, "< Interrupt handler sp watch exception %s >", opt_exception_iret_sp?"enabled ":"disabled");
-    mvprintw(13, 4, "< Interrupt handler acc watch exception %s >", opt_exception_iret_acc?"enabled ":"disabled");
-    mvprintw(15, 4, "< Interrupt handler psw watch exception %s >", opt_exception_iret_psw?"enabled ":"disabled");
-    mvprintw(17, 4, "< Acc-to-a opcode exception %s >", opt_exception_acc_to_a?"enabled ":"disabled");
-    mvprintw(19, 4, "< Stack exception %s >", opt_exception_stack?"enabled ":"disabled");
-    mvprintw(21, 4, "< Illegal opcode exception %s >", opt_exception_invalid?"enabled ":"disabled"); 
+    mvprintw(7, 4, "< High inputs from ports with low out level should be %c >", "01?"[ctx->opt_input_outputlow]);
+    mvprintw(11, 4, "< Interrupt handler sp watch exception %s >", ctx->opt_exception_iret_sp?"enabled ":"disabled");
+    mvprintw(13, 4, "< Interrupt handler acc watch exception %s >", ctx->opt_exception_iret_acc?"enabled ":"disabled");
+    mvprintw(15, 4, "< Interrupt handler psw watch exception %s >", ctx->opt_exception_iret_psw?"enabled ":"disabled");
+    mvprintw(17, 4, "< Acc-to-a opcode exception %s >", ctx->opt_exception_acc_to_a?"enabled ":"disabled");
+    mvprintw(19, 4, "< Stack exception %s >", ctx->opt_exception_stack?"enabled ":"disabled");
+    mvprintw(21, 4, "< Illegal opcode exception %s >", ctx->opt_exception_invalid?"enabled ":"disabled"); 
     attroff(A_REVERSE);
     mvprintw(activerow * 2 + 3, 2, "->");
 }
@@ -33,11 +33,9 @@
 #include "emu8051.h"
 #include "emulator.h"
 
-// store the object filename (Accessed through command line as well)
-char filename[256];
-
 void emu_popup(struct em8051 *aCPU, char *aTitle, char *aMessage)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     nocbreak();
     cbreak();
@@ -45,8 +43,8 @@ void emu_popup(struct em8051 *aCPU, char *aTitle, char *aMessage)
     halfdelay(1);
     while (getch() > 0) {}
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 5, 40, (LINES-5)/2, (COLS-40)/2);
     wattron(exc,A_REVERSE);
     werase(exc);
@@ -71,27 +69,32 @@ void emu_popup(struct em8051 *aCPU, char *aTitle, char *aMessage)
 
 void emu_exception(struct em8051 *aCPU, int aCode)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
 
+    // these were shown when the replayed code first ran
+    if (ctx->reverse.replaying)
+        return;
+
     switch (aCode)
     {
     case EXCEPTION_IRET_SP_MISMATCH:
-        if (opt_exception_iret_sp) return;
+        if (ctx->opt_exception_iret_sp) return;
         break;
     case EXCEPTION_IRET_ACC_MISMATCH:
-        if (opt_exception_iret_acc) return;
+        if (ctx->opt_exception_iret_acc) return;
         break;
     case EXCEPTION_IRET_PSW_MISMATCH:
-        if (opt_exception_iret_psw) return;
+        if (ctx->opt_exception_iret_psw) return;
         break;
     case EXCEPTION_ACC_TO_A:
-        if (!opt_exception_acc_to_a) return;
+        if (!ctx->opt_exception_acc_to_a) return;
         break;
     case EXCEPTION_STACK:
-        if (!opt_exception_stack) return;
+        if (!ctx->opt_exception_stack) return;
         break;
     case EXCEPTION_ILLEGAL_OPCODE:
-        if (!opt_exception_invalid) return;
+        if (!ctx->opt_exception_invalid) return;
         break;
     }
 
@@ -102,8 +105,8 @@ void emu_exception(struct em8051 *aCPU, int aCode)
     while (getch() > 0) {}
 
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 7, 50, (LINES-6)/2, (COLS-50)/2);
     wattron(exc,A_REVERSE);
     werase(exc);
@@ -145,39 +148,42 @@ void emu_exception(struct em8051 *aCPU, int aCode)
     change_view(aCPU, MAIN_VIEW);
 }
 
-void emu_load(struct em8051 *aCPU)
+// Stops the emulator and asks for a file name in a popup titled aTitle,
+// starting from the last one used; the name is left in ctx->filename.
+// Returns the popup, for the caller to delwin() once done with the file.
+static WINDOW *filename_prompt(struct em8051 *aCPU, const char *aTitle)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     int pos = 0;
     int ch = 0;
-    int result;
-    pos = (int)strlen(filename);
+    pos = (int)strlen(ctx->filename);
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 5, 50, (LINES-6)/2, (COLS-50)/2);
     wattron(exc, A_REVERSE);
     werase(exc);
     box(exc,ACS_VLINE,ACS_HLINE);
-    mvwaddstr(exc, 0, 2, "Load Intel HEX File");
+    mvwaddstr(exc, 0, 2, aTitle);
     wattroff(exc, A_REVERSE);
     wmove(exc, 2, 2);
     //            12345678901234567890123456780123456789012345
     waddstr(exc,"[____________________________________________]"); 
     wmove(exc,2,3);
-    waddstr(exc, filename);
+    waddstr(exc, ctx->filename);
     wrefresh(exc);
 
     while (ch != '\n')
     {
         ch = getch();
-        if (ch > 31 && ch < 127 || ch > 127 && ch < 255)
+        if ((ch > 31 && ch < 127) || (ch > 127 && ch < 255))
         {
             if (pos < 44)
             {
-                filename[pos] = ch;
+                ctx->filename[pos] = ch;
                 pos++;
-                filename[pos] = 0;
+                ctx->filename[pos] = 0;
                 waddch(exc,ch);
                 wrefresh(exc);
             }
@@ -187,7 +193,7 @@ void emu_load(struct em8051 *aCPU)
             if (pos > 0)
             {
                 pos--;
-                filename[pos] = 0;
+                ctx->filename[pos] = 0;
                 wmove(exc,2,3+pos);
                 waddch(exc,'_');
                 wmove(exc,2,3+pos);
@@ -195,8 +201,18 @@ void emu_load(struct em8051 *aCPU)
             }
         }
     }
+    return exc;
+}
 
-    result = load_obj(aCPU, filename);
+void emu_load(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    WINDOW * exc;
+    int result;
+
+    exc = filename_prompt(aCPU, "Load Intel HEX File");
+
+    result = load_obj(aCPU, ctx->filename);
     delwin(exc);
     refreshview(aCPU);
 
@@ -222,66 +238,70 @@ void emu_load(struct em8051 *aCPU)
 
 void mem_load(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
-    int pos = 0;
-    int ch = 0;
     int result;
-    pos = (int)strlen(filename);
 
-    runmode = 0;
-    setSpeed(speed, runmode);
-    exc = subwin(stdscr, 5, 50, (LINES-6)/2, (COLS-50)/2);
-    wattron(exc, A_REVERSE);
-    werase(exc);
-    box(exc,ACS_VLINE,ACS_HLINE);
-    mvwaddstr(exc, 0, 2, "Load dump file to mem");
-    wattroff(exc, A_REVERSE);
-    wmove(exc, 2, 2);
-    //            12345678901234567890123456780123456789012345
-    waddstr(exc,"[____________________________________________]"); 
-    wmove(exc,2,3);
-    waddstr(exc, filename);
-    wrefresh(exc);
+    exc = filename_prompt(aCPU, "Load dump file to mem");
 
-    while (ch != '\n')
+    result = load_mem(aCPU, ctx->filename);
+    delwin(exc);
+    refreshview(aCPU);
+
+    switch (result)
     {
-        ch = getch();
-        if (ch > 31 && ch < 127 || ch > 127 && ch < 255)
-        {
-            if (pos < 44)
-            {
-                filename[pos] = ch;
-                pos++;
-                filename[pos] = 0;
-                waddch(exc,ch);
-                wrefresh(exc);
-            }
-        }
-        if (ch == KEY_DC || ch == 8 || ch == KEY_BACKSPACE)
-        {
-            if (pos > 0)
-            {
-                pos--;
-                filename[pos] = 0;
-                wmove(exc,2,3+pos);
-                waddch(exc,'_');
-                wmove(exc,2,3+pos);
-                wrefresh(exc);
-            }
-        }
+    case -1:
+        emu_popup(aCPU, "Load error", "File not found.");
+        break;
+    case -2:
+        emu_popup(aCPU, "Load error", "Bad file format.");
+        break;
     }
+}
+
 
-    result = load_mem(aCPU, filename);
+void state_file(struct em8051 *aCPU, int aSave)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    unsigned char board[LOGICBOARD_STATE_SIZE];
+    WINDOW * exc;
+    int result;
+
+    exc = filename_prompt(aCPU, aSave ? "Save snapshot" : "Restore snapshot");
+
+    // the logic board hardware goes along; its output files stay as they are
+    if (aSave)
+    {
+        logicboard_save_state(&ctx->logicboard, board);
+        result = em8051_save_state(aCPU, ctx->filename, board, sizeof(board));
+    }
+    else
+    {
+        // a snapshot without the board (say, from emu8051-batch) leaves it be
+        logicboard_save_state(&ctx->logicboard, board);
+        result = em8051_load_state(aCPU, ctx->filename, board, sizeof(board));
+        if (result == 0)
+            logicboard_load_state(&ctx->logicboard, board);
+    }
     delwin(exc);
     refreshview(aCPU);
 
     switch (result)
     {
     case -1:
-        emu_popup(aCPU, "Load error", "File not found.");
+        emu_popup(aCPU, aSave ? "Save error" : "Load error", aSave ? "Can't write file." : "File not found.");
         break;
     case -2:
-        emu_popup(aCPU, "Load error", "Bad file format.");
+        emu_popup(aCPU, "Load error", "Not a snapshot file.");
+        break;
+    case -3:
+        emu_popup(aCPU, "Load error", "Unsupported snapshot version.");
+        break;
+    case -4:
+        emu_popup(aCPU, "Load error", "Snapshot of a different setup.");
+        break;
+    case -5:
+        emu_popup(aCPU, "Load error", "Snapshot file is truncated.");
         break;
     }
 }
@@ -289,14 +309,15 @@ void mem_load(struct em8051 *aCPU)
 
 int emu_readvalue(struct em8051 *aCPU, const char *aPrompt, int aOldvalue, int aValueSize)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     int pos = 0;
     int ch = 0;
     char temp[16];
     pos = aValueSize;    
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     if (aValueSize == 2)
         exc = subwin(stdscr, 5, 30, (LINES-6)/2, (COLS-30)/2);
     else
@@ -383,13 +404,14 @@ int emu_readvalue(struct em8051 *aCPU, const char *aPrompt, int aOldvalue, int a
 
 int emu_readhz(struct em8051 *aCPU, const char *aPrompt, int aOldvalue)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     int pos = 0;
     int ch = 0;
     char temp[24];
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 5, 50, (LINES-6)/2, (COLS-50)/2);
     wattron(exc,A_REVERSE);
     werase(exc);
@@ -439,6 +461,7 @@ int emu_readhz(struct em8051 *aCPU, const char *aPrompt, int aOldvalue)
 
 int emu_reset(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     char temp[256];
     int pos = 0;
@@ -446,8 +469,8 @@ int emu_reset(struct em8051 *aCPU)
     int result;
     temp[0] = 0;
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 7, 60, (LINES-7)/2, (COLS-60)/2);
     wattron(exc,A_REVERSE);
     werase(exc);
@@ -491,14 +514,15 @@ int emu_reset(struct em8051 *aCPU)
 
 void emu_help(struct em8051 *aCPU)
 {
+    struct emu_context *ctx = aCPU->mContext;
     WINDOW * exc;
     char temp[256];
     int pos = 0;
     int ch = 0;
     temp[0] = 0;
 
-    runmode = 0;
-    setSpeed(speed, runmode);
+    ctx->runmode = 0;
+    setSpeed(ctx->speed, ctx->runmode);
     exc = subwin(stdscr, 14, 70, (LINES-14)/2, (COLS-70)/2);
     wattron(exc,A_REVERSE);
     werase(exc);
@@ -524,6 +548,8 @@ void emu_help(struct em8051 *aCPU)
     mvwaddstr(exc, 9, 2, "+ & - - Adjust run speed");
     mvwaddstr(exc, 10, 6, "v - Change views");
     mvwaddstr(exc, 11, 3, "home - Reset (with options)");
+    mvwaddstr(exc, 12, 6, "s - Save snapshot, S - restore");
+    mvwaddstr(exc, 12, 38, "p - Step back, P - run back");
 
     mvwaddstr(exc, 5, 32, "shift-q - Quit");
     mvwaddstr(exc, 6, 32, "cursors - Move cursor");
@@ -0,0 +1,499 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * profile.c
+ * Execution profiler; operations and cycles per opcode, per address and
+ * per call stack
+ */
+
+// profile_tick() counts each operation tick() runs under its opcode and
+// under the address it ran at, together with the ticks it took. Runs that
+// aren't profiled don't go through here at all, so they cost nothing
+// extra; the counts don't depend on how the run was dispatched, as ticks
+// are emulated time.
+//
+// Calls are followed on a shadow stack. LCALL, ACALL and interrupts push a
+// frame, noting SP with the return address on the stack, and RET or RETI
+// pops back to the frame whose return address it takes; firmware that
+// returns through a pushed address, or drops its return address, doesn't
+// throw it off for long. Each frame is a node in a tree of the call stacks
+// seen, and every tick goes to the node on top. An interrupt starts a tree
+// of its own rather than a branch of whatever it interrupted, so its time
+// isn't counted in the interrupted functions. Per function totals are
+// worked out of the tree for the report.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// one call stack; see em8051profile::mNodes
+struct em8051profilenode
+{
+    int mAddress; // function entry point, or -1 for the code run from reset
+    int mInterrupt; // entered by an interrupt
+    int mParent; // -1 for a tree of its own
+    int mChild; // first callee, -1 if none
+    int mSibling; // next callee of the same caller, or the next tree
+    unsigned long long mCalls;
+    unsigned long long mCycles; // ticks in the function itself
+};
+
+// one line of the report
+struct hotspot
+{
+    int mIndex; // opcode or address
+    unsigned long long mCount;
+    unsigned long long mCycles;
+    unsigned long long mSelf; // functions only; ticks outside the callees
+};
+
+struct em8051profile *profile_create(void)
+{
+    struct em8051profile *p = calloc(1, sizeof(struct em8051profile));
+    if (!p)
+        return NULL;
+    p->mNodes = malloc(64 * sizeof(struct em8051profilenode));
+    if (!p->mNodes)
+    {
+        free(p);
+        return NULL;
+    }
+    p->mNodeSpace = 64;
+    // the code run from reset, at the bottom of the stack
+    p->mNodes[0].mAddress = -1;
+    p->mNodes[0].mInterrupt = 0;
+    p->mNodes[0].mParent = -1;
+    p->mNodes[0].mChild = -1;
+    p->mNodes[0].mSibling = -1;
+    p->mNodes[0].mCalls = 1;
+    p->mNodes[0].mCycles = 0;
+    p->mNodeCount = 1;
+    p->mStackNode[0] = 0;
+    p->mStackSP[0] = -1;
+    p->mDepth = 1;
+    return p;
+}
+
+void profile_free(struct em8051profile *aProfile)
+{
+    free(aProfile->mNodes);
+    free(aProfile);
+}
+
+// the node for a call to aAddress from aParent, or for a tree of its own
+// if aParent is -1; -1 if there's no memory for a new one
+static int find_node(struct em8051profile *aProfile, int aParent, int aAddress, int aInterrupt)
+{
+    struct em8051profilenode *n;
+    int last = -1;
+    int i;
+
+    // the trees follow each other from the one run from reset
+    i = aParent < 0 ? 0 : aProfile->mNodes[aParent].mChild;
+    for (; i >= 0; i = aProfile->mNodes[i].mSibling)
+    {
+        n = &aProfile->mNodes[i];
+        if (n->mAddress == aAddress && n->mInterrupt == aInterrupt)
+            return i;
+        last = i;
+    }
+
+    if (aProfile->mNodeCount == aProfile->mNodeSpace)
+    {
+        n = realloc(aProfile->mNodes, 2 * aProfile->mNodeSpace * sizeof(struct em8051profilenode));
+        if (!n)
+            return -1;
+        aProfile->mNodes = n;
+        aProfile->mNodeSpace *= 2;
+    }
+    i = aProfile->mNodeCount++;
+    n = &aProfile->mNodes[i];
+    n->mAddress = aAddress;
+    n->mInterrupt = aInterrupt;
+    n->mParent = aParent;
+    n->mChild = -1;
+    n->mSibling = -1;
+    n->mCalls = 0;
+    n->mCycles = 0;
+    if (last >= 0)
+        aProfile->mNodes[last].mSibling = i;
+    else
+        aProfile->mNodes[aParent].mChild = i;
+    return i;
+}
+
+// a call to aAddress, or an interrupt, with the return address at aSP
+static void push_frame(struct em8051profile *aProfile, int aAddress, int aSP, int aInterrupt)
+{
+    int node;
+
+    // frames whose return address has been overwritten are gone
+    while (aProfile->mDepth > 1 && aProfile->mStackSP[aProfile->mDepth - 1] >= aSP)
+        aProfile->mDepth--;
+    if (aProfile->mDepth == PROFILE_DEPTH)
+        return;
+
+    node = find_node(aProfile, aInterrupt ? -1 : aProfile->mStackNode[aProfile->mDepth - 1], aAddress, aInterrupt);
+    if (node < 0)
+        return;
+    aProfile->mNodes[node].mCalls++;
+    aProfile->mStackNode[aProfile->mDepth] = node;
+    aProfile->mStackSP[aProfile->mDepth] = aSP;
+    aProfile->mDepth++;
+}
+
+// a return taking the return address at aSP
+static void pop_frame(struct em8051profile *aProfile, int aSP)
+{
+    int i;
+
+    // a return that no call was made for is a jump
+    for (i = aProfile->mDepth - 1; i > 0; i--)
+    {
+        if (aProfile->mStackSP[i] == aSP)
+        {
+            aProfile->mDepth = i;
+            return;
+        }
+    }
+}
+
+int profile_tick(struct em8051 *aCPU, struct em8051profile *aProfile)
+{
+    int pc = aCPU->mPC & 0xffff;
+    int opcode = aCPU->mCodeMem[pc & (aCPU->mCodeMemSize - 1)];
+    int sp = aCPU->mSFR[REG_SP];
+    int active = aCPU->mInterruptActive;
+    int ticked;
+    int cycles;
+
+    // if an operation runs, it's the one at PC
+    ticked = tick(aCPU);
+    if (ticked)
+    {
+        // the next operation runs on the tick the delay runs out, or the
+        // next one if there's none
+        cycles = aCPU->mTickDelay ? aCPU->mTickDelay : 1;
+        aProfile->mOpCount[opcode]++;
+        aProfile->mOpCycles[opcode] += cycles;
+        aProfile->mPCCount[pc]++;
+        aProfile->mPCCycles[pc] += cycles;
+        // the call or return itself goes to the caller
+        aProfile->mNodes[aProfile->mStackNode[aProfile->mDepth - 1]].mCycles += cycles;
+
+        if (opcode == 0x12 || (opcode & 0x1f) == 0x11)
+            push_frame(aProfile, aCPU->mPC & 0xffff, aCPU->mSFR[REG_SP], 0);
+        else if (opcode == 0x22 || opcode == 0x32)
+            pop_frame(aProfile, sp);
+    }
+    else if (aCPU->mInterruptActive & ~active)
+    {
+        // the interrupt's own call goes to the interrupt
+        push_frame(aProfile, aCPU->mPC & 0xffff, aCPU->mSFR[REG_SP], 1);
+        aProfile->mNodes[aProfile->mStackNode[aProfile->mDepth - 1]].mCycles += aCPU->mTickDelay;
+    }
+    return ticked;
+}
+
+int profile_run(struct em8051 *aCPU, struct em8051profile *aProfile, int aCycles, int aBreakpoint)
+{
+    int cycles = 0;
+
+    aCPU->mStop = 0;
+    while (cycles < aCycles)
+    {
+        // idle and power-down ticks don't run operations; skip them
+        if (aCPU->mTickDelay <= 1 && (aCPU->mSFR[REG_PCON] & (PCON_IDL_MASK | PCON_PD_MASK)))
+        {
+            int skip = idle_skip(aCPU, aCycles - cycles);
+            cycles += skip;
+            if (skip)
+                continue;
+        }
+
+        cycles++;
+        if (profile_tick(aCPU, aProfile) && (aCPU->mPC & 0xffff) == aBreakpoint)
+            aCPU->mStop = 1;
+        if (aCPU->mStop)
+            break;
+    }
+    return cycles;
+}
+
+// most cycles first
+static int hotspot_compare(const void *aA, const void *aB)
+{
+    const struct hotspot *a = aA;
+    const struct hotspot *b = aB;
+    if (a->mCycles != b->mCycles)
+        return a->mCycles < b->mCycles ? 1 : -1;
+    if (a->mCount != b->mCount)
+        return a->mCount < b->mCount ? 1 : -1;
+    return a->mIndex - b->mIndex;
+}
+
+static double percent(unsigned long long aPart, double aTotal)
+{
+    return aTotal > 0 ? 100.0 * aPart / aTotal : 0;
+}
+
+// functions by address, and the interrupts after them
+#define FUNCTION_KEY(node) ((node)->mAddress < 0 ? 0x20000 : (node)->mAddress | ((node)->mInterrupt << 16))
+
+static void function_name(int aKey, char *aBuffer)
+{
+    if (aKey == 0x20000)
+        sprintf(aBuffer, "main");
+    else if (aKey & 0x10000)
+        sprintf(aBuffer, "isr_%04X", aKey & 0xffff);
+    else
+        sprintf(aBuffer, "sub_%04X", aKey);
+}
+
+// ticks per function, in it and in everything it called; recursive calls
+// are only counted once
+static int report_functions(struct em8051profile *aProfile, FILE *aFile)
+{
+    struct em8051profilenode *nodes = aProfile->mNodes;
+    struct hotspot *spots;
+    unsigned long long *total;
+    int *slot;
+    char name[16];
+    double cycles = 0;
+    int used = 0;
+    int i;
+    int j;
+
+    spots = malloc(aProfile->mNodeCount * sizeof(struct hotspot));
+    total = malloc(aProfile->mNodeCount * sizeof(unsigned long long));
+    slot = malloc((0x20000 + 1) * sizeof(int));
+    if (!spots || !total || !slot)
+    {
+        free(spots);
+        free(total);
+        free(slot);
+        return -1;
+    }
+
+    // callees come after their callers
+    for (i = 0; i < aProfile->mNodeCount; i++)
+        total[i] = nodes[i].mCycles;
+    for (i = aProfile->mNodeCount - 1; i >= 0; i--)
+    {
+        cycles += nodes[i].mCycles;
+        if (nodes[i].mParent >= 0)
+            total[nodes[i].mParent] += total[i];
+    }
+
+    for (i = 0; i <= 0x20000; i++)
+        slot[i] = -1;
+    for (i = 0; i < aProfile->mNodeCount; i++)
+    {
+        int key = FUNCTION_KEY(&nodes[i]);
+        struct hotspot *h;
+        if (slot[key] < 0)
+        {
+            slot[key] = used;
+            spots[used].mIndex = key;
+            spots[used].mCount = 0;
+            spots[used].mCycles = 0;
+            spots[used].mSelf = 0;
+            used++;
+        }
+        h = &spots[slot[key]];
+        h->mCount += nodes[i].mCalls;
+        h->mSelf += nodes[i].mCycles;
+        for (j = nodes[i].mParent; j >= 0; j = nodes[j].mParent)
+        {
+            if (FUNCTION_KEY(&nodes[j]) == key)
+                break;
+        }
+        if (j < 0)
+            h->mCycles += total[i];
+    }
+    qsort(spots, used, sizeof(struct hotspot), hotspot_compare);
+
+    fprintf(aFile, "\nFunction      Calls   Inclusive       %%   Exclusive       %%\n");
+    for (i = 0; i < used; i++)
+    {
+        function_name(spots[i].mIndex, name);
+        fprintf(aFile, "%-8s %10llu  %10llu  %5.1f%%  %10llu  %5.1f%%\n",
+            name,
+            spots[i].mCount,
+            spots[i].mCycles,
+            percent(spots[i].mCycles, cycles),
+            spots[i].mSelf,
+            percent(spots[i].mSelf, cycles));
+    }
+
+    free(spots);
+    free(total);
+    free(slot);
+    return 0;
+}
+
+int profile_report(struct em8051 *aCPU, struct em8051profile *aProfile, char *aFilename, int aLines)
+{
+    struct hotspot *spots;
+    FILE *f;
+    int hottest[256];
+    char assembly[128];
+    double operations = 0;
+    double cycles = 0;
+    int mask = aCPU->mCodeMemSize - 1;
+    int used = 0;
+    int i;
+
+    spots = malloc(65536 * sizeof(struct hotspot));
+    if (!spots)
+        return -1;
+    f = fopen(aFilename, "w");
+    if (!f)
+    {
+        free(spots);
+        return -1;
+    }
+
+    // where each opcode ran most, to show it in use
+    for (i = 0; i < 256; i++)
+        hottest[i] = -1;
+    for (i = 0; i < 65536; i++)
+    {
+        int opcode = aCPU->mCodeMem[i & mask];
+        if (!aProfile->mPCCount[i])
+            continue;
+        if (hottest[opcode] < 0 || aProfile->mPCCycles[i] > aProfile->mPCCycles[hottest[opcode]])
+            hottest[opcode] = i;
+    }
+
+    for (i = 0; i < 256; i++)
+    {
+        operations += aProfile->mOpCount[i];
+        cycles += aProfile->mOpCycles[i];
+        if (!aProfile->mOpCount[i])
+            continue;
+        spots[used].mIndex = i;
+        spots[used].mCount = aProfile->mOpCount[i];
+        spots[used].mCycles = aProfile->mOpCycles[i];
+        used++;
+    }
+    qsort(spots, used, sizeof(struct hotspot), hotspot_compare);
+
+    fprintf(f, "Profile: %.0f operations, %.0f cycles\n\n", operations, cycles);
+    fprintf(f, "Opcode       Count      Cycles       %%  Hottest use\n");
+    for (i = 0; i < used; i++)
+    {
+        int opcode = spots[i].mIndex;
+        assembly[0] = 0;
+        if (hottest[opcode] >= 0)
+            decode(aCPU, hottest[opcode], (unsigned char*)assembly);
+        fprintf(f, "    %02X  %10llu  %10llu  %5.1f%%  %04X  %s\n",
+            opcode,
+            spots[i].mCount,
+            spots[i].mCycles,
+            percent(spots[i].mCycles, cycles),
+            hottest[opcode] & 0xffff,
+            assembly);
+    }
+
+    if (report_functions(aProfile, f) != 0)
+    {
+        fclose(f);
+        free(spots);
+        return -1;
+    }
+
+    used = 0;
+    for (i = 0; i < 65536; i++)
+    {
+        if (!aProfile->mPCCount[i])
+            continue;
+        spots[used].mIndex = i;
+        spots[used].mCount = aProfile->mPCCount[i];
+        spots[used].mCycles = aProfile->mPCCycles[i];
+        used++;
+    }
+    qsort(spots, used, sizeof(struct hotspot), hotspot_compare);
+    if (aLines >= 0 && used > aLines)
+        used = aLines;
+
+    fprintf(f, "\nAddress      Count      Cycles       %%  Operation\n");
+    for (i = 0; i < used; i++)
+    {
+        decode(aCPU, spots[i].mIndex, (unsigned char*)assembly);
+        fprintf(f, "   %04X  %10llu  %10llu  %5.1f%%  %s\n",
+            spots[i].mIndex,
+            spots[i].mCount,
+            spots[i].mCycles,
+            percent(spots[i].mCycles, cycles),
+            assembly);
+    }
+
+    free(spots);
+    if (ferror(f))
+    {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) != 0 ? -1 : 0;
+}
+
+int profile_stacks(struct em8051profile *aProfile, char *aFilename)
+{
+    struct em8051profilenode *nodes = aProfile->mNodes;
+    int stack[PROFILE_DEPTH];
+    char name[16];
+    FILE *f;
+    int depth;
+    int i;
+    int j;
+
+    f = fopen(aFilename, "w");
+    if (!f)
+        return -1;
+
+    // one line per call stack, with the ticks spent on top of it
+    for (i = 0; i < aProfile->mNodeCount; i++)
+    {
+        if (!nodes[i].mCycles)
+            continue;
+        depth = 0;
+        for (j = i; j >= 0; j = nodes[j].mParent)
+            stack[depth++] = j;
+        while (depth--)
+        {
+            function_name(FUNCTION_KEY(&nodes[stack[depth]]), name);
+            fprintf(f, depth ? "%s;" : "%s", name);
+        }
+        fprintf(f, " %llu\n", nodes[i].mCycles);
+    }
+
+    if (ferror(f))
+    {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) != 0 ? -1 : 0;
+}
@@ -0,0 +1,376 @@
+/* 8051 emulator 
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * reverse.c
+ * Stepping backwards for the curses-based emulator front-end
+ */
+
+// Going back in time is done by going forward again: while the emulator
+// runs, a checkpoint of the whole machine is taken every
+// CHECKPOINT_TICKS ticks, and the values of the port reads (user input) are
+// recorded. To get to an earlier point the closest checkpoint before it is
+// restored and the emulator is run to the point, with the port reads taken
+// from the record. The checkpoints are copy-on-write snapshots, so each
+// one only holds the memory pages written since the one before. When they
+// and the record outgrow the memory budget, the oldest checkpoints go.
+//
+// Searching for a breakpoint goes through the checkpoints from the newest
+// with run_cycles(), which is fast; only the final stretch to the point
+// found is run tick by tick, to bring the logic board hardware and the
+// history buffer along. Changing the machine by hand starts a new time
+// line, as the recorded past no longer leads to it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+#include "emulator.h"
+
+// ticks between checkpoints; the most a step back has to run twice
+#define CHECKPOINT_TICKS 200000
+
+static void drop_oldest(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    struct checkpoint *c = &rev->checkpoint[0];
+    int skip;
+    int i;
+
+    if (aCPU->mSnapshot == c->snapshot)
+        aCPU->mSnapshot = NULL;
+    rev->used -= snapshot_size(c->snapshot) + sizeof(struct checkpoint);
+    snapshot_destroy(c->snapshot);
+    rev->checkpoints--;
+    memmove(rev->checkpoint, rev->checkpoint + 1, rev->checkpoints * sizeof(struct checkpoint));
+
+    // the input before the new oldest checkpoint is no longer needed
+    skip = rev->checkpoints ? rev->checkpoint[0].input : rev->inputs;
+    memmove(rev->input, rev->input + skip, (rev->inputs - skip) * sizeof(int));
+    rev->inputs -= skip;
+    rev->used -= skip * sizeof(int);
+    for (i = 0; i < rev->checkpoints; i++)
+        rev->checkpoint[i].input -= skip;
+}
+
+static void drop_newest(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    struct checkpoint *c = &rev->checkpoint[rev->checkpoints - 1];
+
+    if (aCPU->mSnapshot == c->snapshot)
+        aCPU->mSnapshot = NULL;
+    rev->used -= snapshot_size(c->snapshot) + sizeof(struct checkpoint);
+    snapshot_destroy(c->snapshot);
+    rev->checkpoints--;
+}
+
+static void add_checkpoint(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    struct checkpoint *c;
+
+    if (rev->checkpoints == rev->checkpointsize)
+    {
+        struct checkpoint *grown = realloc(rev->checkpoint, (rev->checkpointsize * 2 + 16) * sizeof(struct checkpoint));
+        if (!grown)
+            return;
+        rev->checkpoint = grown;
+        rev->checkpointsize = rev->checkpointsize * 2 + 16;
+    }
+
+    c = &rev->checkpoint[rev->checkpoints];
+    c->snapshot = snapshot_create(aCPU);
+    if (!c->snapshot)
+        return;
+    rev->checkpoints++;
+    rev->used += snapshot_size(c->snapshot) + sizeof(struct checkpoint);
+    c->ticks = rev->ticks;
+    c->input = rev->inputs;
+    c->icount = ctx->icount;
+    c->clocks = ctx->clocks;
+    c->portout[0] = ctx->p0out;
+    c->portout[1] = ctx->p1out;
+    c->portout[2] = ctx->p2out;
+    c->portout[3] = ctx->p3out;
+    c->portout[4] = ctx->p4out;
+    c->portout[5] = ctx->p5out;
+    c->portout[6] = ctx->p6out;
+    c->logicboard = ctx->logicboard;
+
+    // keep at least the new one
+    while (rev->used > rev->budget && rev->checkpoints > 1)
+        drop_oldest(aCPU);
+}
+
+// put the emulator back to checkpoint aIndex
+static void restore(struct em8051 *aCPU, int aIndex)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    struct checkpoint *c = &rev->checkpoint[aIndex];
+    struct logicboard *lb = &ctx->logicboard;
+    FILE *audioout = lb->audioout;
+    FILE *rawout = lb->rawout;
+
+    snapshot_fork(c->snapshot, aCPU);
+    rev->ticks = c->ticks;
+    rev->inputpos = c->input;
+    ctx->icount = c->icount;
+    ctx->clocks = c->clocks;
+    ctx->p0out = c->portout[0];
+    ctx->p1out = c->portout[1];
+    ctx->p2out = c->portout[2];
+    ctx->p3out = c->portout[3];
+    ctx->p4out = c->portout[4];
+    ctx->p5out = c->portout[5];
+    ctx->p6out = c->portout[6];
+    *lb = c->logicboard;
+    lb->audioout = audioout;
+    lb->rawout = rawout;
+}
+
+// whether the operation step mode would stop after the last tick
+static int step_done(struct em8051 *aCPU, int aTicked)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    if (!ctx->opt_step_instruction)
+        return 1;
+    return aTicked || (aCPU->mSFR[REG_PCON] & (PCON_IDL_MASK | PCON_PD_MASK));
+}
+
+// replay from checkpoint aIndex to tick aTarget the way the front-end runs,
+// and forget the time line after it
+static void replay_to(struct em8051 *aCPU, int aIndex, unsigned int aTarget)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+
+    restore(aCPU, aIndex);
+    history_rewind(aCPU, ctx->icount);
+    while (rev->ticks != aTarget)
+    {
+        int old_pc = aCPU->mPC;
+        ctx->clocks += 12;
+        rev->ticks++;
+        // idle loops are run through rather than skipped, so icount
+        // counts their operations as well; the logic board comes out the
+        // same either way, as the forward run catches it up with
+        // logicboard_skip()
+        if (tick(aCPU))
+            history_add(aCPU, old_pc);
+        logicboard_tick(aCPU);
+    }
+
+    while (rev->checkpoints > aIndex + 1)
+        drop_newest(aCPU);
+    rev->used -= (rev->inputs - rev->inputpos) * sizeof(int);
+    rev->inputs = rev->inputpos;
+    timer_sync(aCPU);
+}
+
+void reverse_init(struct em8051 *aCPU, int aBudget)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+
+    rev->budget = aBudget;
+    if (aBudget == 0)
+        return;
+    aCPU->mDirty = calloc((aCPU->mCodeMemSize + aCPU->mExtDataSize) / EM8051_PAGE_SIZE, 1);
+    reverse_edited(aCPU);
+}
+
+void reverse_edited(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+
+    if (rev->budget == 0)
+        return;
+    while (rev->checkpoints)
+        drop_newest(aCPU);
+    rev->inputs = 0;
+    rev->used = 0;
+    rev->ticks = 0;
+    // the edits may not have set mDirty
+    aCPU->mSnapshot = NULL;
+    add_checkpoint(aCPU);
+}
+
+void reverse_ran(struct em8051 *aCPU, int aTicks)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    int i;
+
+    if (rev->budget == 0 || rev->checkpoints == 0)
+        return;
+    rev->ticks += aTicks;
+    if (rev->ticks - rev->checkpoint[rev->checkpoints - 1].ticks >= CHECKPOINT_TICKS)
+        add_checkpoint(aCPU);
+
+    // keep the tick counts well clear of wrapping around
+    if (rev->ticks >= 0x80000000)
+    {
+        unsigned int base = rev->checkpoint[0].ticks;
+        for (i = 0; i < rev->checkpoints; i++)
+            rev->checkpoint[i].ticks -= base;
+        rev->ticks -= base;
+    }
+}
+
+void reverse_record_input(struct em8051 *aCPU, int aValue)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+
+    if (rev->budget == 0 || rev->checkpoints == 0)
+        return;
+    if (rev->inputs == rev->inputsize)
+    {
+        int *grown = realloc(rev->input, (rev->inputsize * 2 + 256) * sizeof(int));
+        if (!grown)
+        {
+            // can't replay without it
+            reverse_edited(aCPU);
+            return;
+        }
+        rev->input = grown;
+        rev->inputsize = rev->inputsize * 2 + 256;
+    }
+    rev->input[rev->inputs++] = aValue;
+    rev->used += sizeof(int);
+}
+
+int reverse_replay_input(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+
+    return rev->input[rev->inputpos++];
+}
+
+int reverse_step(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    unsigned int now = rev->ticks;
+    int i;
+
+    if (rev->checkpoints == 0 || now == rev->checkpoint[0].ticks)
+        return 0;
+
+    rev->replaying = 1;
+    // find the last stop of a forward step before now, looking back from
+    // the newest checkpoint before it
+    for (i = rev->checkpoints - 1; i >= 0; i--)
+    {
+        unsigned int found = 0;
+        int any = 0;
+        if (rev->checkpoint[i].ticks >= now)
+            continue;
+        if (!ctx->opt_step_instruction)
+        {
+            found = now - 1;
+            any = 1;
+        }
+        else
+        {
+            restore(aCPU, i);
+            while (rev->ticks < now - 1)
+            {
+                int ticked = tick(aCPU);
+                rev->ticks++;
+                if (step_done(aCPU, ticked))
+                {
+                    found = rev->ticks;
+                    any = 1;
+                }
+            }
+        }
+        if (any)
+        {
+            replay_to(aCPU, i, found);
+            rev->replaying = 0;
+            return 1;
+        }
+    }
+
+    // no step back from here; stop at the oldest checkpoint
+    replay_to(aCPU, 0, rev->checkpoint[0].ticks);
+    rev->replaying = 0;
+    return 1;
+}
+
+int reverse_continue(struct em8051 *aCPU)
+{
+    struct emu_context *ctx = aCPU->mContext;
+    struct reverse *rev = &ctx->reverse;
+    unsigned int now = rev->ticks;
+    int i;
+
+    if (rev->checkpoints == 0 || now == rev->checkpoint[0].ticks)
+        return 0;
+
+    rev->replaying = 1;
+    if (ctx->breakpoint != -1)
+    {
+        // find the last time the breakpoint was reached before now, in
+        // the stretch from each checkpoint to the next, newest first
+        for (i = rev->checkpoints - 1; i >= 0; i--)
+        {
+            unsigned int found = 0;
+            int any = 0;
+            unsigned int end;
+            if (rev->checkpoint[i].ticks >= now)
+                continue;
+            end = (i == rev->checkpoints - 1 || rev->checkpoint[i + 1].ticks >= now) ? now - 1 : rev->checkpoint[i + 1].ticks;
+
+            restore(aCPU, i);
+            while (rev->ticks < end)
+            {
+                rev->ticks += run_cycles(aCPU, end - rev->ticks, ctx->breakpoint);
+                if (aCPU->mStop)
+                {
+                    found = rev->ticks;
+                    any = 1;
+                }
+            }
+            if (any)
+            {
+                replay_to(aCPU, i, found);
+                rev->replaying = 0;
+                return 1;
+            }
+        }
+    }
+
+    // not reached; go as far back as there is
+    replay_to(aCPU, 0, rev->checkpoint[0].ticks);
+    rev->replaying = 0;
+    return 1;
+}
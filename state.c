@@ -0,0 +1,435 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * state.c
+ * Machine state snapshots
+ */
+
+// A snapshot holds everything a running 8051 needs to carry on exactly as
+// if it had not been stopped, so that tests can start from a saved state
+// instead of running the firmware's start-up code each time. The layout is
+// little-endian whatever the host:
+//
+//   "EM8051ST"             magic
+//   version, flags         32 bits each; see STATE_VERSION and STATE_FLAGS
+//   code, ext, upper size  32 bits each; code size is 0 without STATE_CODE
+//   front-end size         32 bits
+//   PC, mTickDelay, mInterruptActive, int_a[2], int_psw[2], int_sp[2]
+//                          32 bits each
+//   code memory, external memory, lower RAM, upper RAM, SFRs
+//   front-end data
+//
+// Timers and PSW flags are synced before saving, so the lazily kept state
+// in struct em8051 needn't be stored. Front-end data (such as the logic
+// board hardware) is opaque to the core, and is only checked for size.
+//
+// For forking many emulators from one state there are copy-on-write
+// snapshots as well, kept in memory only; see snapshot_create() below.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#define STATE_MAGIC "EM8051ST"
+#define STATE_VERSION 1
+#define STATE_HEADER (8 + 6 * 4)
+#define STATE_REGISTERS (9 * 4)
+
+static unsigned char *put_int(unsigned char *aDest, int aValue)
+{
+    aDest[0] = aValue & 0xff;
+    aDest[1] = (aValue >> 8) & 0xff;
+    aDest[2] = (aValue >> 16) & 0xff;
+    aDest[3] = (aValue >> 24) & 0xff;
+    return aDest + 4;
+}
+
+static int get_int(const unsigned char *aSrc)
+{
+    return aSrc[0] | (aSrc[1] << 8) | (aSrc[2] << 16) | ((unsigned int)aSrc[3] << 24);
+}
+
+int em8051_state_size(struct em8051 *aCPU, int aFlags, int aExtraSize)
+{
+    return STATE_HEADER + STATE_REGISTERS +
+        ((aFlags & STATE_CODE) ? aCPU->mCodeMemSize : 0) +
+        aCPU->mExtDataSize + 128 + (aCPU->mUpperData ? 128 : 0) + 128 +
+        aExtraSize;
+}
+
+int em8051_save_state_mem(struct em8051 *aCPU, unsigned char *aBuffer, int aFlags, const void *aExtra, int aExtraSize)
+{
+    unsigned char *p = aBuffer;
+    int codesize = (aFlags & STATE_CODE) ? aCPU->mCodeMemSize : 0;
+    int uppersize = aCPU->mUpperData ? 128 : 0;
+
+    timer_sync(aCPU);
+    psw_sync(aCPU);
+
+    memcpy(p, STATE_MAGIC, 8);
+    p += 8;
+    p = put_int(p, STATE_VERSION);
+    p = put_int(p, aFlags);
+    p = put_int(p, codesize);
+    p = put_int(p, aCPU->mExtDataSize);
+    p = put_int(p, uppersize);
+    p = put_int(p, aExtraSize);
+
+    p = put_int(p, aCPU->mPC);
+    p = put_int(p, aCPU->mTickDelay);
+    p = put_int(p, aCPU->mInterruptActive);
+    p = put_int(p, aCPU->int_a[0]);
+    p = put_int(p, aCPU->int_a[1]);
+    p = put_int(p, aCPU->int_psw[0]);
+    p = put_int(p, aCPU->int_psw[1]);
+    p = put_int(p, aCPU->int_sp[0]);
+    p = put_int(p, aCPU->int_sp[1]);
+
+    memcpy(p, aCPU->mCodeMem, codesize);
+    p += codesize;
+    memcpy(p, aCPU->mExtData, aCPU->mExtDataSize);
+    p += aCPU->mExtDataSize;
+    memcpy(p, aCPU->mLowerData, 128);
+    p += 128;
+    memcpy(p, aCPU->mUpperData, uppersize);
+    p += uppersize;
+    memcpy(p, aCPU->mSFR, 128);
+    p += 128;
+    if (aExtraSize)
+        memcpy(p, aExtra, aExtraSize);
+    p += aExtraSize;
+
+    return p - aBuffer;
+}
+
+int em8051_load_state_mem(struct em8051 *aCPU, const unsigned char *aBuffer, int aSize, void *aExtra, int aExtraSize)
+{
+    const unsigned char *p = aBuffer;
+    int codesize, extsize, uppersize, extrasize;
+
+    if (aSize < STATE_HEADER || memcmp(p, STATE_MAGIC, 8) != 0)
+        return -2; // not a snapshot
+    if (get_int(p + 8) != STATE_VERSION)
+        return -3; // unsupported version
+    codesize = get_int(p + 16);
+    extsize = get_int(p + 20);
+    uppersize = get_int(p + 24);
+    extrasize = get_int(p + 28);
+    if ((codesize && codesize != aCPU->mCodeMemSize) ||
+        extsize != aCPU->mExtDataSize ||
+        uppersize != (aCPU->mUpperData ? 128 : 0) ||
+        (aExtra && extrasize && extrasize != aExtraSize))
+        return -4; // memory layout mismatch
+    if (aSize < STATE_HEADER + STATE_REGISTERS + codesize + extsize + 128 + uppersize + 128 + extrasize)
+        return -5; // truncated
+    p += STATE_HEADER;
+
+    aCPU->mPC = get_int(p);
+    aCPU->mTickDelay = get_int(p + 4);
+    aCPU->mInterruptActive = get_int(p + 8);
+    aCPU->int_a[0] = get_int(p + 12);
+    aCPU->int_a[1] = get_int(p + 16);
+    aCPU->int_psw[0] = get_int(p + 20);
+    aCPU->int_psw[1] = get_int(p + 24);
+    aCPU->int_sp[0] = get_int(p + 28);
+    aCPU->int_sp[1] = get_int(p + 32);
+    p += STATE_REGISTERS;
+
+    if (codesize)
+    {
+        memcpy(aCPU->mCodeMem, p, codesize);
+        predecode_invalidate(aCPU, 0, codesize);
+    }
+    p += codesize;
+    memcpy(aCPU->mExtData, p, extsize);
+    if (aCPU->mDirty)
+        memset(aCPU->mDirty + (aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT), 1, extsize >> EM8051_PAGE_SHIFT);
+    p += extsize;
+    memcpy(aCPU->mLowerData, p, 128);
+    p += 128;
+    memcpy(aCPU->mUpperData, p, uppersize);
+    p += uppersize;
+    memcpy(aCPU->mSFR, p, 128);
+    p += 128;
+    if (aExtra && extrasize)
+        memcpy(aExtra, p, extrasize);
+
+    // the lazily kept state was synced when saving
+    aCPU->mTimerTicks = 0;
+    aCPU->mFlagsOp = FLAGS_NONE;
+    timer_sync(aCPU);
+
+    return 0;
+}
+
+int em8051_save_state(struct em8051 *aCPU, char *aFilename, const void *aExtra, int aExtraSize)
+{
+    FILE *f;
+    unsigned char *buf;
+    int size = em8051_state_size(aCPU, STATE_CODE, aExtraSize);
+    int ok;
+
+    if (aFilename == 0 || aFilename[0] == 0)
+        return -1;
+    buf = malloc(size);
+    if (!buf)
+        return -1;
+    em8051_save_state_mem(aCPU, buf, STATE_CODE, aExtra, aExtraSize);
+    f = fopen(aFilename, "wb");
+    if (!f)
+    {
+        free(buf);
+        return -1;
+    }
+    ok = fwrite(buf, size, 1, f) == 1;
+    if (fclose(f) != 0)
+        ok = 0;
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+int em8051_load_state(struct em8051 *aCPU, char *aFilename, void *aExtra, int aExtraSize)
+{
+    FILE *f;
+    unsigned char *buf;
+    long size;
+    int ret;
+
+    if (aFilename == 0 || aFilename[0] == 0)
+        return -1;
+    f = fopen(aFilename, "rb");
+    if (!f) return -1;
+    if (fseek(f, 0, SEEK_END) != 0 ||
+        (size = ftell(f)) < 0 ||
+        fseek(f, 0, SEEK_SET) != 0)
+    {
+        fclose(f);
+        return -1;
+    }
+    buf = malloc(size > 0 ? size : 1);
+    if (!buf || fread(buf, 1, size, f) != (size_t)size)
+    {
+        free(buf);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    ret = em8051_load_state_mem(aCPU, buf, size, aExtra, aExtraSize);
+    free(buf);
+    return ret;
+}
+
+// Copy-on-write snapshots keep the small state as is, and memory as a
+// table of reference counted pages. A page never changes once it is in a
+// snapshot, so the snapshots taken after it can share it for as long as
+// the emulator doesn't write it, and it is freed with the last of them.
+struct em8051page
+{
+    int mRefs;
+    unsigned char mData[EM8051_PAGE_SIZE];
+};
+
+struct em8051snapshot
+{
+    int mCodeMemSize;
+    int mExtDataSize;
+    struct em8051page **mPage; // code memory pages, then external memory pages
+
+    int mPC;
+    int mTickDelay;
+    int mInterruptActive;
+    int int_a[2];
+    int int_psw[2];
+    int int_sp[2];
+    int mHasUpper;
+    unsigned char mLowerData[128];
+    unsigned char mUpperData[128];
+    unsigned char mSFR[128];
+};
+
+// memory behind page aPage of the emulator's code and external memory
+static unsigned char *page_memory(struct em8051 *aCPU, int aPage)
+{
+    int codepages = aCPU->mCodeMemSize >> EM8051_PAGE_SHIFT;
+    if (aPage < codepages)
+        return aCPU->mCodeMem + (aPage << EM8051_PAGE_SHIFT);
+    return aCPU->mExtData + ((aPage - codepages) << EM8051_PAGE_SHIFT);
+}
+
+static int snapshot_pages(struct em8051snapshot *aSnapshot)
+{
+    return (aSnapshot->mCodeMemSize + aSnapshot->mExtDataSize) >> EM8051_PAGE_SHIFT;
+}
+
+struct em8051snapshot *snapshot_create(struct em8051 *aCPU)
+{
+    struct em8051snapshot *s;
+    struct em8051snapshot *from = NULL;
+    int pages = (aCPU->mCodeMemSize + aCPU->mExtDataSize) >> EM8051_PAGE_SHIFT;
+    int i;
+
+    if ((aCPU->mCodeMemSize | aCPU->mExtDataSize) & (EM8051_PAGE_SIZE - 1))
+        return NULL;
+
+    timer_sync(aCPU);
+    psw_sync(aCPU);
+
+    // unchanged pages are shared with the snapshot the emulator was forked from
+    if (aCPU->mDirty && aCPU->mSnapshot &&
+        aCPU->mSnapshot->mCodeMemSize == aCPU->mCodeMemSize &&
+        aCPU->mSnapshot->mExtDataSize == aCPU->mExtDataSize)
+        from = aCPU->mSnapshot;
+
+    s = malloc(sizeof(struct em8051snapshot));
+    if (!s)
+        return NULL;
+    s->mCodeMemSize = aCPU->mCodeMemSize;
+    s->mExtDataSize = aCPU->mExtDataSize;
+    s->mPage = calloc(pages + 1, sizeof(struct em8051page *));
+    if (!s->mPage)
+    {
+        free(s);
+        return NULL;
+    }
+
+    for (i = 0; i < pages; i++)
+    {
+        if (from && !aCPU->mDirty[i])
+        {
+            s->mPage[i] = from->mPage[i];
+        }
+        else
+        {
+            s->mPage[i] = malloc(sizeof(struct em8051page));
+            if (!s->mPage[i])
+            {
+                snapshot_destroy(s);
+                return NULL;
+            }
+            s->mPage[i]->mRefs = 0;
+            memcpy(s->mPage[i]->mData, page_memory(aCPU, i), EM8051_PAGE_SIZE);
+        }
+        s->mPage[i]->mRefs++;
+    }
+
+    s->mPC = aCPU->mPC;
+    s->mTickDelay = aCPU->mTickDelay;
+    s->mInterruptActive = aCPU->mInterruptActive;
+    memcpy(s->int_a, aCPU->int_a, sizeof(s->int_a));
+    memcpy(s->int_psw, aCPU->int_psw, sizeof(s->int_psw));
+    memcpy(s->int_sp, aCPU->int_sp, sizeof(s->int_sp));
+    s->mHasUpper = aCPU->mUpperData != NULL;
+    memcpy(s->mLowerData, aCPU->mLowerData, 128);
+    if (aCPU->mUpperData)
+        memcpy(s->mUpperData, aCPU->mUpperData, 128);
+    memcpy(s->mSFR, aCPU->mSFR, 128);
+
+    // the emulator now matches the snapshot
+    if (aCPU->mDirty)
+    {
+        memset(aCPU->mDirty, 0, pages);
+        aCPU->mSnapshot = s;
+    }
+
+    return s;
+}
+
+void snapshot_destroy(struct em8051snapshot *aSnapshot)
+{
+    int pages = snapshot_pages(aSnapshot);
+    int i;
+
+    // pages are filled in order; a failed snapshot_create() stops early
+    for (i = 0; i < pages && aSnapshot->mPage[i]; i++)
+    {
+        if (--aSnapshot->mPage[i]->mRefs == 0)
+            free(aSnapshot->mPage[i]);
+    }
+    free(aSnapshot->mPage);
+    free(aSnapshot);
+}
+
+int snapshot_size(struct em8051snapshot *aSnapshot)
+{
+    int pages = snapshot_pages(aSnapshot);
+    int size = sizeof(struct em8051snapshot) + pages * sizeof(struct em8051page *);
+    int i;
+
+    for (i = 0; i < pages; i++)
+    {
+        if (aSnapshot->mPage[i]->mRefs == 1)
+            size += sizeof(struct em8051page);
+    }
+    return size;
+}
+
+int snapshot_fork(struct em8051snapshot *aSnapshot, struct em8051 *aCPU)
+{
+    struct em8051snapshot *from = aCPU->mDirty ? aCPU->mSnapshot : NULL;
+    int codepages = aSnapshot->mCodeMemSize >> EM8051_PAGE_SHIFT;
+    int pages = snapshot_pages(aSnapshot);
+    int i;
+
+    if (aCPU->mCodeMemSize != aSnapshot->mCodeMemSize ||
+        aCPU->mExtDataSize != aSnapshot->mExtDataSize ||
+        (aCPU->mUpperData != NULL) != aSnapshot->mHasUpper)
+        return -4; // memory layout mismatch
+    if (from && (from->mCodeMemSize != aSnapshot->mCodeMemSize || from->mExtDataSize != aSnapshot->mExtDataSize))
+        from = NULL;
+
+    // a page shared by the two snapshots is still right if the emulator
+    // hasn't written it
+    for (i = 0; i < pages; i++)
+    {
+        if (from && !aCPU->mDirty[i] && from->mPage[i] == aSnapshot->mPage[i])
+            continue;
+        memcpy(page_memory(aCPU, i), aSnapshot->mPage[i]->mData, EM8051_PAGE_SIZE);
+        if (i < codepages)
+            predecode_invalidate(aCPU, i << EM8051_PAGE_SHIFT, EM8051_PAGE_SIZE);
+    }
+    aCPU->mPC = aSnapshot->mPC;
+    aCPU->mTickDelay = aSnapshot->mTickDelay;
+    aCPU->mInterruptActive = aSnapshot->mInterruptActive;
+    memcpy(aCPU->int_a, aSnapshot->int_a, sizeof(aCPU->int_a));
+    memcpy(aCPU->int_psw, aSnapshot->int_psw, sizeof(aCPU->int_psw));
+    memcpy(aCPU->int_sp, aSnapshot->int_sp, sizeof(aCPU->int_sp));
+    memcpy(aCPU->mLowerData, aSnapshot->mLowerData, 128);
+    if (aCPU->mUpperData)
+        memcpy(aCPU->mUpperData, aSnapshot->mUpperData, 128);
+    memcpy(aCPU->mSFR, aSnapshot->mSFR, 128);
+
+    // the lazily kept state was synced when the snapshot was taken
+    aCPU->mTimerTicks = 0;
+    aCPU->mFlagsOp = FLAGS_NONE;
+    timer_sync(aCPU);
+
+    if (aCPU->mDirty)
+    {
+        memset(aCPU->mDirty, 0, pages);
+        aCPU->mSnapshot = aSnapshot;
+    }
+
+    return 0;
+}
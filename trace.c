@@ -0,0 +1,488 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining 
+ * a copy of this software and associated documentation files (the 
+ * "Software"), to deal in the Software without restriction, including 
+ * without limitation the rights to use, copy, modify, merge, publish, 
+ * distribute, sublicense, and/or sell copies of the Software, and to 
+ * permit persons to whom the Software is furnished to do so, subject 
+ * to the following conditions: 
+ *
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software. 
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE. 
+ *
+ * (i.e. the MIT License)
+ *
+ * trace.c
+ * Binary execution traces
+ */
+
+// A trace is a header followed by a fixed-size record for every operation
+// run and every interrupt started, so that it can be read from any record
+// on and compared record by record. The layout is little-endian whatever
+// the host:
+//
+//   "EM8051TR"             magic
+//   version, record size   32 bits each; see TRACE_VERSION and TRACE_RECORD
+//
+// and for each record:
+//
+//   ticks                  32 bits; ticks since the trace started
+//   PC                     16 bits
+//   code                   opcode and its operands, 3 bytes; zero past
+//                          the length of the operation
+//   A, PSW, SP             after the operation
+//   DPTR                   16 bits, after the operation
+//   type                   TRACE_TYPES
+//   writes                 0 to 2
+//   2 * (address, value, space)
+//                          16, 8 and 8 bits; TRACE_SPACES
+//
+// The writes are worked out from the operation before it runs (see
+// op_writes()), and their values read from memory after it. Writes
+// through MOVX are recorded with the value written, whatever the front-end
+// does with it.
+//
+// Records are collected in a buffer of TRACE_BUFFER records, and written
+// out as it fills, so that the emulator doesn't wait for the disk between
+// operations. A trace of a million operations takes 24MB.
+//
+// A trace opened with trace_open() can be run against instead: each record
+// the run makes is compared with the next one read from the trace, and the
+// run stops at the first that differs. The trace is read a buffer at a
+// time, however long it is.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#define TRACE_MAGIC "EM8051TR"
+#define TRACE_VERSION 2
+#define TRACE_HEADER (8 + 2 * 4)
+#define TRACE_RECORD 24
+#define TRACE_BUFFER 65536
+
+struct em8051trace
+{
+    FILE *mFile;
+    int mWriting;
+    unsigned char *mBuffer;
+    // bytes written into the buffer, or read from it
+    int mPos;
+    // bytes read into the buffer
+    int mFill;
+    int mError;
+    // ticks run
+    unsigned int mTicks;
+    // when comparing; see TRACE_COMPARE
+    int mStatus;
+    struct em8051tracerecord mExpected;
+    struct em8051tracerecord mActual;
+};
+
+static void put_u16(unsigned char *aDest, int aValue)
+{
+    aDest[0] = aValue & 0xff;
+    aDest[1] = (aValue >> 8) & 0xff;
+}
+
+static void put_u32(unsigned char *aDest, unsigned int aValue)
+{
+    aDest[0] = aValue & 0xff;
+    aDest[1] = (aValue >> 8) & 0xff;
+    aDest[2] = (aValue >> 16) & 0xff;
+    aDest[3] = (aValue >> 24) & 0xff;
+}
+
+static int get_u16(const unsigned char *aSrc)
+{
+    return aSrc[0] | (aSrc[1] << 8);
+}
+
+static unsigned int get_u32(const unsigned char *aSrc)
+{
+    return aSrc[0] | (aSrc[1] << 8) | (aSrc[2] << 16) | ((unsigned int)aSrc[3] << 24);
+}
+
+static void flush(struct em8051trace *aTrace)
+{
+    if (aTrace->mPos && fwrite(aTrace->mBuffer, aTrace->mPos, 1, aTrace->mFile) != 1)
+        aTrace->mError = 1;
+    aTrace->mPos = 0;
+}
+
+static void write_record(struct em8051trace *aTrace, struct em8051tracerecord *aRecord)
+{
+    unsigned char *p;
+    int i;
+
+    if (aTrace->mPos == TRACE_BUFFER * TRACE_RECORD)
+        flush(aTrace);
+    p = aTrace->mBuffer + aTrace->mPos;
+    aTrace->mPos += TRACE_RECORD;
+
+    put_u32(p, aRecord->mTicks);
+    put_u16(p + 4, aRecord->mPC);
+    p[6] = aRecord->mCode[0];
+    p[7] = aRecord->mCode[1];
+    p[8] = aRecord->mCode[2];
+    p[9] = aRecord->mACC;
+    p[10] = aRecord->mPSW;
+    p[11] = aRecord->mSP;
+    put_u16(p + 12, aRecord->mDPTR);
+    p[14] = aRecord->mType;
+    p[15] = aRecord->mWrites;
+    for (i = 0; i < 2; i++)
+    {
+        if (i < aRecord->mWrites)
+        {
+            put_u16(p + 16 + i * 4, aRecord->mAddress[i]);
+            p[18 + i * 4] = aRecord->mValue[i];
+            p[19 + i * 4] = aRecord->mSpace[i];
+        }
+        else
+        {
+            memset(p + 16 + i * 4, 0, 4);
+        }
+    }
+}
+
+// the byte at aAddress, as the operation that wrote it left it
+static int written_value(struct em8051 *aCPU, int aSpace, int aAddress)
+{
+    switch (aSpace)
+    {
+    case TRACE_IDATA:
+        if (aAddress < 0x80)
+            return aCPU->mLowerData[aAddress];
+        return aCPU->mUpperData ? aCPU->mUpperData[aAddress - 0x80] : 0;
+    case TRACE_SFR:
+        return aCPU->mSFR[aAddress - 0x80];
+    }
+    // MOVX writes A
+    return aCPU->mSFR[REG_ACC];
+}
+
+static struct em8051trace *trace_alloc(FILE *aFile)
+{
+    struct em8051trace *t = calloc(1, sizeof(struct em8051trace));
+    if (t)
+        t->mBuffer = malloc(TRACE_BUFFER * TRACE_RECORD);
+    if (!t || !t->mBuffer)
+    {
+        free(t);
+        fclose(aFile);
+        return NULL;
+    }
+    t->mFile = aFile;
+    return t;
+}
+
+struct em8051trace *trace_create(char *aFilename)
+{
+    struct em8051trace *t;
+    FILE *f;
+
+    f = fopen(aFilename, "wb");
+    if (!f)
+        return NULL;
+    t = trace_alloc(f);
+    if (!t)
+        return NULL;
+    t->mWriting = 1;
+
+    memcpy(t->mBuffer, TRACE_MAGIC, 8);
+    put_u32(t->mBuffer + 8, TRACE_VERSION);
+    put_u32(t->mBuffer + 12, TRACE_RECORD);
+    t->mPos = TRACE_HEADER;
+    flush(t);
+    // the buffer is big enough by itself
+    setvbuf(f, NULL, _IONBF, 0);
+    return t;
+}
+
+struct em8051trace *trace_open(char *aFilename)
+{
+    unsigned char header[TRACE_HEADER];
+    FILE *f;
+
+    f = fopen(aFilename, "rb");
+    if (!f)
+        return NULL;
+    if (fread(header, TRACE_HEADER, 1, f) != 1 ||
+        memcmp(header, TRACE_MAGIC, 8) != 0 ||
+        get_u32(header + 8) != TRACE_VERSION ||
+        get_u32(header + 12) != TRACE_RECORD)
+    {
+        fclose(f);
+        return NULL;
+    }
+    return trace_alloc(f);
+}
+
+// tick(), filling aRecord if an operation ran or an interrupt started.
+// Returns what tick() did, and sets *aRecorded.
+static int record_tick(struct em8051 *aCPU, struct em8051trace *aTrace, struct em8051tracerecord *aRecord, int *aRecorded)
+{
+    struct em8051tracerecord *r = aRecord;
+    int mask = aCPU->mCodeMemSize - 1;
+    int active = aCPU->mInterruptActive;
+    int length;
+    int ticked;
+    int i;
+
+    // the operation tick() may run; if an interrupt starts instead,
+    // nothing runs on this tick
+    r->mWrites = 0;
+    if (aCPU->mTickDelay <= 1)
+    {
+        r->mPC = aCPU->mPC & 0xffff;
+        // only the operation's own bytes, so that what comes after it
+        // doesn't count when comparing
+        length = op_length(aCPU->mCodeMem[aCPU->mPC & mask]);
+        memset(r->mCode, 0, 3);
+        for (i = 0; i < length; i++)
+            r->mCode[i] = aCPU->mCodeMem[(aCPU->mPC + i) & mask];
+        r->mWrites = op_writes(aCPU, r->mSpace, r->mAddress);
+    }
+
+    ticked = tick(aCPU);
+    r->mTicks = aTrace->mTicks++;
+    *aRecorded = 0;
+
+    if (ticked)
+    {
+        r->mType = TRACE_OPERATION;
+    }
+    else
+    {
+        if (!(aCPU->mInterruptActive & ~active))
+            return 0;
+        // the return address went on the stack
+        r->mType = TRACE_INTERRUPT;
+        r->mPC = aCPU->mPC & 0xffff;
+        memset(r->mCode, 0, 3);
+        r->mWrites = 2;
+        r->mSpace[0] = TRACE_IDATA;
+        r->mSpace[1] = TRACE_IDATA;
+        r->mAddress[0] = (aCPU->mSFR[REG_SP] - 1) & 0xff;
+        r->mAddress[1] = aCPU->mSFR[REG_SP];
+    }
+
+    r->mACC = aCPU->mSFR[REG_ACC];
+    r->mPSW = aCPU->mSFR[REG_PSW];
+    r->mSP = aCPU->mSFR[REG_SP];
+    r->mDPTR = (aCPU->mSFR[REG_DPH] << 8) | aCPU->mSFR[REG_DPL];
+    for (i = 0; i < r->mWrites; i++)
+        r->mValue[i] = written_value(aCPU, r->mSpace[i], r->mAddress[i]);
+    *aRecorded = 1;
+    return ticked;
+}
+
+static int same_record(struct em8051tracerecord *aA, struct em8051tracerecord *aB)
+{
+    int i;
+
+    if (aA->mTicks != aB->mTicks ||
+        aA->mType != aB->mType ||
+        aA->mPC != aB->mPC ||
+        memcmp(aA->mCode, aB->mCode, sizeof(aA->mCode)) != 0 ||
+        aA->mACC != aB->mACC ||
+        aA->mPSW != aB->mPSW ||
+        aA->mSP != aB->mSP ||
+        aA->mDPTR != aB->mDPTR ||
+        aA->mWrites != aB->mWrites)
+        return 0;
+    for (i = 0; i < aA->mWrites; i++)
+    {
+        if (aA->mSpace[i] != aB->mSpace[i] ||
+            aA->mAddress[i] != aB->mAddress[i] ||
+            aA->mValue[i] != aB->mValue[i])
+            return 0;
+    }
+    return 1;
+}
+
+// check a record against the next one in the reference trace, and stop
+// the emulator at the first that differs
+static void compare_record(struct em8051 *aCPU, struct em8051trace *aTrace, struct em8051tracerecord *aRecord)
+{
+    int result;
+
+    if (aTrace->mStatus != TRACE_MATCH)
+        return;
+    result = trace_read(aTrace, &aTrace->mExpected);
+    if (result > 0 && same_record(&aTrace->mExpected, aRecord))
+        return;
+
+    if (result > 0)
+        aTrace->mStatus = TRACE_DIVERGED;
+    else if (result == 0)
+        aTrace->mStatus = TRACE_ENDED;
+    else
+        aTrace->mStatus = TRACE_DAMAGED;
+    aTrace->mActual = *aRecord;
+    aCPU->mStop = 1;
+}
+
+int trace_tick(struct em8051 *aCPU, struct em8051trace *aTrace)
+{
+    struct em8051tracerecord r;
+    int recorded;
+    int ticked;
+
+    ticked = record_tick(aCPU, aTrace, &r, &recorded);
+    if (recorded)
+    {
+        if (aTrace->mWriting)
+            write_record(aTrace, &r);
+        else
+            compare_record(aCPU, aTrace, &r);
+    }
+    return ticked;
+}
+
+int trace_run(struct em8051 *aCPU, struct em8051trace *aTrace, int aCycles, int aBreakpoint)
+{
+    int cycles = 0;
+
+    aCPU->mStop = 0;
+    while (cycles < aCycles)
+    {
+        // power-down mode; nothing runs until reset
+        if (aCPU->mTickDelay <= 1 && (aCPU->mSFR[REG_PCON] & PCON_PD_MASK))
+        {
+            aTrace->mTicks += aCycles - cycles;
+            cycles = aCycles;
+            break;
+        }
+
+        cycles++;
+        if (trace_tick(aCPU, aTrace) && (aCPU->mPC & 0xffff) == aBreakpoint)
+            aCPU->mStop = 1;
+        if (aCPU->mStop)
+            break;
+    }
+    return cycles;
+}
+
+int trace_read(struct em8051trace *aTrace, struct em8051tracerecord *aRecord)
+{
+    unsigned char *p;
+    int i;
+
+    if (aTrace->mPos == aTrace->mFill)
+    {
+        aTrace->mFill = fread(aTrace->mBuffer, 1, TRACE_BUFFER * TRACE_RECORD, aTrace->mFile);
+        aTrace->mPos = 0;
+        if (ferror(aTrace->mFile))
+            return -1;
+        if (aTrace->mFill == 0)
+            return 0;
+    }
+    // a record cut short
+    if (aTrace->mFill - aTrace->mPos < TRACE_RECORD)
+        return -2;
+    p = aTrace->mBuffer + aTrace->mPos;
+    aTrace->mPos += TRACE_RECORD;
+
+    aRecord->mTicks = get_u32(p);
+    aRecord->mPC = get_u16(p + 4);
+    aRecord->mCode[0] = p[6];
+    aRecord->mCode[1] = p[7];
+    aRecord->mCode[2] = p[8];
+    aRecord->mACC = p[9];
+    aRecord->mPSW = p[10];
+    aRecord->mSP = p[11];
+    aRecord->mDPTR = get_u16(p + 12);
+    aRecord->mType = p[14];
+    aRecord->mWrites = p[15];
+    if (aRecord->mWrites > 2)
+        return -2;
+    for (i = 0; i < 2; i++)
+    {
+        aRecord->mAddress[i] = get_u16(p + 16 + i * 4);
+        aRecord->mValue[i] = p[18 + i * 4];
+        aRecord->mSpace[i] = p[19 + i * 4];
+    }
+    return 1;
+}
+
+int trace_status(struct em8051trace *aTrace, struct em8051tracerecord *aExpected, struct em8051tracerecord *aActual)
+{
+    if (aExpected)
+        *aExpected = aTrace->mExpected;
+    if (aActual)
+        *aActual = aTrace->mActual;
+    return aTrace->mStatus;
+}
+
+int trace_format(struct em8051 *aCPU, struct em8051tracerecord *aRecord, char *aBuffer)
+{
+    static const char *space_names[] = { "idata", "sfr", "xdata" };
+    struct em8051 scratch;
+    unsigned char code[4];
+    char assembly[128];
+    int stringpos = 0;
+    int opcode_bytes;
+    int i;
+
+    stringpos += sprintf(aBuffer + stringpos, "%10u  %04X  ", aRecord->mTicks, aRecord->mPC);
+    if (aRecord->mType == TRACE_INTERRUPT)
+    {
+        stringpos += sprintf(aBuffer + stringpos, "%-33s", "interrupt");
+    }
+    else
+    {
+        // decode() the recorded bytes rather than the code memory, which
+        // may hold something else by now; a four byte code memory is
+        // enough, as decode() wraps addresses around its size
+        scratch = *aCPU;
+        for (i = 0; i < 3; i++)
+            code[(aRecord->mPC + i) & 3] = aRecord->mCode[i];
+        scratch.mCodeMem = code;
+        scratch.mCodeMemSize = 4;
+        opcode_bytes = decode(&scratch, aRecord->mPC, (unsigned char*)assembly);
+
+        for (i = 0; i < opcode_bytes; i++)
+            stringpos += sprintf(aBuffer + stringpos, "%02X ", aRecord->mCode[i]);
+        for (i = opcode_bytes; i < 3; i++)
+            stringpos += sprintf(aBuffer + stringpos, "   ");
+        stringpos += sprintf(aBuffer + stringpos, " %-23s", assembly);
+    }
+    stringpos += sprintf(aBuffer + stringpos, " A=%02X PSW=%02X SP=%02X DPTR=%04X",
+        aRecord->mACC, aRecord->mPSW, aRecord->mSP, aRecord->mDPTR);
+    for (i = 0; i < aRecord->mWrites; i++)
+    {
+        stringpos += sprintf(aBuffer + stringpos, " %s[%0*X]=%02X",
+            space_names[aRecord->mSpace[i] % 3],
+            aRecord->mSpace[i] == TRACE_XDATA ? 4 : 2,
+            aRecord->mAddress[i],
+            aRecord->mValue[i]);
+    }
+    return stringpos;
+}
+
+int trace_close(struct em8051trace *aTrace)
+{
+    int result;
+
+    if (aTrace->mWriting)
+        flush(aTrace);
+    if (fclose(aTrace->mFile) != 0)
+        aTrace->mError = 1;
+    result = aTrace->mError ? -1 : 0;
+    free(aTrace->mBuffer);
+    free(aTrace);
+    return result;
+}
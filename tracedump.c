@@ -0,0 +1,123 @@
+/* 8051 emulator
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * tracedump.c
+ * Prints a binary execution trace (see trace.c) as text, one line per
+ * operation, with the operations disassembled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+int main(int parc, char ** pars)
+{
+    struct em8051 emu;
+    struct em8051trace *trace;
+    struct em8051tracerecord record;
+    char line[160];
+    char *tracefile = NULL;
+    unsigned int from = 0;
+    unsigned int count = 0;
+    unsigned int printed = 0;
+    int result;
+    int i;
+
+    for (i = 1; i < parc; i++)
+    {
+        if (pars[i][0] == '-')
+        {
+            if (strncmp("from=",pars[i]+1,5) == 0)
+            {
+                from = strtoul(pars[i]+6, NULL, 10);
+            }
+            else
+            if (strncmp("count=",pars[i]+1,6) == 0)
+            {
+                count = strtoul(pars[i]+7, NULL, 10);
+            }
+            else
+            {
+                printf("Help:\n\n"
+                    "emu8051-tracedump [options] tracefile\n\n"
+                    "Prints a trace written by emu8051-batch -trace. Each line has the\n"
+                    "tick count, the PC, the operation, the registers after it and the\n"
+                    "memory it wrote. Available options:\n\n"
+                    "Option            Alternate   description\n"
+                    "-from=ticks                   Start at the first record at or after ticks\n"
+                    "-count=records                Print at most this many records\n"
+                    );
+                return -1;
+            }
+        }
+        else
+        {
+            tracefile = pars[i];
+        }
+    }
+
+    if (tracefile == NULL)
+    {
+        printf("No file given; try emu8051-tracedump -help\n");
+        return -1;
+    }
+
+    trace = trace_open(tracefile);
+    if (!trace)
+    {
+        printf("File '%s' is not a trace\n", tracefile);
+        return -1;
+    }
+
+    // only for decode()
+    memset(&emu, 0, sizeof(emu));
+    emu.mCodeMem     = malloc(65536);
+    emu.mCodeMemSize = 65536;
+    emu.mExtData     = NULL;
+    emu.mExtDataSize = 0;
+    emu.mLowerData   = malloc(128);
+    emu.mUpperData   = malloc(128);
+    emu.mSFR         = malloc(128);
+    reset(&emu, 1);
+
+    while ((result = trace_read(trace, &record)) > 0)
+    {
+        if (record.mTicks < from)
+            continue;
+        trace_format(&emu, &record, line);
+        printf("%s\n", line);
+        printed++;
+        if (count && printed == count)
+            break;
+    }
+    trace_close(trace);
+
+    if (result < 0)
+    {
+        printf("File '%s' is damaged\n", tracefile);
+        return -1;
+    }
+    return 0;
+}